@@ -0,0 +1,47 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "Types.h"
+#include "HexFile.h"
+#include "Digest.h"
+
+/*
+ * On-disk cache of conditioned images so a flash run can skip the parse.
+ *  <dir>/<digest>-<mcu size>-<erase block>-<boot start>.img
+ *      one per hex file and device profile
+ *  <dir>/profile-<mcu size>-<erase block>-<boot start>.bin
+ *      bootinfo of a device that has been flashed, what the watcher
+ *      conditions new files for
+ *
+ * The cache is host local, fields are in host byte order. An image file
+ * is the header, prg_len bytes of program flash, conf_len bytes of config
+ * data (both 0xff past that) and one erase block of boot page.
+ */
+#define CACHE_MAGIC "UHBIMG"
+#define CACHE_VERSION 1
+#define CACHE_PATH_SIZE 512
+#define CACHE_MAX_PROFILES 16
+
+typedef struct
+{
+  char magic[6];
+  uint16_t version;
+  uint32_t prg_size;
+  uint32_t block_size;
+  uint32_t boot_address;
+  uint32_t prg_mem_count;
+  uint32_t conf_mem_count;
+  uint32_t file_size;
+  uint32_t prg_len;
+  uint32_t conf_len;
+  char digest[DIGEST_HEX_SIZE];
+} __attribute__((packed)) TCacheHeader;
+
+int cache_load(const char *dir, const char *path, TBootInfo *bootinfo, THexImage *image);
+int cache_store(const char *dir, const THexImage *image, const TBootInfo *bootinfo);
+int cache_profile_save(const char *dir, const TBootInfo *bootinfo);
+int cache_profiles(const char *dir, TBootInfo *profiles, int max);
+int cache_warm(const char *dir, const char *path);
+
+#endif
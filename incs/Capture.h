@@ -0,0 +1,54 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "USB.h"
+#include "Session.h"
+
+/*
+ * Record / replay of the interrupt transfer stream.
+ *
+ * Capture file, all fields little endian:
+ *   header  "UHBCAP" | uint16 version | uint64 wall clock ns at open
+ *   record  uint32 us since the previous submit | uint32 us to complete |
+ *           int16 result | uint8 flags | uint16 len | len bytes of report
+ *
+ * result is the byte count or libusb error code the transfer returned,
+ * trailing zero bytes of a report are not stored.
+ */
+#define CAPTURE_MAGIC "UHBCAP"
+#define CAPTURE_VERSION 2
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 13
+#define CAPTURE_FLAG_IN 0x01
+
+typedef struct
+{
+  uint64_t t_us;   // submit time from the start of the capture
+  uint32_t dur_us; // submit to completion
+  int16_t result;
+  uint8_t in;
+  uint16_t len;
+  const uint8_t *data; // into the loaded capture
+} TCaptureRecord;
+
+// capture, every transfer is appended while a file is open
+int capture_open(const char *path);
+void capture_record(uint8_t in, uint64_t submitted_ns, uint64_t done_ns, int result, const char *data, int size);
+void capture_close(void);
+
+/*
+ * Replay, the transport answers from the capture instead of libusb.
+ * OUT reports are checked against the captured ones, IN reports and
+ * result codes are played back after the captured device latency
+ * divided by speed, speed 0 = no delay.
+ */
+int replay_open(const char *path, double speed);
+int replay_active(void);
+int replay_transfer(uint8_t in, char *data, int size);
+int replay_submit(TUsbTransfer *t, uint8_t in, char *data, int size);
+void replay_report_sizes(uint16_t *out_size, uint16_t *in_size);
+int replay_run(TSession *sessions[], int count);
+void replay_close(void);
+
+#endif
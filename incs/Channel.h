@@ -0,0 +1,22 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+#include "USB.h"
+
+/*
+ * OUT channel choice per host and hub. With chAUTO the first board seen
+ * behind a hub writes its first pages over both channels once it is in
+ * boot mode, the faster cmdHEX throughput is used for every board there.
+ * The choice is kept for the run and, with a cache directory, in
+ * <dir>/channel-<host>-<hub>-<report size>.txt.
+ */
+#define CHANNEL_TRIAL_PAGES 2
+#define CHANNEL_MAX_HUBS 16
+
+const char *channel_name(TUsbChannel channel);
+int channel_parse(const char *name, TUsbChannel *channel);
+TUsbChannel channel_select(libusb_device_handle *devh, TUsbChannel wanted, const char *cache_dir, uint16_t out_size);
+TUsbChannel channel_record(libusb_device_handle *devh, const char *cache_dir, uint16_t out_size, const uint64_t bytes[2], const uint64_t ns[2]);
+
+#endif
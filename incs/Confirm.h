@@ -0,0 +1,43 @@
+#ifndef CONFIRM_H
+#define CONFIRM_H
+
+#include <stdint.h>
+#include "USB.h"
+
+#define MAX_CONFIRM_BOARDS 32
+#define CONFIRM_PATH_SIZE 32
+// how often the device list is looked at between hotplug events
+#define CONFIRM_POLL_MS 20
+
+/*
+ * After cmdREBOOT, wait for proof the application came up on each
+ * boards port, either its own vid:pid arriving there or the bootloader
+ * leaving it. Hotplug events are timestamped as libusb delivers them,
+ * also while the boards are still flashing, a poll of the device list
+ * covers hosts without hotplug.
+ */
+typedef struct
+{
+  char path[CONFIRM_PATH_SIZE]; // bus-port.port... of the board
+  uint64_t rebooted_ns;         // cmdREBOOT went out, 0 = not re-booted
+  uint64_t seen_ns;             // confirmed at, 0 = not yet
+} TConfirmBoard;
+
+typedef struct
+{
+  libusb_context *ctx;
+  uint16_t vid;
+  uint16_t pid;
+  uint8_t arrive; // 1 = vid:pid arriving confirms, 0 = vid:pid leaving
+  uint8_t hotplug;
+  libusb_hotplug_callback_handle handle;
+  TConfirmBoard boards[MAX_CONFIRM_BOARDS];
+  int count;
+} TConfirm;
+
+int confirm_open(TConfirm *c, libusb_context *ctx, uint16_t vid, uint16_t pid, uint8_t arrive);
+int confirm_add(TConfirm *c, libusb_device_handle *devh);
+int confirm_wait(TConfirm *c, int timeout_ms);
+void confirm_close(TConfirm *c);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef COORDINATOR_H
+#define COORDINATOR_H
+
+#include <stdint.h>
+#include "Digest.h"
+
+/*
+ * A batch of flash jobs spread over several hosts. The coordinator holds
+ * the batch, workers (mikro_hb --worker) connect over TCP and take one job
+ * at a time, a job being one board flashed with one image. Text lines,
+ * every request gets one reply:
+ *   HELLO <host>               -> WORKER <id>
+ *   NEXT                       -> JOB <job> <digest> <size> | WAIT <ms> | END
+ *   FETCH <digest>             -> IMAGE <digest> <size> and size bytes | MISSING
+ *   DONE <job> <result> <ms>   -> OK
+ * Images are named by their SHA-256 only, a worker keeps what it fetched
+ * in its --cache directory and never asks for a digest twice.
+ *
+ * The batch is sharded by image over the expected workers, each takes
+ * from the head of its own shard and once that is empty steals from the
+ * tail of the fullest one. The jobs of a worker that drops are left to
+ * the others.
+ */
+#define MAX_COORD_JOBS 1024
+#define MAX_COORD_IMAGES 32
+#define MAX_COORD_WORKERS 16
+#define COORD_LINE_SIZE 320
+#define COORD_HOST_SIZE 64
+// NEXT with every job taken but some still running
+#define COORD_WAIT_MS 250
+
+int coordinator_run(const char *address, const char *batch, int shards);
+
+#endif
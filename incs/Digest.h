@@ -0,0 +1,25 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DIGEST_SIZE 32
+#define DIGEST_HEX_SIZE (DIGEST_SIZE * 2 + 1)
+
+// SHA-256, used to identify an image independent of its file name
+typedef struct
+{
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  size_t used;
+} TDigest;
+
+void digest_init(TDigest *d);
+void digest_update(TDigest *d, const void *data, size_t len);
+void digest_final(TDigest *d, uint8_t out[DIGEST_SIZE]);
+void digest_hex(const uint8_t bin[DIGEST_SIZE], char hex[DIGEST_HEX_SIZE]);
+int digest_file(const char *path, char hex[DIGEST_HEX_SIZE]);
+
+#endif
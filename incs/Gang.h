@@ -0,0 +1,55 @@
+#ifndef GANG_H
+#define GANG_H
+
+#include <stdint.h>
+#include "USB.h"
+#include "Session.h"
+#include "Patch.h"
+
+#define MAX_GANG_BOARDS 32
+#define MAX_GANG_HUBS 16
+#define GANG_PATH_SIZE 32
+
+/*
+ * Boards behind one hub share its bandwidth and interrupt polling slots,
+ * the scheduler keeps per hub concurrency at what measured throughput
+ * says the hub can carry and queues the rest.
+ */
+typedef struct
+{
+  char path[GANG_PATH_SIZE]; // bus-port.port... of the hub
+  int speed;                 // libusb speed of its boards
+  int limit;                 // boards flashed at once
+  int active;
+  int done;
+  int best_active;  // concurrency that gave best_rate
+  double best_rate; // aggregate bytes/s measured at best_active
+} TGangHub;
+
+typedef struct
+{
+  TSession *session;
+  libusb_device_handle *devh;
+  char path[GANG_PATH_SIZE]; // bus-port.port... of the board
+  int hub;
+  uint8_t state;   // gsQUEUED, gsACTIVE or gsDONE
+  int concurrency; // most boards active on the hub while this one ran
+  TPatchList patches; // --patch rows whose device is this boards path
+} TGangBoard;
+
+typedef struct
+{
+  TGangBoard boards[MAX_GANG_BOARDS];
+  int board_count;
+  TGangHub hubs[MAX_GANG_HUBS];
+  int hub_count;
+  int hub_max; // upper bound on any hubs limit
+  THexImage base; // parsed once, every patched board takes a view of it
+} TGang;
+
+int gang_open(TGang *g, libusb_context *ctx, uint16_t vid, uint16_t pid, const char *path);
+int gang_run(libusb_context *ctx, TGang *g);
+void gang_close(TGang *g);
+int gang_flash(libusb_context *ctx, uint16_t vid, uint16_t pid, const char *path);
+
+#endif
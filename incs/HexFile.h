@@ -4,19 +4,98 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "USB.h"
+#include "Types.h"
+#include "Digest.h"
 
 #define V2P 0x1FFFFFFF
 
 #define MZ1024 0x100000
 #define MZ2048 0x200000
 
+// configuration data buffer size
+#define CONF_BUFFER_SIZE 0xffff
+
+// longest converted line, 255 data bytes plus header and checksum
+#define HEX_LINE_BYTES 264
+
+// hex files composed into one image, the first plus overlays
+#define MAX_HEX_FILES 8
+
+typedef struct THexWindow THexWindow;
+typedef struct TSharedImage TSharedImage;
+
+// image buffer a flash region is read from
+typedef enum
+{
+  hsPRG = 0, // program flash
+  hsBOOT,    // boot start up page
+  hsCONF     // configuration data
+} THexSource;
+
+// which of an image's buffers free_hex_image() releases
+#define IMAGE_OWNS_PRG 0x01
+#define IMAGE_OWNS_CONF 0x02
+#define IMAGE_OWNS_BOOT 0x04
+#define IMAGE_OWNS_ALL (IMAGE_OWNS_PRG | IMAGE_OWNS_CONF | IMAGE_OWNS_BOOT)
+
+/*
+ * Conditioned image of a hex file, filled once by condition_hexfile_data()
+ * and only read from there on.
+ *  prg  = program flash, ulMcuSize bytes
+ *  conf = configuration data with the bootloaders start up line in place
+ *  boot = boot start up page, the applications start up line in the last 16 bytes
+ *
+ * A view made by hex_image_share() reads the base image's buffers, any
+ * erase block patched for one device is copied into prg_blocks first.
+ * With a window prg is NULL and blocks are parsed as they are read.
+ * A shared image maps another process's buffers read-only.
+ */
+typedef struct
+{
+  uint8_t *prg;
+  uint8_t *conf;
+  uint8_t *boot;
+  uint32_t prg_mem_count;
+  uint32_t conf_mem_count;
+  uint32_t file_size;
+  char digest[DIGEST_HEX_SIZE]; // sha256 of the hex file
+
+  uint32_t prg_size;     // ulMcuSize
+  uint32_t block_size;   // erase block, unit of copy on write
+  uint32_t boot_address; // physical address of the boot start up page
+  uint8_t owned;         // IMAGE_OWNS_* bits
+  uint8_t **prg_blocks;  // per erase block copy, NULL = read prg
+  THexWindow *window;    // bounded memory, NULL = prg holds the image
+  TSharedImage *shared;  // host wide segment the buffers map, NULL = none
+} THexImage;
+
+// where hex_record_apply() is up to in a file
+typedef struct
+{
+  uint32_t root_address;
+  uint32_t prg_mem_last;
+  uint32_t prg_mem_count;
+  uint32_t conf_mem_count;
+  uint32_t rejected; // data records outside the image buffers, never written
+} THexCursor;
+
 void bootInfo_buffer(void *boot_info, const void *buffer);
-void setupChiptoBoot(struct libusb_device_handle *devh, char *path);
+int hex_image_alloc(THexImage *image, TBootInfo *bootinfo);
+void hex_line_decode(const char *text, uint8_t *line, size_t size);
+uint8_t hex_record_locate(const uint8_t *line, THexCursor *cursor, uint32_t *address, uint8_t *count);
+uint8_t hex_record_apply(THexImage *image, uint8_t *line, THexCursor *cursor);
+void overwrite_bootflash_program(THexImage *image, TBootInfo *bootinfo);
+uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo, THexImage *image);
+uint32_t compose_hexfile_data(const char *paths[], int count, TBootInfo *bootinfo, THexImage *image);
+void free_hex_image(THexImage *image);
+void hex_image_share(THexImage *image, const THexImage *base);
+uint8_t *hex_image_data(const THexImage *image, THexSource source, uint32_t offset);
+uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity);
 
 // function prototypes file handling
-void load_hex_buffer(char *data, uint16_t iterable);
+void load_hex_buffer(char *data, uint8_t **src, uint16_t iterable);
 uint32_t file_byte_count(FILE *fp);
-void file_extract_line(FILE *fp, char *buf, int fp_result);
+int file_extract_line(FILE *fp, char *buf, int fp_result);
 int16_t get_data_array(FILE *fp, uint8_t *bytes);
 
-#endif
\ No newline at end of file
+#endif
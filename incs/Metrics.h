@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Line level flashing statistics in Prometheus text format.
+ * Counters are plain uint64_t updated with relaxed atomics so the
+ * session and transfer paths never take a lock, one slot per
+ * device profile / image digest label pair.
+ */
+#define METRICS_SLOTS 16
+#define METRICS_LABEL_SIZE 24
+#define METRICS_FLASH_BUCKETS 10
+
+typedef enum
+{
+  failTIMEOUT = 0,
+  failNO_DEVICE,
+  failSTALL,
+  failIO,
+  failIMAGE,
+  failOTHER,
+  failCOUNT
+} TFailReason;
+
+typedef struct
+{
+  int state; // 0 = free, 1 = being claimed, 2 = ready
+  char profile[METRICS_LABEL_SIZE];
+  char digest[METRICS_LABEL_SIZE];
+  uint64_t boards_ok;
+  uint64_t boards_failed[failCOUNT];
+  uint64_t bytes_written;
+  uint64_t duration_buckets[METRICS_FLASH_BUCKETS];
+  uint64_t duration_count;
+  uint64_t duration_sum_us;
+
+  // after re-boot, see confirm_wait()
+  uint64_t confirmed;
+  uint64_t unconfirmed;
+  uint64_t enumerate_buckets[METRICS_FLASH_BUCKETS];
+  uint64_t enumerate_count;
+  uint64_t enumerate_sum_us;
+  uint64_t cycle_buckets[METRICS_FLASH_BUCKETS];
+  uint64_t cycle_count;
+  uint64_t cycle_sum_us;
+} TMetricsSlot;
+
+void metrics_init(const char *fixture);
+int metrics_slot(const char *profile, const char *digest);
+TFailReason metrics_fail_reason(int result);
+void metrics_board_done(int slot, int result, TFailReason reason, uint64_t duration_ns, uint64_t bytes);
+void metrics_board_confirmed(int slot, int confirmed, uint64_t enumerate_ns, uint64_t cycle_ns);
+void metrics_transfer(uint8_t in, int result);
+void metrics_render(FILE *fp);
+int metrics_write_textfile(const char *path);
+int metrics_listen(const char *address);
+
+#endif
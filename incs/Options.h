@@ -0,0 +1,76 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdint.h>
+#include "Watch.h"
+#include "HexFile.h"
+#include "Region.h"
+
+// command line options, filled once by parse_options()
+typedef struct
+{
+  char path[250]; // hex file to load
+  char overlays[MAX_HEX_FILES - 1][250]; // hex files laid over path in order
+  int overlay_count;
+
+  // real-time transfer thread
+  uint8_t rt;      // run the transfer path on its own SCHED_FIFO thread
+  int rt_priority; // SCHED_FIFO priority 1..99
+  int rt_cpu;      // cpu to pin the thread to, -1 = leave affinity alone
+
+  // prometheus metrics
+  char metrics_listen[64]; // [ip:]port for the http listener
+  char metrics_file[250];  // node_exporter textfile to update
+  char fixture[32];        // fixture label, defaults to the host name
+
+  // record / replay of the usb transfer stream
+  char capture[250];   // write every transfer to this file
+  char replay[250];    // answer transfers from this capture, no device needed
+  double replay_speed; // 1 = captured device latency, 0 = no delay
+
+  // per device patching of the conditioned image
+  char patch[250];       // csv of device,address,bytes[,crc_start,crc_end,crc_at]
+  char patch_device[32]; // rows for this device, * rows always apply
+
+  // targeted update
+  uint32_t range_start;             // first address of --range
+  uint32_t range_end;               // exclusive, 0 = no range
+  char region[REGION_NAME_SIZE];    // program, boot or config, "" = all
+
+  TUsbChannel out_channel; // interrupt, control or auto
+  uint32_t probe;          // SYNC round trips to time, 0 = flash
+
+  // wait for the application after cmdREBOOT
+  uint8_t confirm;
+  uint16_t confirm_vid;  // application vid:pid to arrive, 0 = the bootloader leaving
+  uint16_t confirm_pid;
+  int confirm_timeout;   // ms
+
+  char progress[64]; // shared memory segment live progress is published to, "" = none
+
+  // batches spread over hosts, path is the batch file when coordinating
+  char coordinate[64]; // [ip:]port to hand jobs out on, "" = not the coordinator
+  int workers;         // workers the batch is sharded over up front
+  char worker[64];     // ip:port of the coordinator to take jobs from
+
+  uint8_t parse_thread; // parse the hex on its own thread while flashing
+  uint8_t validate;     // pre-flight check of the hex before erasing
+  int window;           // erase blocks held when parsing on demand, 0 = whole image
+
+  // gang programming of every attached bootloader
+  uint8_t gang;
+  int gang_hub_max; // most boards flashed at once behind one hub
+
+  // conditioned image cache
+  uint8_t shared;                    // one parsed copy per image for every process on the host
+  char cache[250];                   // cache directory, "" = no cache
+  char watch[MAX_WATCH_DIRS][250];   // build output directories to pre-warm from
+  int watch_count;
+} TOptions;
+
+extern TOptions options;
+
+int parse_options(int argc, char **argv);
+void print_usage(const char *prog);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdint.h>
+#include "HexFile.h"
+
+#define PATCH_MAX_DATA 64
+#define PATCH_DEVICE_SIZE 32
+
+/*
+ * One per device record, serial number, MAC, calibration block...
+ * crc_end > crc_start asks for a CRC-32 of [crc_start, crc_end) to be
+ * stored little endian at crc_at once the bytes are in place.
+ * Addresses are virtual or physical, they are masked with V2P.
+ */
+typedef struct
+{
+  char device[PATCH_DEVICE_SIZE]; // "*" = every device
+  uint32_t address;
+  uint16_t len;
+  uint8_t data[PATCH_MAX_DATA];
+  uint32_t crc_start;
+  uint32_t crc_end;
+  uint32_t crc_at;
+} TPatch;
+
+/*
+ * Patch source, fill patch with record index.
+ * return: 1 = filled, 0 = no more records, < 0 on failure
+ */
+typedef int (*TPatchSource)(void *user, int index, TPatch *patch);
+
+typedef struct
+{
+  TPatch *items;
+  int count;
+} TPatchList;
+
+int patch_image(THexImage *image, TPatchSource next, void *user);
+int patch_csv_load(const char *path, const char *device, TPatchList *list);
+int patch_list_next(void *user, int index, TPatch *patch);
+void patch_list_free(TPatchList *list);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "Types.h"
+#include "HexFile.h"
+
+/*
+ * Parse-while-flashing, a parser thread fills the image while the
+ * session erases and writes. An address index prepass records the last
+ * line that touches each erase block, once the parser is past that line
+ * the block can't change and is published to the session through a
+ * single producer / single consumer ring, an eventfd wakes the
+ * session's event loop on every block and when the parse is done.
+ */
+typedef struct
+{
+  uint32_t line;  // last line touching the block, 0 = none
+  uint32_t block; // erase block index into prg
+} THexRelease;
+
+typedef struct
+{
+  THexImage *image;
+  TBootInfo bootinfo;
+  char path[250];
+  pthread_t thread;
+  uint8_t running; // thread started and not joined yet
+  int result;      // 0 or -1 once the parser is done
+
+  // prepass index, blocks in the order they become final
+  uint32_t block_count;
+  THexRelease *release;
+
+  // parser -> session ring, sized so the parser never finds it full
+  uint32_t *ring;
+  uint32_t ring_mask;
+  uint32_t head; // written by the parser only
+  uint32_t tail; // written by the session only
+  int done;      // parser finished, boot page and config are final
+  int event_fd;  // signalled by the parser, -1 = not started
+
+  uint8_t *ready;   // session side, blocks taken off the ring
+  uint8_t *touched; // prepass, blocks some record writes to
+} THexPipeline;
+
+void hex_pipeline_init(THexPipeline *p);
+uint32_t hex_pipeline_start(THexPipeline *p, const char *path, TBootInfo *bootinfo, THexImage *image);
+int hex_pipeline_ready(THexPipeline *p, THexSource source, uint32_t offset, uint32_t size);
+int hex_pipeline_touched(const THexPipeline *p, uint32_t offset, uint32_t size);
+void hex_pipeline_drain(THexPipeline *p);
+int hex_pipeline_finish(THexPipeline *p);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+#include "USB.h"
+
+// a probe gives up after this many failed round trips in a row
+#define PROBE_MAX_FAILURES 8
+
+/*
+ * Link health, count cmdSYNC round trips through the blocking transfer
+ * path after the INFO / BOOT / SYNC handshake, nothing is erased or
+ * written and the board is re-booted back to its application after.
+ */
+int probe_run(libusb_device_handle *devh, uint32_t count);
+
+#endif
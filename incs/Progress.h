@@ -0,0 +1,61 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+
+/*
+ * Live session progress in a POSIX shared memory segment, one slot per
+ * board. Every slot has a single writer, the thread driving its session,
+ * and is guarded by a sequence count: odd while an update is being
+ * written, readers copy the slot and retry when the count moved.
+ * Neither side takes a lock or makes a syscall per update.
+ */
+#define PROGRESS_MAGIC 0x4d4b4850 // "PHKM" little endian
+#define PROGRESS_VERSION 2
+#define MAX_PROGRESS_SLOTS 32
+#define PROGRESS_NAME_SIZE 64
+#define PROGRESS_PATH_SIZE 32
+#define PROGRESS_PHASE_SIZE 12
+// a reader gives up on a slot whose writer died mid update
+#define PROGRESS_READ_TRIES 1000
+
+typedef struct
+{
+  char path[PROGRESS_PATH_SIZE];   // bus-port.port... of the board
+  char phase[PROGRESS_PHASE_SIZE]; // session state name
+  uint32_t address;       // last erase or write address sent
+  int32_t result;         // libusb error code the session ended on
+  uint8_t done;           // the session has finished
+  uint64_t bytes_done;    // image bytes streamed
+  uint64_t bytes_total;   // image bytes to stream, 0 = not planned yet
+  uint64_t rate;          // bytes/s since the session started
+  uint64_t updated_ns;    // monotonic ns of this update
+} TProgress;
+
+typedef struct
+{
+  uint32_t seq; // even = stable
+  uint32_t reserved;
+  TProgress progress;
+} __attribute__((aligned(64))) TProgressSlot; // slots don't share a cache line
+
+typedef struct
+{
+  uint32_t magic; // stored last, a reader ignores the segment until it's set
+  uint32_t version;
+  int32_t pid;    // writing process, a live one keeps the name
+  uint32_t count; // slots claimed
+  TProgressSlot slots[MAX_PROGRESS_SLOTS];
+} TProgressShm;
+
+// writer
+int progress_open(const char *name);
+int progress_slot(const char *path);
+void progress_publish(int slot, const TProgress *progress);
+
+// reader
+const TProgressShm *progress_attach(const char *name);
+int progress_read(const TProgressShm *shm, int slot, TProgress *progress);
+void progress_detach(const TProgressShm *shm);
+
+#endif
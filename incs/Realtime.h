@@ -0,0 +1,10 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "USB.h"
+#include "Session.h"
+
+// run session_run() on a dedicated SCHED_FIFO thread, see options.rt
+int realtime_run(libusb_context *ctx, TSession *sessions[], int count);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdint.h>
+#include "Types.h"
+#include "HexFile.h"
+#include "Pipeline.h"
+
+#define MAX_REGIONS 8
+#define REGION_NAME_SIZE 16
+
+// erase policy
+typedef enum
+{
+  erNONE = 0, // write only, the blocks are known to be blank
+  erBLOCKS    // erase erase_blocks from erase_address down before writing
+} TRegionErase;
+
+typedef struct TRegion TRegion;
+
+/*
+ * Patch hook, called once when the session reaches the region and the
+ * bytes it reads are final, may change them through the image.
+ * return: 0 on success, < 0 to fail the session
+ */
+typedef int (*TRegionHook)(TRegion *region, THexImage *image, void *user);
+
+/*
+ * One flash region, size bytes from offset into an image buffer are
+ * written page_size bytes per cmdWRITE starting at base.
+ */
+struct TRegion
+{
+  char name[REGION_NAME_SIZE];
+  THexSource source;
+  uint32_t offset;     // first byte in the source buffer
+  uint32_t base;       // physical address of offset
+  uint32_t size;       // whole pages
+  uint32_t page_size;  // bytes per cmdWRITE, whole reports
+  TRegionErase erase;
+  uint32_t erase_address; // MikroC erases from the top down
+  uint16_t erase_blocks;
+  int order;           // lowest is flashed first
+  TRegionHook hook;    // NULL = none
+  void *hook_user;
+};
+
+typedef struct
+{
+  TRegion items[MAX_REGIONS];
+  int count;
+} TRegionList;
+
+// --range / --region, physical or virtual addresses
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;                // exclusive, 0 = no range
+  char name[REGION_NAME_SIZE]; // "" = any region
+} TRegionSelect;
+
+int region_add(TRegionList *list, const TRegion *region);
+int region_plan(TRegionList *list, const THexImage *image, const TBootInfo *bootinfo);
+void region_sort(TRegionList *list);
+int region_select(TRegionList *list, const TRegionSelect *select);
+int region_changed(const TRegion *region, const THexImage *image, const THexPipeline *pipeline);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include "USB.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Stats.h"
+#include "Patch.h"
+#include "Pipeline.h"
+#include "Region.h"
+#include "Stream.h"
+#include "Confirm.h"
+#include "Progress.h"
+
+/*
+ * Events that drive a session, session_step() never blocks,
+ * it frames the next packet, queues the transfer and returns.
+ */
+typedef enum
+{
+  evSTART = 0, // begin the UHB sequence
+  evOUT_DONE,  // OUT report has gone out
+  evIN_DONE,   // IN report has come back
+  evTIMEOUT,   // session deadline expired
+  evERROR,     // transfer failed, error code in result
+  evREADY      // a stalled state may be able to go on
+} TSessionEvent;
+
+/*
+ * One bootloader session per device, everything the state machine
+ * needs lives in here so any number of sessions can share a thread.
+ */
+typedef struct
+{
+  libusb_device_handle *devh;
+  char path[250];
+
+  TCmd tcmd;          // current state
+  TCmd last_tcmd;     // last state announced
+  uint8_t out_only;   // 0 = wait for ack, 1 = stream, 2 = reboot
+  int result;         // zero on success, libusb error code on failure
+  uint8_t image_failed; // the hex failed, not the board, see metrics_board_done()
+  int64_t deadline;   // monotonic ms the pending transfer must finish by, -1 = none
+  uint8_t pending;    // transfers in flight
+
+  TBootInfo bootinfo;
+  THexImage image;
+  THexImage *base;       // conditioned once for every board, the first here parses it, NULL = none
+  TPatchSource patch;    // per device records, NULL = none
+  void *patch_user;
+  uint8_t parse_thread;  // parse the hex while erasing / writing
+  uint8_t validate;      // hex_validate() the file before the first erase
+  uint8_t stalled;       // waiting on the parser, no transfer pending
+  int epfd;              // event loop the parser wakes, -1 = none
+  uint32_t window;       // erase blocks held, 0 = the whole image
+  THexPipeline pipeline;
+  const char *overlays[MAX_HEX_FILES - 1]; // composed over path, later wins
+  int overlay_count;
+  TRegionSelect select;  // --range / --region, zeroed = everything
+  const char *cache_dir; // conditioned image cache, NULL = none
+  uint8_t cache_hit;     // image came from the cache
+  uint8_t shared;        // map the image another process parsed, or publish it
+
+  // flash regions in write order, walked without going back through cmdNON
+  TRegionList regions;
+  int region_index;       // region being loaded
+  uint8_t region_entered; // its patch hook has run
+  uint8_t *src;
+  uint32_t bootaddress_space;
+  uint32_t pages_to_flash;
+  uint32_t page_tracking;
+  uint16_t hex_load_limit;
+  uint16_t hex_load_tracking;
+
+  // compiled reports from the first erase on, replaces the region walk
+  TPacketStream *stream; // NULL = frame each report in data_out
+  uint8_t streaming;     // past cmdSYNC and sending from stream
+  uint8_t stream_publish; // compile one at the end for boards still to come
+  uint32_t packet;       // next report in stream
+  char *frame;           // report session_submit() sends, data_out or in stream
+
+  TUsbTransfer xfer_out;
+  TUsbTransfer xfer_in;
+  TUsbTransfer xfer_queue[CONTROL_QUEUE_DEPTH]; // unacknowledged control reports
+  uint8_t queue_busy;     // bit per xfer_queue slot in flight
+  uint8_t queued;         // slots in flight
+  uint8_t queue_wait;     // next report waits for a slot
+  TLatencyStats latency; // submit to completion of every transfer
+  uint64_t opened;        // monotonic ns of session_init(), the bootloader is up
+  uint64_t started;       // monotonic ns of evSTART
+  uint64_t rebooted;      // monotonic ns cmdREBOOT was sent, 0 = not yet
+  int metrics_slot;       // fixture / profile / digest line, set when done
+  uint64_t bytes_written; // image bytes streamed
+  uint64_t bytes_total;   // image bytes to stream, known from cmdSYNC on
+  int progress_slot;      // --progress slot, -1 = not published
+  TProgress progress;     // as last published
+  TUsbChannel channel;  // how OUT reports are sent, chAUTO = trial from evSTART
+  uint8_t channel_trial;  // first pages timed on each channel in turn
+  uint32_t trial_pages;   // pages timed so far
+  uint64_t trial_bytes[2]; // cmdHEX bytes sent per channel
+  uint64_t trial_ns[2];    // time in those pages per channel
+  uint64_t page_started;  // monotonic ns the current pages cmdWRITE was framed
+  uint16_t report_out; // negotiated OUT report, bytes per transfer
+  uint16_t report_in;  // negotiated IN report
+  char data_in[MAX_INTERRUPT_REPORT_SIZE];
+  char data_out[MAX_INTERRUPT_REPORT_SIZE];
+} TSession;
+
+int session_init(TSession *s, libusb_device_handle *devh, const char *path);
+void session_configure(TSession *s);
+void session_free(TSession *s);
+int session_step(TSession *s, TSessionEvent ev);
+int session_done(const TSession *s);
+int64_t session_deadline(const TSession *s);
+
+// --confirm, proof the application came up after cmdREBOOT
+int session_confirm_open(TConfirm *c, libusb_context *ctx, uint16_t vid, uint16_t pid);
+int session_confirmed(TSession *s, const TConfirmBoard *board);
+
+// event loop helpers, libusb_get_pollfds() registered into an epoll set
+int session_epoll_register(libusb_context *ctx, int epfd);
+void session_epoll_unregister(libusb_context *ctx);
+int session_poll_timeout(libusb_context *ctx, TSession *sessions[], int count);
+void session_poll_deadlines(TSession *sessions[], int count);
+int session_run(libusb_context *ctx, TSession *sessions[], int count);
+
+int session_flash(libusb_device_handle *devh, const char *path, THexImage *base, const char *device);
+void setupChiptoBoot(struct libusb_device_handle *devh, char *path);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "Types.h"
+#include "HexFile.h"
+#include "Cache.h"
+
+/*
+ * Conditioned images shared between mikro_hb processes on one host, one
+ * POSIX shared memory segment per hex digest and device profile:
+ *  /mikro_hb-<digest>-<mcu size>-<erase block>-<boot start>
+ * The first process to open it parses the file and publishes program
+ * flash, config data and boot page, later ones map them read-only and
+ * skip the parse. flock() on the segment serializes publish, attach and
+ * release, so a process arriving mid parse waits for the result rather
+ * than parsing again. The pids mapping it are listed in the header, the
+ * last to leave, or the first to find the rest gone, unlinks it.
+ */
+#define SHARED_MAGIC "UHBSHM"
+#define SHARED_VERSION 1
+#define SHARED_NAME_SIZE 128
+#define SHARED_MAX_USERS 64
+// the header page is written, the image after it is mapped read-only
+#define SHARED_HEADER_SIZE 4096
+// where shm_open() names live, to tell whether a name still is this segment
+#define SHARED_SHM_DIR "/dev/shm"
+// opens that found the name unlinked under them before giving up
+#define SHARED_OPEN_TRIES 4
+
+typedef struct
+{
+  char magic[6];
+  uint16_t version;
+  uint32_t ready;       // image complete, 0 = the publisher died mid write
+  uint32_t user_count;
+  pid_t users[SHARED_MAX_USERS];
+  TCacheHeader image;   // prg_len = prg_size, conf_len = CONF_BUFFER_SIZE
+} TSharedHeader;
+
+struct TSharedImage
+{
+  int fd;
+  char name[SHARED_NAME_SIZE];
+  TSharedHeader *header;
+  uint8_t *data;        // prg, conf, boot page, PROT_READ
+  size_t data_size;
+};
+
+int shared_open(TSharedImage **shared, const char *digest, const TBootInfo *bootinfo, THexImage *image);
+int shared_publish(TSharedImage *shared, THexImage *image);
+void shared_release(TSharedImage *shared);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Fixed size log-linear latency histogram, values below 64us land in
+ * 1us buckets, above that each power of two is split 32 ways (~3%).
+ * Nothing is allocated so it can be updated from the transfer path.
+ */
+#define LATENCY_BUCKETS 512
+
+typedef struct
+{
+  uint32_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t sum_ns;
+  double sum_sq_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+} TLatencyStats;
+
+void latency_reset(TLatencyStats *st);
+void latency_add(TLatencyStats *st, uint64_t ns);
+void latency_merge(TLatencyStats *dst, const TLatencyStats *src);
+uint64_t latency_percentile(const TLatencyStats *st, double pct);
+double latency_stddev(const TLatencyStats *st);
+void latency_print(const char *label, const TLatencyStats *st);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include "Types.h"
+#include "HexFile.h"
+#include "Region.h"
+
+#define MAX_STREAMS 8
+#define STREAM_KEY_SIZE 160
+
+/*
+ * Every report from the first erase to the re-boot, framed once for an
+ * image and device profile and sent as is by any number of sessions.
+ * Report i is frames + i * report_size, its mark is what the session
+ * does after sending it.
+ */
+typedef struct
+{
+  uint8_t cmd;      // TCmd the report belongs to
+  uint8_t out_only; // 0 = an IN report acks it, 1 = next report straight away, 2 = re-boot
+} TStreamMark;
+
+typedef struct
+{
+  char key[STREAM_KEY_SIZE]; // digest, profile, report size and selection
+  char *frames;
+  TStreamMark *marks;
+  uint32_t count;
+  uint16_t report_size;
+  int refs;
+} TPacketStream;
+
+void stream_key(char *key, size_t size, const char *digest, const TBootInfo *bootinfo, uint16_t report_size, const TRegionSelect *select);
+int stream_shared(void);
+TPacketStream *stream_find(const char *key);
+TPacketStream *stream_compile(const char *key, const TRegionList *regions, const THexImage *image, uint16_t report_size);
+void stream_release(TPacketStream *stream);
+
+#endif
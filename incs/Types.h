@@ -8,6 +8,7 @@
 // Boot flash size can be aquired after a compiation of Boot firmware in MikroC Pro
 #define __BOOT_FLASH_SIZE 0x9858
 extern const uint32_t _PIC32Mn_STARTFLASH;
+extern const uint32_t _PIC32Mn_STARTCONF;
 
 // Supported MCU families/types.
 enum TMcuType
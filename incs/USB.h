@@ -2,14 +2,59 @@
 #define USB_H
 
 #include <libusb-1.0/libusb.h>
+#include "Types.h"
 
 #define MAX_CONTROL_IN_TRANSFER_SIZE 64
 #define MAX_CONTROL_OUT_TRANSFER_SIZE 64
 #define MAX_INTERRUPT_IN_TRANSFER_SIZE 64
 #define MAX_INTERRUPT_OUT_TRANSFER_SIZE 64
 
+// largest report boot_report_negotiate() will settle on, multi-packet above wMaxPacketSize
+#define MAX_INTERRUPT_REPORT_SIZE 4096
+
+// deepest usb port path libusb_get_port_numbers() reports
+#define MAX_PORT_DEPTH 7
+
 extern const int INTERFACE_NUMBER;
+extern const int TIMEOUT_MS;
+
+// how OUT reports reach the device, IN always comes back on the interrupt endpoint
+typedef enum
+{
+  chINTERRUPT = 0, // interrupt OUT endpoint, one report per polling interval
+  chCONTROL,       // HID SET_REPORT control transfer on endpoint 0
+  chAUTO           // whichever streams faster, see channel_record()
+} TUsbChannel;
+
+// control OUT reports of a cmdHEX burst queued on endpoint 0 at once
+#define CONTROL_QUEUE_DEPTH 4
+
+/*
+ * Asynchronous transfer handle, done() is called from inside
+ * libusb_handle_events*() with the number of bytes transferred
+ * or a libusb error code.
+ */
+typedef struct TUsbTransfer TUsbTransfer;
+typedef void (*TUsbDone)(TUsbTransfer *t, int result);
+
+struct TUsbTransfer
+{
+  struct libusb_transfer *xfer;
+  TUsbDone done;
+  void *user_data;
+  uint64_t submitted; // monotonic ns the transfer was queued
+  unsigned char *setup; // control transfers, setup packet + report
+};
 
 // function prototypes usb handling
+void boot_frame_command(char *data_out, TCmd cmd, uint16_t size);
+int boot_report_negotiate(libusb_device_handle *devh, uint16_t *out_size, uint16_t *in_size);
 int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *data_out, uint8_t out_only);
-#endif
\ No newline at end of file
+void boot_transfer_trace(uint8_t on);
+int boot_transfer_alloc(TUsbTransfer *t, TUsbDone done, void *user_data);
+void boot_transfer_free(TUsbTransfer *t);
+int boot_interrupt_submit(TUsbTransfer *t, libusb_device_handle *devh, uint8_t in, char *data, uint16_t size);
+int boot_control_submit(TUsbTransfer *t, libusb_device_handle *devh, char *data, uint16_t size);
+int boot_transfer_cancel(TUsbTransfer *t);
+void boot_device_topology(libusb_device *dev, char *board, char *hub, size_t size);
+#endif
@@ -6,5 +6,7 @@ uint16_t swap_wordbytes(uint16_t wb);
 uint8_t transform_char_bin(unsigned char c);
 uint8_t transform_2chars_1bin(uint8_t var[]);
 uint32_t transform_2words_long(uint16_t a, uint16_t b);
+uint64_t time_now_ms(void);
+uint64_t time_now_ns(void);
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <stdint.h>
+#include "Types.h"
+#include "HexFile.h"
+
+// data record extent, [start, end) physical
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+  uint32_t line;
+  const char *data; // the records data digits in the mapped file
+} THexInterval;
+
+int hex_validate(const char *path, const TBootInfo *bootinfo);
+int hex_validate_window(const char *path, const TBootInfo *bootinfo, THexWindow *w);
+
+#endif
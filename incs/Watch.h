@@ -0,0 +1,8 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#define MAX_WATCH_DIRS 8
+
+int watch_run(char dirs[][250], int count, const char *cache_dir);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "Types.h"
+#include "HexFile.h"
+
+/*
+ * Bounded memory image, program flash is never held whole. One pass over
+ * the file indexes, per erase block, the runs of lines that write to it,
+ * a block is parsed from its runs into one of a few slots when the
+ * session first reads it and dropped again once the slot is reused.
+ * Peak memory is the slots, one config row, the boot page and the index,
+ * whatever the size of the chip or the file. The file is read again for
+ * every block, a block is refused once the file differs from the one
+ * that was indexed and digested.
+ */
+#define WINDOW_NO_BLOCK UINT32_MAX
+
+typedef struct
+{
+  uint32_t block;  // erase block index into program flash
+  uint32_t offset; // file offset of the first line
+  uint32_t end;    // file offset past the last line
+  uint32_t root;   // extended address in force at offset
+  uint32_t line;   // line number at offset, for validation reports
+} THexRun;
+
+struct THexWindow
+{
+  FILE *fp;
+  struct stat st;       // the file as indexed, size and mtime are checked before a re-read
+  THexRun *runs;        // sorted by block, file order within one
+  uint32_t run_count;
+  uint32_t run_cap;
+  uint32_t block_size;
+  uint32_t prg_size;
+  uint8_t *slots;       // slot_count erase blocks
+  uint32_t *slot_block; // block each slot holds, UINT32_MAX = none
+  uint32_t slot_count;
+  uint32_t next_slot;   // reused next, round robin
+  uint32_t parsed;      // blocks materialized, a block read twice counts twice
+};
+
+uint32_t hex_window_open(THexImage *image, const char *path, TBootInfo *bootinfo, uint32_t slots);
+uint8_t *hex_window_block(THexWindow *w, uint32_t block);
+int hex_window_touched(const THexWindow *w, uint32_t offset, uint32_t size);
+int hex_window_unchanged(const THexWindow *w);
+void hex_window_free(THexWindow *w);
+
+#endif
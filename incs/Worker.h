@@ -0,0 +1,16 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include "USB.h"
+
+// how often a worker looks for the next board
+#define WORKER_POLL_MS 200
+// a flashed board comes back as the bootloader for its start up window
+#define WORKER_STARTUP_MS 5000
+#define WORKER_PATH_SIZE 32
+#define WORKER_MAX_RECENT 16
+
+int worker_run(libusb_context *ctx, const char *address, uint16_t vid, uint16_t pid);
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * Bench.c
+ *
+ * Microbenchmarks for the parsing, validation and packet paths, built with make bench.
+ *   mikro_hb_bench [--json <path>] [--time-ms <n>] [hex files...]
+ * Synthetic hex files are generated for every run, any files given are
+ * benchmarked as well. Allocations are counted by wrapping malloc,
+ * calloc and realloc at link time so only this programs own calls count.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "Types.h"
+#include "HexFile.h"
+#include "Utils.h"
+#include "USB.h"
+#include "Validate.h"
+#include "Region.h"
+#include "Stream.h"
+
+#define BENCH_CHARS 4096
+#define BENCH_MAX_RESULTS 64
+#define BENCH_LINE_BYTES 300
+#define BENCH_MIN_BATCHES 3
+
+typedef struct
+{
+    const char *name;
+    char input[64];
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+} TBenchResult;
+
+// runs one batch, returns the ops done and the bytes they covered
+typedef uint64_t (*TBenchFn)(void *ctx, uint64_t *bytes);
+
+typedef struct
+{
+    char path[250];
+    uint32_t size;
+    uint32_t lines;
+    FILE *fp;
+    TBootInfo bootinfo;
+    THexImage image;     // conditioned once for stream_compile
+    TRegionList regions;
+} TBenchFile;
+
+static TBenchResult results[BENCH_MAX_RESULTS];
+static int result_count = 0;
+static uint64_t bench_min_ns = 200000000ull;
+static volatile uint32_t sink = 0;
+
+static uint64_t bench_allocs = 0;
+static uint64_t bench_alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+// Time fn in batches until bench_min_ns has passed.
+static void bench_run(const char *name, const char *input, TBenchFn fn, void *ctx)
+{
+    TBenchResult *r = &results[result_count];
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+    uint64_t bytes = 0;
+    uint64_t start = 0;
+    int batches = 0;
+
+    if (result_count == BENCH_MAX_RESULTS)
+        return;
+
+    memset(r, 0, sizeof(TBenchResult));
+    r->name = name;
+    snprintf(r->input, sizeof(r->input), "%s", input);
+
+    // warm the caches, the first batch isn't counted
+    fn(ctx, &bytes);
+
+    allocs = bench_allocs;
+    alloc_bytes = bench_alloc_bytes;
+    start = time_now_ns();
+    do
+    {
+        r->ops += fn(ctx, &bytes);
+        r->bytes += bytes;
+        batches++;
+        r->ns = time_now_ns() - start;
+    } while (r->ns < bench_min_ns || batches < BENCH_MIN_BATCHES);
+    r->allocs = bench_allocs - allocs;
+    r->alloc_bytes = bench_alloc_bytes - alloc_bytes;
+
+    printf("%-24s %-20s %12.1f ns/op %10.1f MB/s %8.2f allocs/op %10.0f B/op\n",
+           r->name, r->input, (double)r->ns / r->ops,
+           r->bytes ? (r->bytes / 1e6) / (r->ns / 1e9) : 0.0,
+           (double)r->allocs / r->ops, (double)r->alloc_bytes / r->ops);
+    result_count++;
+}
+
+static char hex_chars[BENCH_CHARS];
+static uint8_t hex_nibbles[BENCH_CHARS];
+
+static uint64_t bench_char_bin(void *ctx, uint64_t *bytes)
+{
+    uint32_t sum = 0;
+    int i = 0;
+
+    for (i = 0; i < BENCH_CHARS; i++)
+        sum += transform_char_bin(hex_chars[i]);
+    sink += sum;
+    *bytes = BENCH_CHARS;
+    return BENCH_CHARS;
+}
+
+static uint64_t bench_2chars_1bin(void *ctx, uint64_t *bytes)
+{
+    uint32_t sum = 0;
+    int i = 0;
+
+    for (i = 0; i < BENCH_CHARS; i += 2)
+        sum += transform_2chars_1bin(&hex_nibbles[i]);
+    sink += sum;
+    *bytes = BENCH_CHARS;
+    return BENCH_CHARS / 2;
+}
+
+static uint64_t bench_page_calc(void *ctx, uint64_t *bytes)
+{
+    uint32_t sum = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < BENCH_CHARS; i++)
+        sum += page_iteration_calc(0x4000, i * 97);
+    sink += sum;
+    *bytes = 0;
+    return BENCH_CHARS;
+}
+
+// ERASE / WRITE framing as the session builds them
+static uint64_t bench_frame(void *ctx, uint64_t *bytes)
+{
+    char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    uint32_t address = 0x1D000000;
+    uint16_t size = 0x4000;
+    int i = 0;
+
+    for (i = 0; i < BENCH_CHARS; i++)
+    {
+        boot_frame_command(data_out, (i & 1) ? cmdWRITE : cmdERASE, sizeof(data_out));
+        memcpy(data_out + 2, &address, sizeof(uint32_t));
+        memcpy(data_out + 6, &size, sizeof(int16_t));
+        address += size;
+        sink += data_out[i & 7];
+    }
+    *bytes = (uint64_t)BENCH_CHARS * sizeof(data_out);
+    return BENCH_CHARS;
+}
+
+// 64 byte reports streamed out of the program flash buffer
+static uint64_t bench_load_hex(void *ctx, uint64_t *bytes)
+{
+    THexImage *image = ctx;
+    char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    uint8_t *src = image->prg;
+    uint32_t slices = image->prg_size / sizeof(data_out);
+    uint32_t i = 0;
+
+    for (i = 0; i < slices; i++)
+    {
+        load_hex_buffer(data_out, &src, sizeof(data_out));
+        sink += data_out[i & 63];
+    }
+    *bytes = (uint64_t)slices * sizeof(data_out);
+    return slices;
+}
+
+static uint64_t bench_extract_line(void *ctx, uint64_t *bytes)
+{
+    TBenchFile *f = ctx;
+    char line[BENCH_LINE_BYTES];
+    uint32_t i = 0;
+
+    fseek(f->fp, 0, SEEK_SET);
+    for (i = 0; i < f->lines; i++)
+    {
+        file_extract_line(f->fp, line, 0);
+        sink += line[0];
+    }
+    *bytes = f->size;
+    return f->lines;
+}
+
+static uint64_t bench_condition(void *ctx, uint64_t *bytes)
+{
+    TBenchFile *f = ctx;
+    THexImage image = {0};
+
+    sink += condition_hexfile_data(f->path, &f->bootinfo, &image);
+    free_hex_image(&image);
+    *bytes = f->size;
+    return 1;
+}
+
+static uint64_t bench_validate(void *ctx, uint64_t *bytes)
+{
+    TBenchFile *f = ctx;
+
+    sink += hex_validate(f->path, &f->bootinfo);
+    *bytes = f->size;
+    return 1;
+}
+
+static uint64_t bench_stream(void *ctx, uint64_t *bytes)
+{
+    TBenchFile *f = ctx;
+    TPacketStream *stream = stream_compile("bench", &f->regions, &f->image, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+
+    if (stream == NULL)
+        return 0;
+    *bytes = (uint64_t)stream->count * stream->report_size;
+    stream_release(stream);
+    return 1;
+}
+
+// pic32mz2048efh as the bootloader reports it
+static void bench_bootinfo(TBootInfo *bootinfo)
+{
+    memset(bootinfo, 0, sizeof(TBootInfo));
+    bootinfo->ulMcuSize.fValue = MZ2048;
+    bootinfo->uiEraseBlock.fValue.intVal = 0x4000;
+    bootinfo->uiWriteBlock.fValue.intVal = 0x800;
+    bootinfo->ulBootStart.fValue = 0x9D1F4000;
+    memcpy(bootinfo->sDevDsc.fValue, "PIC32MZ2048EFH", 14);
+}
+
+static void write_record(FILE *fp, uint8_t count, uint16_t address, uint8_t type, const uint8_t *data)
+{
+    uint8_t sum = count + (address >> 8) + (address & 0xff) + type;
+    int i = 0;
+
+    fprintf(fp, ":%02X%04X%02X", count, address, type);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(fp, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fp, "%02X\n", (uint8_t)-sum);
+}
+
+// size bytes of program flash in 16 byte records, a config line and EOF
+static int bench_synth(char *path, size_t path_size, uint32_t size)
+{
+    uint8_t data[16];
+    uint8_t upper[2];
+    uint32_t address = 0;
+    uint32_t seed = 1;
+    FILE *fp = NULL;
+    int fd = 0;
+    int i = 0;
+
+    snprintf(path, path_size, "/tmp/mikro_hb_bench_XXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (address = 0; address < size; address += sizeof(data))
+    {
+        if ((address & 0xffff) == 0)
+        {
+            upper[0] = ((_PIC32Mn_STARTFLASH + address) >> 24) & 0xff;
+            upper[1] = ((_PIC32Mn_STARTFLASH + address) >> 16) & 0xff;
+            write_record(fp, 2, 0, 0x04, upper);
+        }
+        for (i = 0; i < (int)sizeof(data); i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            data[i] = (seed >> 16) & 0xff;
+        }
+        write_record(fp, sizeof(data), address & 0xffff, 0x00, data);
+    }
+
+    upper[0] = (_PIC32Mn_STARTCONF >> 24) & 0xff;
+    upper[1] = (_PIC32Mn_STARTCONF >> 16) & 0xff;
+    write_record(fp, 2, 0, 0x04, upper);
+    write_record(fp, sizeof(data), 0, 0x00, data);
+    write_record(fp, 0, 0, 0x01, NULL);
+    fclose(fp);
+    return 0;
+}
+
+static int bench_file_open(TBenchFile *f, const char *path)
+{
+    int c = 0;
+
+    memset(f, 0, sizeof(TBenchFile));
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    bench_bootinfo(&f->bootinfo);
+
+    f->fp = fopen(path, "r");
+    if (f->fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // whole lines only, one file_extract_line() each
+    while ((c = fgetc(f->fp)) != EOF)
+    {
+        f->size++;
+        if (c == '\n')
+            f->lines++;
+    }
+    return 0;
+}
+
+static void bench_file(const char *path, const char *label)
+{
+    TBenchFile f;
+
+    if (bench_file_open(&f, path) < 0)
+        return;
+
+    bench_run("file_extract_line", label, bench_extract_line, &f);
+    bench_run("condition_hexfile_data", label, bench_condition, &f);
+    bench_run("hex_validate", label, bench_validate, &f);
+
+    memset(&f.image, 0, sizeof(f.image));
+    memset(&f.regions, 0, sizeof(f.regions));
+    if (condition_hexfile_data(f.path, &f.bootinfo, &f.image) > 0 && region_plan(&f.regions, &f.image, &f.bootinfo) == 0)
+        bench_run("stream_compile", label, bench_stream, &f);
+    free_hex_image(&f.image);
+    fclose(f.fp);
+}
+
+// a JSON string body, quotes, backslashes and control characters escaped
+static void bench_json_string(FILE *fp, const char *s)
+{
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, fp);
+    }
+}
+
+static int bench_json(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    TBenchResult *r = NULL;
+    int i = 0;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "{\n  \"build\": \"%s\",\n  \"results\": [\n", BUILD_TIMESTAMP_STR);
+    for (i = 0; i < result_count; i++)
+    {
+        r = &results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"input\": \"", r->name);
+        bench_json_string(fp, r->input);
+        fprintf(fp, "\", \"ops\": %llu, \"ns_per_op\": %.3f, "
+                    "\"mb_per_s\": %.3f, \"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.1f}%s\n",
+                (unsigned long long)r->ops, (double)r->ns / r->ops,
+                r->bytes ? (r->bytes / 1e6) / (r->ns / 1e9) : 0.0,
+                (double)r->allocs / r->ops, (double)r->alloc_bytes / r->ops,
+                (i + 1 < result_count) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"json", required_argument, NULL, 'j'},
+        {"time-ms", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}};
+    static const uint32_t synth_sizes[] = {0x10000, 0x100000};
+    char json[250] = {0};
+    char path[64];
+    char label[32];
+    TBootInfo bootinfo;
+    THexImage image = {0};
+    int c = 0;
+    int i = 0;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'j':
+            snprintf(json, sizeof(json), "%s", optarg);
+            break;
+        case 't':
+            bench_min_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--json <path>] [--time-ms <n>] [hex files...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < BENCH_CHARS; i++)
+    {
+        hex_chars[i] = "0123456789ABCDEFabcdef"[i % 22];
+        hex_nibbles[i] = transform_char_bin(hex_chars[i]);
+    }
+
+    bench_run("transform_char_bin", "chars", bench_char_bin, NULL);
+    bench_run("transform_2chars_1bin", "chars", bench_2chars_1bin, NULL);
+    bench_run("page_iteration_calc", "sizes", bench_page_calc, NULL);
+    bench_run("packet_framing", "erase/write", bench_frame, NULL);
+
+    bench_bootinfo(&bootinfo);
+    if (hex_image_alloc(&image, &bootinfo) == 0)
+    {
+        bench_run("load_hex_buffer", "2MB prg", bench_load_hex, &image);
+        free_hex_image(&image);
+    }
+
+    for (i = 0; i < (int)(sizeof(synth_sizes) / sizeof(synth_sizes[0])); i++)
+    {
+        if (bench_synth(path, sizeof(path), synth_sizes[i]) < 0)
+            continue;
+        snprintf(label, sizeof(label), "synthetic %uK", synth_sizes[i] >> 10);
+        bench_file(path, label);
+        unlink(path);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        // label real files by name, keep the JSON short
+        snprintf(label, sizeof(label), "%s", strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i]);
+        bench_file(argv[i], label);
+    }
+
+    if (json[0] != '\0' && bench_json(json) < 0)
+        return EXIT_FAILURE;
+    return 0;
+}
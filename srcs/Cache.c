@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "Cache.h"
+#include "HexFile.h"
+#include "Digest.h"
+#include "Utils.h"
+#include "Validate.h"
+
+// 2 = cache hits and stores
+#define DEBUG 2
+
+// the bootinfo fields condition_hexfile_data() depends on
+static void cache_profile_key(const TBootInfo *bootinfo, char *key, size_t size)
+{
+    snprintf(key, size, "%x-%x-%x", bootinfo->ulMcuSize.fValue, bootinfo->uiEraseBlock.fValue.intVal, bootinfo->ulBootStart.fValue);
+}
+
+static void cache_image_path(const char *dir, const char *digest, const TBootInfo *bootinfo, char *path, size_t size)
+{
+    char key[40];
+
+    cache_profile_key(bootinfo, key, sizeof(key));
+    snprintf(path, size, "%s/%s-%s.img", dir, digest, key);
+}
+
+// bytes up to and including the last one that isn't erased
+static uint32_t cache_used(const uint8_t *buf, uint32_t size)
+{
+    while (size > 0 && buf[size - 1] == 0xff)
+        size--;
+    return size;
+}
+
+/*
+ * Fill image from the cache if this hex has been conditioned for the
+ * device profile before, the image owns its buffers as if parsed.
+ *
+ * return: 0 on a hit, -1 on a miss or a bad cache file
+ */
+int cache_load(const char *dir, const char *path, TBootInfo *bootinfo, THexImage *image)
+{
+    char digest[DIGEST_HEX_SIZE];
+    char img_path[CACHE_PATH_SIZE];
+    TCacheHeader header;
+    uint16_t page_size = bootinfo->uiEraseBlock.fValue.intVal;
+    FILE *fp = NULL;
+
+    if (digest_file(path, digest) != 0)
+        return -1;
+
+    cache_image_path(dir, digest, bootinfo, img_path, sizeof(img_path));
+    fp = fopen(img_path, "rb");
+    if (fp == NULL)
+        return -1;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_VERSION || header.prg_size != bootinfo->ulMcuSize.fValue || header.block_size != page_size ||
+        header.prg_len > header.prg_size || header.conf_len > CONF_BUFFER_SIZE)
+    {
+        fprintf(stderr, "Ignoring bad cache file %s\n", img_path);
+        fclose(fp);
+        return -1;
+    }
+
+    if (hex_image_alloc(image, bootinfo) < 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+    image->boot = malloc(page_size);
+    if (image->boot != NULL)
+        image->owned |= IMAGE_OWNS_BOOT;
+
+    if (image->boot == NULL || fread(image->prg, 1, header.prg_len, fp) != header.prg_len ||
+        fread(image->conf, 1, header.conf_len, fp) != header.conf_len || fread(image->boot, 1, page_size, fp) != page_size)
+    {
+        fprintf(stderr, "Unable to read cache file %s\n", img_path);
+        fclose(fp);
+        free_hex_image(image);
+        return -1;
+    }
+    fclose(fp);
+
+    image->boot_address = header.boot_address;
+    image->prg_mem_count = header.prg_mem_count;
+    image->conf_mem_count = header.conf_mem_count;
+    image->file_size = header.file_size;
+    memcpy(image->digest, digest, sizeof(image->digest));
+
+#if DEBUG == 2
+    printf("cache hit %s\n", img_path);
+#endif
+    return 0;
+}
+
+/*
+ * Write a conditioned image to the cache, through a temp file and a
+ * rename so a flash run never reads half an image. image must be as
+ * parsed, not a patched view.
+ *
+ * return: 0 on success, -1 on failure
+ */
+int cache_store(const char *dir, const THexImage *image, const TBootInfo *bootinfo)
+{
+    char img_path[CACHE_PATH_SIZE];
+    char tmp_path[CACHE_PATH_SIZE + 16];
+    TCacheHeader header;
+    FILE *fp = NULL;
+    int result = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.prg_size = image->prg_size;
+    header.block_size = image->block_size;
+    header.boot_address = image->boot_address;
+    header.prg_mem_count = image->prg_mem_count;
+    header.conf_mem_count = image->conf_mem_count;
+    header.file_size = image->file_size;
+    header.prg_len = cache_used(image->prg, image->prg_size);
+    header.conf_len = cache_used(image->conf, CONF_BUFFER_SIZE);
+    memcpy(header.digest, image->digest, sizeof(header.digest));
+
+    cache_image_path(dir, image->digest, bootinfo, img_path, sizeof(img_path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", img_path, (int)getpid());
+
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to create cache file %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(image->prg, 1, header.prg_len, fp) != header.prg_len ||
+        fwrite(image->conf, 1, header.conf_len, fp) != header.conf_len ||
+        fwrite(image->boot, 1, image->block_size, fp) != image->block_size)
+        result = -1;
+
+    if (fclose(fp) != 0 || result < 0 || rename(tmp_path, img_path) != 0)
+    {
+        fprintf(stderr, "Unable to write cache file %s: %s\n", img_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+#if DEBUG == 2
+    printf("cached %s : [%u] : [%u]\n", img_path, header.prg_len, header.conf_len);
+#endif
+    return 0;
+}
+
+// remember a device so the watcher conditions new files for it
+int cache_profile_save(const char *dir, const TBootInfo *bootinfo)
+{
+    char key[40];
+    char path[CACHE_PATH_SIZE];
+    FILE *fp = NULL;
+    int result = 0;
+
+    cache_profile_key(bootinfo, key, sizeof(key));
+    snprintf(path, sizeof(path), "%s/profile-%s.bin", dir, key);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to save the device profile %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fwrite(bootinfo, sizeof(TBootInfo), 1, fp) != 1)
+        result = -1;
+    if (fclose(fp) != 0)
+        result = -1;
+    return result;
+}
+
+/*
+ * Read back the device profiles saved in dir.
+ *
+ * return: number of profiles, -1 if dir can't be read
+ */
+int cache_profiles(const char *dir, TBootInfo *profiles, int max)
+{
+    char path[CACHE_PATH_SIZE];
+    struct dirent *entry = NULL;
+    DIR *d = opendir(dir);
+    FILE *fp = NULL;
+    size_t len = 0;
+    int count = 0;
+
+    if (d == NULL)
+    {
+        fprintf(stderr, "Unable to read cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    while (count < max && (entry = readdir(d)) != NULL)
+    {
+        len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "profile-", 8) != 0 || len < 4 || strcmp(entry->d_name + len - 4, ".bin") != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        fp = fopen(path, "rb");
+        if (fp == NULL)
+            continue;
+        if (fread(&profiles[count], sizeof(TBootInfo), 1, fp) == 1)
+            count++;
+        fclose(fp);
+    }
+    closedir(d);
+    return count;
+}
+
+/*
+ * Condition path for every device profile in the cache.
+ *
+ * return: number of images stored, -1 on failure
+ */
+int cache_warm(const char *dir, const char *path)
+{
+    TBootInfo profiles[CACHE_MAX_PROFILES];
+    THexImage image;
+    char hex_path[CACHE_PATH_SIZE];
+    uint64_t started = 0;
+    int count = cache_profiles(dir, profiles, CACHE_MAX_PROFILES);
+    int stored = 0;
+    int i = 0;
+
+    if (count <= 0)
+    {
+        if (count == 0)
+            fprintf(stderr, "No device profiles in %s yet, flash a board with --cache first\n", dir);
+        return count;
+    }
+
+    // condition_hexfile_data() wants a writable path
+    snprintf(hex_path, sizeof(hex_path), "%s", path);
+
+    for (i = 0; i < count; i++)
+    {
+        started = time_now_ns();
+        if (hex_validate(path, &profiles[i]) != 0)
+        {
+            fprintf(stderr, "%s not cached for %.20s\n", path, profiles[i].sDevDsc.fValue);
+            continue;
+        }
+        memset(&image, 0, sizeof(image));
+        if (condition_hexfile_data(hex_path, &profiles[i], &image) == 0)
+        {
+            free_hex_image(&image);
+            return -1;
+        }
+        if (cache_store(dir, &image, &profiles[i]) == 0)
+            stored++;
+        free_hex_image(&image);
+        printf("warmed %s for %.20s in %.1f ms\n", path, profiles[i].sDevDsc.fValue, (time_now_ns() - started) / 1e6);
+    }
+    return stored;
+}
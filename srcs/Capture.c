@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "Capture.h"
+#include "Utils.h"
+#include "Metrics.h"
+
+#define CAPTURE_BUFFER_SIZE 0x10000
+#define REPLAY_MAX_PENDING 16
+#define REPLAY_MAX_REPORTS 8
+
+static FILE *capture_fp = NULL;
+static uint64_t capture_last_ns = 0;
+
+static uint8_t *replay_blob = NULL;
+static TCaptureRecord *replay_records = NULL;
+static uint32_t replay_count = 0;
+static uint32_t replay_cursor = 0;
+static uint32_t replay_mismatches = 0;
+static double replay_speed = 1.0;
+static uint8_t replay_on = 0;
+
+// completions waiting for their captured latency to pass
+static struct
+{
+    TUsbTransfer *t;
+    uint64_t due;
+    int result;
+} replay_pending[REPLAY_MAX_PENDING];
+static int replay_pending_count = 0;
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, v & 0xffff);
+    put_u16(p + 2, v >> 16);
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint32_t ns_to_us(uint64_t ns)
+{
+    ns /= 1000;
+    return (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+}
+
+/*
+ * Start appending every transfer to path, the stdio buffer keeps
+ * file writes off the per packet path.
+ *
+ * return: 0 on success, -1 if the file can't be created
+ */
+int capture_open(const char *path)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE] = {0};
+    struct timespec ts;
+    uint64_t wall_ns = 0;
+
+    capture_fp = fopen(path, "wb");
+    if (capture_fp == NULL)
+    {
+        fprintf(stderr, "Unable to create capture %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(capture_fp, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    // wall clock lets a capture be lined up with line logs later
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wall_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    memcpy(header, CAPTURE_MAGIC, 6);
+    put_u16(header + 6, CAPTURE_VERSION);
+    put_u32(header + 8, (uint32_t)wall_ns);
+    put_u32(header + 12, (uint32_t)(wall_ns >> 32));
+    fwrite(header, 1, sizeof(header), capture_fp);
+
+    capture_last_ns = time_now_ns();
+    return 0;
+}
+
+// append one transfer, size is the report length handed to libusb
+void capture_record(uint8_t in, uint64_t submitted_ns, uint64_t done_ns, int result, const char *data, int size)
+{
+    uint8_t rec[CAPTURE_RECORD_SIZE];
+    int len = in ? result : size;
+
+    if (capture_fp == NULL)
+        return;
+
+    if (len < 0)
+        len = 0;
+    if (len > size)
+        len = size;
+    while (len > 0 && data[len - 1] == 0)
+        len--;
+
+    put_u32(rec, (submitted_ns > capture_last_ns) ? ns_to_us(submitted_ns - capture_last_ns) : 0);
+    put_u32(rec + 4, (done_ns > submitted_ns) ? ns_to_us(done_ns - submitted_ns) : 0);
+    put_u16(rec + 8, (uint16_t)(int16_t)result);
+    rec[10] = in ? CAPTURE_FLAG_IN : 0;
+    put_u16(rec + 11, (uint16_t)len);
+    if (submitted_ns > capture_last_ns)
+        capture_last_ns = submitted_ns;
+
+    fwrite(rec, 1, sizeof(rec), capture_fp);
+    fwrite(data, 1, len, capture_fp);
+}
+
+void capture_close(void)
+{
+    if (capture_fp == NULL)
+        return;
+    fclose(capture_fp);
+    capture_fp = NULL;
+}
+
+/*
+ * Load a capture for replay, speed 1 = original device latency,
+ * 10 = ten times faster, 0 = answer straight away.
+ *
+ * return: 0 on success, -1 if the file is missing or malformed
+ */
+int replay_open(const char *path, double speed)
+{
+    TCaptureRecord *r = NULL;
+    const uint8_t *rec = NULL;
+    uint32_t size = 0;
+    uint64_t t_us = 0;
+    long file_size = 0;
+    long pos = CAPTURE_HEADER_SIZE;
+    FILE *fp = NULL;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open capture %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // the report bytes are played straight out of the loaded file
+    fseek(fp, 0, SEEK_END);
+    file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    replay_blob = malloc(file_size > 0 ? file_size : 1);
+    if (replay_blob == NULL || file_size < CAPTURE_HEADER_SIZE ||
+        fread(replay_blob, 1, file_size, fp) != (size_t)file_size ||
+        memcmp(replay_blob, CAPTURE_MAGIC, 6) != 0 || get_u16(replay_blob + 6) != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d capture file\n", path, CAPTURE_VERSION);
+        fclose(fp);
+        replay_close();
+        return -1;
+    }
+    fclose(fp);
+
+    while (pos + CAPTURE_RECORD_SIZE <= file_size)
+    {
+        if (replay_count == size)
+        {
+            size = size ? size * 2 : 1024;
+            r = realloc(replay_records, size * sizeof(TCaptureRecord));
+            if (r == NULL)
+            {
+                fprintf(stderr, "Out of memory loading capture\n");
+                replay_close();
+                return -1;
+            }
+            replay_records = r;
+        }
+
+        rec = replay_blob + pos;
+        r = &replay_records[replay_count];
+        t_us += get_u32(rec);
+        r->t_us = t_us;
+        r->dur_us = get_u32(rec + 4);
+        r->result = (int16_t)get_u16(rec + 8);
+        r->in = rec[10] & CAPTURE_FLAG_IN;
+        r->len = get_u16(rec + 11);
+        r->data = rec + CAPTURE_RECORD_SIZE;
+        pos += CAPTURE_RECORD_SIZE + r->len;
+        if (pos > file_size)
+        {
+            fprintf(stderr, "Capture %s is truncated at record %u\n", path, replay_count);
+            break;
+        }
+        replay_count++;
+    }
+
+    // default 50us timer slack would swamp the captured latencies
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    printf("replay: %u transfers from %s at %gx\n", replay_count, path, speed);
+    replay_cursor = 0;
+    replay_mismatches = 0;
+    replay_speed = speed;
+    replay_on = 1;
+    return 0;
+}
+
+// report sizes the captured session used, the first completed OUT and IN
+void replay_report_sizes(uint16_t *out_size, uint16_t *in_size)
+{
+    uint32_t i = 0;
+    int out_found = 0;
+    int in_found = 0;
+
+    for (i = 0; i < replay_count && !(out_found && in_found); i++)
+    {
+        if (replay_records[i].result <= 0)
+            continue;
+        if (replay_records[i].in && !in_found++)
+            *in_size = replay_records[i].result;
+        else if (!replay_records[i].in && !out_found++)
+            *out_size = replay_records[i].result;
+    }
+}
+
+int replay_active(void)
+{
+    return replay_on;
+}
+
+/*
+ * Take the next captured transfer, OUT reports are compared with the
+ * captured bytes, IN reports are copied into data.
+ *
+ * return: the captured result, *delay_ns = scaled device latency
+ */
+static int replay_next(uint8_t in, char *data, int size, uint64_t *delay_ns)
+{
+    TCaptureRecord *r = NULL;
+    int i = 0;
+
+    *delay_ns = 0;
+    if (replay_cursor >= replay_count)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    r = &replay_records[replay_cursor];
+    if (r->in != in)
+    {
+        fprintf(stderr, "replay diverged at transfer %u: captured %s, session sent %s\n",
+                replay_cursor, r->in ? "IN" : "OUT", in ? "IN" : "OUT");
+        replay_cursor = replay_count;
+        return LIBUSB_ERROR_IO;
+    }
+    replay_cursor++;
+
+    if (replay_speed > 0)
+        *delay_ns = (uint64_t)(r->dur_us * 1000.0 / replay_speed);
+
+    if (in)
+    {
+        memset(data, 0, size);
+        memcpy(data, r->data, (r->len < size) ? r->len : size);
+        return r->result;
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        if ((uint8_t)data[i] != ((i < r->len) ? r->data[i] : 0))
+            break;
+    }
+    if (i < size && replay_mismatches++ < REPLAY_MAX_REPORTS)
+        fprintf(stderr, "replay OUT mismatch at transfer %u byte %d\n", replay_cursor - 1, i);
+
+    return r->result;
+}
+
+static void replay_sleep_until(uint64_t due_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = due_ns / 1000000000ull;
+    ts.tv_nsec = due_ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// blocking replay of one transfer for boot_interrupt_transfers()
+int replay_transfer(uint8_t in, char *data, int size)
+{
+    uint64_t delay_ns = 0;
+    uint64_t now = time_now_ns();
+    int result = replay_next(in, data, size, &delay_ns);
+
+    replay_sleep_until(now + delay_ns);
+    return result;
+}
+
+// queue the captured completion, replay_run() delivers it when due
+int replay_submit(TUsbTransfer *t, uint8_t in, char *data, int size)
+{
+    uint64_t delay_ns = 0;
+
+    if (replay_pending_count == REPLAY_MAX_PENDING)
+        return LIBUSB_ERROR_BUSY;
+
+    replay_pending[replay_pending_count].result = replay_next(in, data, size, &delay_ns);
+    replay_pending[replay_pending_count].due = t->submitted + delay_ns;
+    replay_pending[replay_pending_count].t = t;
+    replay_pending_count++;
+    return 0;
+}
+
+/*
+ * Stand-in for session_run(), the captured device answers instead of
+ * libusb. Sessions share the one capture so they are replayed in the
+ * order their transfers were queued, normally count is 1.
+ *
+ * return: zero if every session finished cleanly, otherwise the first failure
+ */
+int replay_run(TSession *sessions[], int count)
+{
+    TUsbTransfer *t = NULL;
+    uint64_t started = time_now_ns();
+    uint64_t captured_us = 0;
+    int active = 0;
+    int result = 0;
+    int next = 0;
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+        session_step(sessions[i], evSTART);
+
+    for (;;)
+    {
+        for (active = 0, i = 0; i < count; i++)
+            active += sessions[i]->stalled;
+        if (replay_pending_count == 0 && active == 0)
+            break;
+
+        // sessions waiting on the parser, nothing in flight
+        if (replay_pending_count == 0)
+        {
+            replay_sleep_until(time_now_ns() + 1000000);
+            session_poll_deadlines(sessions, count);
+            continue;
+        }
+
+        for (next = 0, i = 1; i < replay_pending_count; i++)
+        {
+            if (replay_pending[i].due < replay_pending[next].due)
+                next = i;
+        }
+
+        replay_sleep_until(replay_pending[next].due);
+        t = replay_pending[next].t;
+        result = replay_pending[next].result;
+        replay_pending[next] = replay_pending[--replay_pending_count];
+
+        metrics_transfer(t->xfer->endpoint & LIBUSB_ENDPOINT_IN, result);
+        t->done(t, result);
+        session_poll_deadlines(sessions, count);
+    }
+
+    if (replay_count > 0)
+        captured_us = replay_records[replay_count - 1].t_us + replay_records[replay_count - 1].dur_us;
+    printf("replay: %u of %u transfers, %u OUT mismatches, captured %.3f ms, replayed %.3f ms\n",
+           replay_cursor, replay_count, replay_mismatches, captured_us / 1000.0,
+           (time_now_ns() - started) / 1000000.0);
+
+    for (active = 0, result = 0, i = 0; i < count; i++)
+    {
+        active += !session_done(sessions[i]);
+        if (result == 0)
+            result = sessions[i]->result;
+    }
+    if (result == 0 && replay_mismatches > 0)
+        result = LIBUSB_ERROR_OTHER;
+    return (active > 0) ? LIBUSB_ERROR_OTHER : result;
+}
+
+void replay_close(void)
+{
+    free(replay_records);
+    free(replay_blob);
+    replay_records = NULL;
+    replay_blob = NULL;
+    replay_count = 0;
+    replay_pending_count = 0;
+    replay_on = 0;
+}
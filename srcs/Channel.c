@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "Channel.h"
+#include "USB.h"
+
+// 2 = channel timings
+#define DEBUG 2
+
+// control has to beat interrupt by 5% to be worth leaving the default
+#define CHANNEL_GAIN 1.05
+#define CHANNEL_KEY_SIZE 128
+
+typedef struct
+{
+  char key[CHANNEL_KEY_SIZE];
+  TUsbChannel channel;
+} TChannelChoice;
+
+static TChannelChoice choices[CHANNEL_MAX_HUBS];
+static int choice_count = 0;
+
+static const char *channel_names[] = {"interrupt", "control", "auto"};
+
+const char *channel_name(TUsbChannel channel)
+{
+    return channel_names[channel];
+}
+
+// return: 0 on success, -1 for an unknown name
+int channel_parse(const char *name, TUsbChannel *channel)
+{
+    int i = 0;
+
+    for (i = chINTERRUPT; i <= chAUTO; i++)
+    {
+        if (strcmp(name, channel_names[i]) == 0)
+        {
+            *channel = (TUsbChannel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// host, hub the board hangs off and report size, what the timing depends on
+static void channel_key(libusb_device_handle *devh, uint16_t out_size, char *key, size_t size)
+{
+    char host[64] = {0};
+    char board[32];
+    char hub[32];
+
+    if (gethostname(host, sizeof(host) - 1) != 0)
+        strcpy(host, "localhost");
+    boot_device_topology(libusb_get_device(devh), board, hub, sizeof(board));
+    snprintf(key, size, "%s-%s-%u", host, hub, out_size);
+}
+
+static int channel_load(const char *cache_dir, const char *key, TUsbChannel *channel)
+{
+    char path[CHANNEL_KEY_SIZE + 256];
+    char name[16] = {0};
+    FILE *fp = NULL;
+    int result = -1;
+
+    snprintf(path, sizeof(path), "%s/channel-%s.txt", cache_dir, key);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    if (fscanf(fp, "%15s", name) == 1 && channel_parse(name, channel) == 0 && *channel != chAUTO)
+        result = 0;
+    fclose(fp);
+    return result;
+}
+
+static void channel_save(const char *cache_dir, const char *key, TUsbChannel channel)
+{
+    char path[CHANNEL_KEY_SIZE + 256];
+    FILE *fp = NULL;
+
+    snprintf(path, sizeof(path), "%s/channel-%s.txt", cache_dir, key);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to save the channel choice %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s\n", channel_name(channel));
+    fclose(fp);
+}
+
+static int channel_known(const char *key, TUsbChannel *channel)
+{
+    int i = 0;
+
+    for (i = 0; i < choice_count; i++)
+    {
+        if (strcmp(choices[i].key, key) == 0)
+        {
+            *channel = choices[i].channel;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void channel_keep(const char *key, TUsbChannel channel)
+{
+    if (choice_count < CHANNEL_MAX_HUBS)
+    {
+        snprintf(choices[choice_count].key, sizeof(choices[0].key), "%s", key);
+        choices[choice_count].channel = channel;
+        choice_count++;
+    }
+    printf("out channel %s\n", channel_name(channel));
+}
+
+/*
+ * The OUT channel for a board, wanted unless it is chAUTO. Otherwise an
+ * earlier choice for the same host and hub, or chAUTO when the session
+ * has to measure it, see channel_record().
+ */
+TUsbChannel channel_select(libusb_device_handle *devh, TUsbChannel wanted, const char *cache_dir, uint16_t out_size)
+{
+    char key[CHANNEL_KEY_SIZE];
+    TUsbChannel channel = chAUTO;
+
+    if (wanted != chAUTO)
+        return wanted;
+
+    channel_key(devh, out_size, key, sizeof(key));
+    if (channel_known(key, &channel) == 0)
+        return channel;
+    if (cache_dir != NULL && channel_load(cache_dir, key, &channel) == 0)
+        channel_keep(key, channel);
+    return channel;
+}
+
+/*
+ * The faster of the two channels from bytes streamed and ns spent on the
+ * trial pages of each, indexed by TUsbChannel. A board behind the same
+ * hub that finished its trial first has already decided for this one.
+ */
+TUsbChannel channel_record(libusb_device_handle *devh, const char *cache_dir, uint16_t out_size, const uint64_t bytes[2], const uint64_t ns[2])
+{
+    char key[CHANNEL_KEY_SIZE];
+    TUsbChannel channel = chINTERRUPT;
+    double interrupt_rate = 0.0;
+    double control_rate = 0.0;
+
+    channel_key(devh, out_size, key, sizeof(key));
+    if (channel_known(key, &channel) == 0)
+        return channel;
+
+    // bytes per second
+    if (ns[chINTERRUPT] > 0)
+        interrupt_rate = bytes[chINTERRUPT] * 1e9 / ns[chINTERRUPT];
+    if (ns[chCONTROL] > 0)
+        control_rate = bytes[chCONTROL] * 1e9 / ns[chCONTROL];
+    if (control_rate > interrupt_rate * CHANNEL_GAIN)
+        channel = chCONTROL;
+#if DEBUG == 2
+    printf("channel %s : interrupt %.0f B/s : control %.0f B/s\n", key, interrupt_rate, control_rate);
+#endif
+
+    if (cache_dir != NULL)
+        channel_save(cache_dir, key, channel);
+    channel_keep(key, channel);
+    return channel;
+}
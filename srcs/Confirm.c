@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "Confirm.h"
+#include "USB.h"
+#include "Utils.h"
+
+static TConfirmBoard *confirm_board(TConfirm *c, libusb_device *dev)
+{
+    char board[CONFIRM_PATH_SIZE];
+    char hub[CONFIRM_PATH_SIZE];
+    int i = 0;
+
+    boot_device_topology(dev, board, hub, sizeof(board));
+    for (i = 0; i < c->count; i++)
+    {
+        if (strcmp(c->boards[i].path, board) == 0)
+            return &c->boards[i];
+    }
+    return NULL;
+}
+
+// registered for vid:pid, only the event that confirms is asked for
+static int LIBUSB_CALL confirm_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    TConfirm *c = user_data;
+    TConfirmBoard *b = confirm_board(c, dev);
+
+    // boards are still being flashed, confirm_wait() drops any event older than the re-boot
+    if (b != NULL && b->seen_ns == 0)
+        b->seen_ns = time_now_ns();
+    return 0;
+}
+
+/*
+ * Start listening, before any board is re-booted so no event is missed.
+ * arrive = 1 waits for the applications vid:pid, 0 for vid:pid to go.
+ *
+ * return: 0 on success, libusb error code on failure
+ */
+int confirm_open(TConfirm *c, libusb_context *ctx, uint16_t vid, uint16_t pid, uint8_t arrive)
+{
+    int result = 0;
+
+    memset(c, 0, sizeof(TConfirm));
+    c->ctx = ctx;
+    c->vid = vid;
+    c->pid = pid;
+    c->arrive = arrive;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return 0;
+
+    result = libusb_hotplug_register_callback(ctx, arrive ? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED : LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                              0, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, confirm_hotplug, c, &c->handle);
+    if (result < 0)
+    {
+        fprintf(stderr, "libusb_hotplug_register_callback error %d, polling\n", result);
+        return 0;
+    }
+    c->hotplug = 1;
+    return 0;
+}
+
+// return: 0 on success, -1 if there is no room
+int confirm_add(TConfirm *c, libusb_device_handle *devh)
+{
+    char hub[CONFIRM_PATH_SIZE];
+    TConfirmBoard *b = NULL;
+
+    if (c->count >= MAX_CONFIRM_BOARDS)
+        return -1;
+
+    b = &c->boards[c->count++];
+    memset(b, 0, sizeof(TConfirmBoard));
+    boot_device_topology(libusb_get_device(devh), b->path, hub, sizeof(b->path));
+    return 0;
+}
+
+// one look at the device list for boards hotplug hasn't confirmed
+static void confirm_poll(TConfirm *c)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device **list = NULL;
+    TConfirmBoard *b = NULL;
+    uint8_t present[MAX_CONFIRM_BOARDS] = {0};
+    uint64_t now = time_now_ns();
+    ssize_t count = libusb_get_device_list(c->ctx, &list);
+    ssize_t i = 0;
+    int k = 0;
+
+    if (count < 0)
+        return;
+
+    for (i = 0; i < count; i++)
+    {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != c->vid || desc.idProduct != c->pid)
+            continue;
+        b = confirm_board(c, list[i]);
+        if (b != NULL)
+            present[b - c->boards] = 1;
+    }
+    libusb_free_device_list(list, 1);
+
+    for (k = 0; k < c->count; k++)
+    {
+        b = &c->boards[k];
+        if (b->rebooted_ns != 0 && b->seen_ns == 0 && present[k] == c->arrive)
+            b->seen_ns = now;
+    }
+}
+
+/*
+ * Wait up to timeout_ms from now for every board with rebooted_ns set.
+ *
+ * return: boards still not confirmed
+ */
+int confirm_wait(TConfirm *c, int timeout_ms)
+{
+    struct timeval tv = {0, CONFIRM_POLL_MS * 1000};
+    uint64_t deadline = time_now_ms() + timeout_ms;
+    int pending = 0;
+    int k = 0;
+
+    for (k = 0; k < c->count; k++)
+    {
+        if (c->boards[k].seen_ns < c->boards[k].rebooted_ns)
+            c->boards[k].seen_ns = 0;
+    }
+
+    for (;;)
+    {
+        confirm_poll(c);
+        for (pending = 0, k = 0; k < c->count; k++)
+            pending += (c->boards[k].rebooted_ns != 0 && c->boards[k].seen_ns == 0);
+        if (pending == 0 || time_now_ms() >= deadline)
+            return pending;
+
+        // hotplug events come in through the event handling, woken early by them
+        if (c->hotplug)
+            libusb_handle_events_timeout_completed(c->ctx, &tv, NULL);
+        else
+            usleep(CONFIRM_POLL_MS * 1000);
+    }
+}
+
+void confirm_close(TConfirm *c)
+{
+    if (c->hotplug)
+        libusb_hotplug_deregister_callback(c->ctx, c->handle);
+    c->hotplug = 0;
+}
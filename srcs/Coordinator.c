@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "Coordinator.h"
+#include "Digest.h"
+#include "Utils.h"
+
+typedef enum
+{
+  jbQUEUED = 0,
+  jbRUNNING,
+  jbDONE
+} TJobState;
+
+typedef struct
+{
+  char path[250];
+  char digest[DIGEST_HEX_SIZE];
+  uint64_t size;
+} TCoordImage;
+
+typedef struct
+{
+  int image;
+  TJobState state;
+  int worker;  // ran or is running it, -1 = none
+  int result;  // libusb error code the worker reported
+  uint32_t ms; // flash time on the worker
+} TCoordJob;
+
+// jobs[head..tail) still queued, the owner pops the head, thieves the tail
+typedef struct
+{
+  int jobs[MAX_COORD_JOBS];
+  int head;
+  int tail;
+} TCoordShard;
+
+typedef struct
+{
+  char host[COORD_HOST_SIZE];
+  int shard; // owned, -1 = only steals
+  uint8_t connected;
+  int job;   // in flight, -1 = none
+  int jobs;
+  int failed;
+  int stolen;
+  int fetched;
+} TCoordWorker;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  TCoordImage images[MAX_COORD_IMAGES];
+  int image_count;
+  TCoordJob jobs[MAX_COORD_JOBS];
+  int job_count;
+  int done;
+  TCoordShard shards[MAX_COORD_WORKERS];
+  int shard_count;
+  TCoordWorker workers[MAX_COORD_WORKERS];
+  int worker_count;
+  int connections;
+} TCoordinator;
+
+typedef struct
+{
+  TCoordinator *c;
+  int fd;
+} TCoordConnection;
+
+/*
+ * Batch file, one image per line, "<hex path> [boards]", boards = 1 if
+ * left out, # starts a comment.
+ *
+ * return: 0 on success, -1 on failure
+ */
+static int coord_load(TCoordinator *c, const char *batch)
+{
+    char line[COORD_LINE_SIZE];
+    char path[250];
+    struct stat st;
+    TCoordImage *image = NULL;
+    FILE *fp = fopen(batch, "r");
+    int boards = 0;
+    int fields = 0;
+    int n = 0;
+    int i = 0;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open batch %s\n", batch);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        n++;
+        boards = 1;
+        fields = sscanf(line, "%249s %d", path, &boards);
+        if (fields < 1 || path[0] == '#')
+            continue;
+        if (boards < 1 || c->job_count + boards > MAX_COORD_JOBS)
+        {
+            fprintf(stderr, "%s:%d bad board count, at most %d jobs\n", batch, n, MAX_COORD_JOBS);
+            break;
+        }
+
+        // the same file twice is one image
+        for (i = 0; i < c->image_count && strcmp(c->images[i].path, path) != 0; i++)
+            ;
+        if (i == c->image_count)
+        {
+            if (c->image_count >= MAX_COORD_IMAGES)
+            {
+                fprintf(stderr, "%s:%d at most %d images\n", batch, n, MAX_COORD_IMAGES);
+                break;
+            }
+            image = &c->images[c->image_count];
+            strcpy(image->path, path);
+            if (stat(path, &st) != 0 || digest_file(path, image->digest) != 0)
+            {
+                fprintf(stderr, "%s:%d unable to read %s\n", batch, n, path);
+                break;
+            }
+            image->size = (uint64_t)st.st_size;
+            c->image_count++;
+        }
+
+        for (; boards > 0; boards--)
+        {
+            c->jobs[c->job_count].image = i;
+            c->jobs[c->job_count].worker = -1;
+            c->job_count++;
+        }
+    }
+
+    if (!feof(fp) || c->job_count == 0)
+    {
+        if (c->job_count == 0)
+            fprintf(stderr, "%s has no jobs\n", batch);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// jobs in batch order are grouped by image, cut into equal runs
+static void coord_shard(TCoordinator *c)
+{
+    int per = (c->job_count + c->shard_count - 1) / c->shard_count;
+    int order = 0;
+    int s = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < c->image_count; i++)
+    {
+        for (j = 0; j < c->job_count; j++)
+        {
+            if (c->jobs[j].image != i)
+                continue;
+            s = order++ / per;
+            c->shards[s].jobs[c->shards[s].tail++] = j;
+        }
+    }
+}
+
+// the job for worker w, -1 if none is queued, lock held
+static int coord_take(TCoordinator *c, int w)
+{
+    TCoordWorker *worker = &c->workers[w];
+    TCoordShard *shard = NULL;
+    int victim = -1;
+    int most = 0;
+    int i = 0;
+
+    if (worker->shard >= 0 && c->shards[worker->shard].head < c->shards[worker->shard].tail)
+    {
+        shard = &c->shards[worker->shard];
+        return shard->jobs[shard->head++];
+    }
+
+    for (i = 0; i < c->shard_count; i++)
+    {
+        if (c->shards[i].tail - c->shards[i].head > most)
+        {
+            most = c->shards[i].tail - c->shards[i].head;
+            victim = i;
+        }
+    }
+    if (victim < 0)
+        return -1;
+
+    worker->stolen++;
+    shard = &c->shards[victim];
+    return shard->jobs[--shard->tail];
+}
+
+// a dropped worker's job is queued in its shard again, lock held
+static void coord_requeue(TCoordinator *c, int w, int job)
+{
+    TCoordShard *shard = &c->shards[(c->workers[w].shard >= 0) ? c->workers[w].shard : 0];
+
+    c->jobs[job].state = jbQUEUED;
+    c->jobs[job].worker = -1;
+    if (shard->head > 0)
+        shard->jobs[--shard->head] = job;
+    else
+        shard->jobs[shard->tail++] = job;
+}
+
+static int coord_send(int fd, const char *line)
+{
+    size_t len = strlen(line);
+
+    return (write(fd, line, len) == (ssize_t)len) ? 0 : -1;
+}
+
+static int coord_send_image(int fd, const TCoordImage *image)
+{
+    char line[COORD_LINE_SIZE];
+    char buf[4096];
+    FILE *fp = fopen(image->path, "rb");
+    uint64_t left = image->size;
+    size_t n = 0;
+
+    if (fp == NULL)
+        return coord_send(fd, "MISSING\n");
+
+    snprintf(line, sizeof(line), "IMAGE %s %lu\n", image->digest, (unsigned long)image->size);
+    if (coord_send(fd, line) < 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+    while (left > 0 && (n = fread(buf, 1, (left < sizeof(buf)) ? left : sizeof(buf), fp)) > 0)
+    {
+        if (write(fd, buf, n) != (ssize_t)n)
+            break;
+        left -= n;
+    }
+    fclose(fp);
+
+    // the size was promised, a short file would leave the worker hanging
+    return (left == 0) ? 0 : -1;
+}
+
+// one request, return: 0 to go on, 1 after END, -1 to drop the connection
+static int coord_request(TCoordinator *c, int w, int fd, const char *line)
+{
+    char reply[COORD_LINE_SIZE];
+    char digest[DIGEST_HEX_SIZE];
+    TCoordWorker *worker = &c->workers[w];
+    TCoordJob *job = NULL;
+    unsigned int ms = 0;
+    int result = 0;
+    int id = 0;
+    int i = 0;
+
+    if (strcmp(line, "NEXT") == 0)
+    {
+        pthread_mutex_lock(&c->lock);
+        id = coord_take(c, w);
+        if (id >= 0)
+        {
+            job = &c->jobs[id];
+            job->state = jbRUNNING;
+            job->worker = w;
+            worker->job = id;
+            snprintf(reply, sizeof(reply), "JOB %d %s %lu\n", id, c->images[job->image].digest, (unsigned long)c->images[job->image].size);
+        }
+        else if (c->done < c->job_count)
+            snprintf(reply, sizeof(reply), "WAIT %d\n", COORD_WAIT_MS);
+        else
+            strcpy(reply, "END\n");
+        pthread_mutex_unlock(&c->lock);
+
+        if (coord_send(fd, reply) < 0)
+            return -1;
+        return (strcmp(reply, "END\n") == 0) ? 1 : 0;
+    }
+
+    if (sscanf(line, "FETCH %64s", digest) == 1)
+    {
+        // images are fixed once loaded, no lock needed to read them
+        for (i = 0; i < c->image_count && strcmp(c->images[i].digest, digest) != 0; i++)
+            ;
+        if (i == c->image_count)
+            return coord_send(fd, "MISSING\n");
+        pthread_mutex_lock(&c->lock);
+        worker->fetched++;
+        pthread_mutex_unlock(&c->lock);
+        return coord_send_image(fd, &c->images[i]);
+    }
+
+    if (sscanf(line, "DONE %d %d %u", &id, &result, &ms) == 3 && id >= 0 && id < c->job_count)
+    {
+        pthread_mutex_lock(&c->lock);
+        job = &c->jobs[id];
+        if (job->state == jbRUNNING && job->worker == w)
+        {
+            job->state = jbDONE;
+            job->result = result;
+            job->ms = ms;
+            worker->job = -1;
+            worker->jobs++;
+            worker->failed += (result != 0);
+            c->done++;
+            printf("job %d %s : worker %d %s : %s %d : %.1f s\n", id, c->images[job->image].path, w, worker->host,
+                   (result == 0) ? "ok" : "failed", result, ms / 1e3);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return coord_send(fd, "OK\n");
+    }
+
+    fprintf(stderr, "worker %d: bad request %s\n", w, line);
+    return -1;
+}
+
+// one worker connection, HELLO first then requests until END or it drops
+static void *coord_connection_thread(void *arg)
+{
+    TCoordConnection *conn = arg;
+    TCoordinator *c = conn->c;
+    char line[COORD_LINE_SIZE];
+    char host[COORD_HOST_SIZE];
+    FILE *in = fdopen(conn->fd, "r");
+    int fd = conn->fd;
+    int result = 0;
+    int w = -1;
+
+    free(conn);
+    if (in == NULL)
+    {
+        close(fd);
+        result = -1;
+    }
+
+    if (result == 0 && fgets(line, sizeof(line), in) != NULL && sscanf(line, "HELLO %63s", host) == 1)
+    {
+        pthread_mutex_lock(&c->lock);
+        if (c->worker_count < MAX_COORD_WORKERS)
+        {
+            w = c->worker_count++;
+            strcpy(c->workers[w].host, host);
+            c->workers[w].shard = (w < c->shard_count) ? w : -1;
+            c->workers[w].connected = 1;
+            c->workers[w].job = -1;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (w >= 0)
+    {
+        snprintf(line, sizeof(line), "WORKER %d\n", w);
+        result = coord_send(fd, line);
+        printf("worker %d %s connected\n", w, host);
+        while (result == 0 && fgets(line, sizeof(line), in) != NULL)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            result = coord_request(c, w, fd, line);
+        }
+
+        pthread_mutex_lock(&c->lock);
+        c->workers[w].connected = 0;
+        if (c->workers[w].job >= 0)
+        {
+            fprintf(stderr, "worker %d %s dropped job %d\n", w, host, c->workers[w].job);
+            coord_requeue(c, w, c->workers[w].job);
+            c->workers[w].job = -1;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (in != NULL)
+        fclose(in);
+    pthread_mutex_lock(&c->lock);
+    c->connections--;
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// address = "port" (binds 127.0.0.1) or "ip:port", return: listening fd or -1
+static int coord_listen(const char *address)
+{
+    struct sockaddr_in addr = {0};
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+    int one = 1;
+    int fd = 0;
+
+    if (colon != NULL)
+    {
+        if ((size_t)(colon - address) >= sizeof(host))
+            return -1;
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        address = colon + 1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(address));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "coordinator: bad listen address %s\n", host);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAX_COORD_WORKERS) != 0)
+    {
+        fprintf(stderr, "coordinator: unable to listen on %s:%s (%s)\n", host, address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int coord_report(TCoordinator *c, uint64_t started)
+{
+    TCoordWorker *worker = NULL;
+    int failed = 0;
+    int i = 0;
+
+    for (i = 0; i < c->worker_count; i++)
+    {
+        worker = &c->workers[i];
+        printf("worker %d %s : %d jobs, %d failed, %d stolen, %d images fetched\n",
+               i, worker->host, worker->jobs, worker->failed, worker->stolen, worker->fetched);
+    }
+    for (i = 0; i < c->job_count; i++)
+        failed += (c->jobs[i].result != 0);
+    printf("batch : %d jobs, %d ok, %d failed, %d images, %.1f s\n",
+           c->job_count, c->job_count - failed, failed, c->image_count, (time_now_ms() - started) / 1e3);
+    return failed;
+}
+
+/*
+ * Hand the batch out until every job is done and every worker has
+ * been told so, shards = workers the batch is split over up front.
+ *
+ * return: 0 when every job flashed, -1 otherwise
+ */
+int coordinator_run(const char *address, const char *batch, int shards)
+{
+    TCoordinator *c = calloc(1, sizeof(TCoordinator));
+    TCoordConnection *conn = NULL;
+    struct pollfd pfd = {0};
+    pthread_attr_t attr;
+    pthread_t thread;
+    uint64_t started = time_now_ms();
+    int failed = 0;
+    int busy = 0;
+    int fd = 0;
+
+    if (c == NULL)
+        return -1;
+    pthread_mutex_init(&c->lock, NULL);
+    c->shard_count = (shards < 1) ? 1 : (shards > MAX_COORD_WORKERS) ? MAX_COORD_WORKERS : shards;
+
+    pfd.fd = -1;
+    if (coord_load(c, batch) < 0 || (pfd.fd = coord_listen(address)) < 0)
+    {
+        free(c);
+        return -1;
+    }
+    coord_shard(c);
+    printf("batch %s : %d jobs, %d images, %d shards, listening on %s\n", batch, c->job_count, c->image_count, c->shard_count, address);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        pthread_mutex_lock(&c->lock);
+        busy = (c->done < c->job_count || c->connections > 0);
+        pthread_mutex_unlock(&c->lock);
+        if (!busy)
+            break;
+
+        if (poll(&pfd, 1, COORD_WAIT_MS) <= 0)
+            continue;
+        fd = accept(pfd.fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        conn = malloc(sizeof(TCoordConnection));
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->c = c;
+        conn->fd = fd;
+        pthread_mutex_lock(&c->lock);
+        c->connections++;
+        pthread_mutex_unlock(&c->lock);
+        if (pthread_create(&thread, &attr, coord_connection_thread, conn) != 0)
+        {
+            pthread_mutex_lock(&c->lock);
+            c->connections--;
+            pthread_mutex_unlock(&c->lock);
+            close(fd);
+            free(conn);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(pfd.fd);
+
+    failed = coord_report(c, started);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+    return (failed > 0) ? -1 : 0;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Digest.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void digest_block(TDigest *d, const uint8_t *p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, e, f, g, h, dd, t1, t2;
+    int i = 0;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (i = 16; i < 64; i++)
+        w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = d->state[0], b = d->state[1], c = d->state[2], dd = d->state[3];
+    e = d->state[4], f = d->state[5], g = d->state[6], h = d->state[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = dd + t1;
+        dd = c, c = b, b = a, a = t1 + t2;
+    }
+
+    d->state[0] += a, d->state[1] += b, d->state[2] += c, d->state[3] += dd;
+    d->state[4] += e, d->state[5] += f, d->state[6] += g, d->state[7] += h;
+}
+
+void digest_init(TDigest *d)
+{
+    static const uint32_t H[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(d->state, H, sizeof(H));
+    d->length = 0;
+    d->used = 0;
+}
+
+void digest_update(TDigest *d, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t n = 0;
+
+    d->length += len;
+    while (len > 0)
+    {
+        n = 64 - d->used;
+        if (n > len)
+            n = len;
+        memcpy(d->block + d->used, p, n);
+        d->used += n;
+        p += n;
+        len -= n;
+        if (d->used == 64)
+        {
+            digest_block(d, d->block);
+            d->used = 0;
+        }
+    }
+}
+
+void digest_final(TDigest *d, uint8_t out[DIGEST_SIZE])
+{
+    uint64_t bits = d->length * 8;
+    int i = 0;
+
+    d->block[d->used++] = 0x80;
+    if (d->used > 56)
+    {
+        memset(d->block + d->used, 0, 64 - d->used);
+        digest_block(d, d->block);
+        d->used = 0;
+    }
+    memset(d->block + d->used, 0, 56 - d->used);
+    for (i = 0; i < 8; i++)
+        d->block[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+    digest_block(d, d->block);
+
+    for (i = 0; i < 8; i++)
+    {
+        out[i * 4] = (uint8_t)(d->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(d->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(d->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)d->state[i];
+    }
+}
+
+void digest_hex(const uint8_t bin[DIGEST_SIZE], char hex[DIGEST_HEX_SIZE])
+{
+    int i = 0;
+
+    for (i = 0; i < DIGEST_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", bin[i]);
+}
+
+// return: 0 on success, -1 if the file can't be read
+int digest_file(const char *path, char hex[DIGEST_HEX_SIZE])
+{
+    uint8_t buf[4096];
+    uint8_t bin[DIGEST_SIZE];
+    TDigest d;
+    size_t n = 0;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+
+    digest_init(&d);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        digest_update(&d, buf, n);
+    fclose(fp);
+
+    digest_final(&d, bin);
+    digest_hex(bin, hex);
+    return 0;
+}
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "Gang.h"
+#include "Session.h"
+#include "Channel.h"
+#include "Options.h"
+#include "Metrics.h"
+#include "Utils.h"
+
+// 2 = scheduling decisions
+#define DEBUG 2
+
+#define MAX_EPOLL_EVENTS 16
+
+// boards a hub starts with before there is a measurement
+#define GANG_START_LIMIT 2
+// one more board on a hub has to add 10% to its throughput to stay
+#define GANG_GAIN 1.10
+
+enum
+{
+  gsQUEUED = 0,
+  gsACTIVE,
+  gsDONE
+};
+
+static int gang_hub(TGang *g, const char *path, int speed)
+{
+    TGangHub *h = NULL;
+    int i = 0;
+
+    for (i = 0; i < g->hub_count; i++)
+    {
+        if (strcmp(g->hubs[i].path, path) == 0)
+            return i;
+    }
+    if (g->hub_count >= MAX_GANG_HUBS)
+        return -1;
+
+    h = &g->hubs[g->hub_count];
+    memset(h, 0, sizeof(TGangHub));
+    snprintf(h->path, sizeof(h->path), "%s", path);
+    h->speed = speed;
+    h->limit = (GANG_START_LIMIT < g->hub_max) ? GANG_START_LIMIT : g->hub_max;
+    return g->hub_count++;
+}
+
+/*
+ * Open and claim every bootloader with vid:pid and group them by hub.
+ *
+ * return: number of boards, libusb error code on failure
+ */
+int gang_open(TGang *g, libusb_context *ctx, uint16_t vid, uint16_t pid, const char *path)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device **list = NULL;
+    libusb_device_handle *devh = NULL;
+    TGangBoard *b = NULL;
+    char board_path[GANG_PATH_SIZE];
+    char hub_path[GANG_PATH_SIZE];
+    ssize_t count = 0;
+    ssize_t i = 0;
+    int result = 0;
+
+    memset(g, 0, sizeof(TGang));
+    g->hub_max = options.gang_hub_max;
+
+    count = libusb_get_device_list(ctx, &list);
+    if (count < 0)
+        return (int)count;
+
+    for (i = 0; i < count && g->board_count < MAX_GANG_BOARDS; i++)
+    {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+
+        boot_device_topology(list[i], board_path, hub_path, GANG_PATH_SIZE);
+        result = libusb_open(list[i], &devh);
+        if (result < 0)
+        {
+            fprintf(stderr, "%s: libusb_open error %d\n", board_path, result);
+            continue;
+        }
+        libusb_detach_kernel_driver(devh, INTERFACE_NUMBER);
+        result = libusb_claim_interface(devh, INTERFACE_NUMBER);
+        if (result < 0)
+        {
+            fprintf(stderr, "%s: libusb_claim_interface error %d\n", board_path, result);
+            libusb_close(devh);
+            continue;
+        }
+
+        b = &g->boards[g->board_count];
+        memset(b, 0, sizeof(TGangBoard));
+        b->devh = devh;
+        snprintf(b->path, sizeof(b->path), "%s", board_path);
+        b->hub = gang_hub(g, hub_path, libusb_get_device_speed(list[i]));
+        b->session = malloc(sizeof(TSession));
+        if (b->hub < 0 || b->session == NULL || session_init(b->session, devh, path) != 0)
+        {
+            fprintf(stderr, "%s: unable to set up a session\n", board_path);
+            free(b->session);
+            libusb_release_interface(devh, INTERFACE_NUMBER);
+            libusb_close(devh);
+            continue;
+        }
+        session_configure(b->session);
+        b->session->stream_publish = 1;
+
+        // serial numbers and MACs per port, patched over one parsed image
+        if (options.patch[0] != '\0')
+        {
+            if (patch_csv_load(options.patch, board_path, &b->patches) < 0)
+            {
+                session_free(b->session);
+                free(b->session);
+                libusb_release_interface(devh, INTERFACE_NUMBER);
+                libusb_close(devh);
+                continue;
+            }
+            b->session->patch = patch_list_next;
+            b->session->patch_user = &b->patches;
+            b->session->base = &g->base;
+        }
+        boot_report_negotiate(devh, &b->session->report_out, &b->session->report_in);
+        b->session->channel = channel_select(devh, options.out_channel, b->session->cache_dir, b->session->report_out);
+        g->board_count++;
+    }
+    libusb_free_device_list(list, 1);
+
+    for (i = 0; i < g->hub_count; i++)
+        printf("hub %s : speed %d : limit %d\n", g->hubs[i].path, g->hubs[i].speed, g->hubs[i].limit);
+    return g->board_count;
+}
+
+// start queued boards wherever their hub has room
+static void gang_schedule(TGang *g)
+{
+    TGangBoard *b = NULL;
+    TGangHub *h = NULL;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < g->board_count; i++)
+    {
+        b = &g->boards[i];
+        h = &g->hubs[b->hub];
+        if (b->state != gsQUEUED || h->active >= h->limit)
+            continue;
+
+        b->state = gsACTIVE;
+        h->active++;
+        for (j = 0; j < g->board_count; j++)
+        {
+            if (g->boards[j].hub == b->hub && g->boards[j].state == gsACTIVE && g->boards[j].concurrency < h->active)
+                g->boards[j].concurrency = h->active;
+        }
+#if DEBUG == 2
+        printf("start %s : hub %s %d of %d\n", b->path, h->path, h->active, h->limit);
+#endif
+        session_step(b->session, evSTART);
+    }
+}
+
+/*
+ * A board finished, its throughput times the concurrency it ran at is
+ * what the hub carried. A board more than the best level has to buy
+ * GANG_GAIN or the hub goes back to the best level.
+ */
+static void gang_board_done(TGang *g, TGangBoard *b)
+{
+    TGangHub *h = &g->hubs[b->hub];
+    uint64_t elapsed = time_now_ns() - b->session->started;
+    double rate = 0;
+
+    b->state = gsDONE;
+    h->active--;
+    h->done++;
+    printf("board %s : %s %d\n", b->path, (b->session->result == 0) ? "ok" : "failed", b->session->result);
+
+    if (b->session->result != 0 || b->session->bytes_written == 0 || elapsed == 0)
+        return;
+
+    rate = b->session->bytes_written / (elapsed / 1e9) * b->concurrency;
+    if (rate > h->best_rate * GANG_GAIN)
+    {
+        h->best_rate = rate;
+        h->best_active = b->concurrency;
+        if (b->concurrency >= h->limit && h->limit < g->hub_max)
+            h->limit++;
+    }
+    else if (b->concurrency > h->best_active && h->best_active > 0)
+        h->limit = h->best_active;
+
+#if DEBUG == 2
+    printf("hub %s : %.1f kB/s at %d : limit %d\n", h->path, rate / 1e3, b->concurrency, h->limit);
+#endif
+}
+
+/*
+ * Drive every board from this one thread, like session_run() but only
+ * the boards the scheduler has started are polled.
+ *
+ * return: zero if every board flashed, otherwise the first failure
+ */
+int gang_run(libusb_context *ctx, TGang *g)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct timeval zero_tv = {0, 0};
+    TSession *active[MAX_GANG_BOARDS];
+    int remaining = 0;
+    int count = 0;
+    int result = 0;
+    int epfd = 0;
+    int i = 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        fprintf(stderr, "epoll_create1 error %d\n", errno);
+        return LIBUSB_ERROR_OTHER;
+    }
+    if (session_epoll_register(ctx, epfd) < 0)
+    {
+        fprintf(stderr, "libusb pollfds are not available\n");
+        close(epfd);
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    for (i = 0; i < g->board_count; i++)
+    {
+        if (g->boards[i].session != NULL)
+            g->boards[i].session->epfd = epfd;
+    }
+
+    do
+    {
+        gang_schedule(g);
+
+        for (count = 0, i = 0; i < g->board_count; i++)
+        {
+            if (g->boards[i].state == gsACTIVE)
+                active[count++] = g->boards[i].session;
+        }
+
+        if (epoll_wait(epfd, events, MAX_EPOLL_EVENTS, session_poll_timeout(ctx, active, count)) < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "epoll_wait error %d\n", errno);
+            break;
+        }
+
+        libusb_handle_events_timeout_completed(ctx, &zero_tv, NULL);
+        session_poll_deadlines(active, count);
+
+        for (remaining = 0, i = 0; i < g->board_count; i++)
+        {
+            if (g->boards[i].state == gsACTIVE && session_done(g->boards[i].session))
+                gang_board_done(g, &g->boards[i]);
+            remaining += (g->boards[i].state != gsDONE);
+        }
+    } while (remaining > 0);
+
+    session_epoll_unregister(ctx);
+    close(epfd);
+
+    for (i = 0; i < g->board_count; i++)
+    {
+        if (result == 0)
+            result = g->boards[i].session->result;
+    }
+    return (remaining > 0) ? LIBUSB_ERROR_OTHER : result;
+}
+
+void gang_close(TGang *g)
+{
+    int i = 0;
+
+    for (i = 0; i < g->board_count; i++)
+    {
+        session_free(g->boards[i].session);
+        free(g->boards[i].session);
+        patch_list_free(&g->boards[i].patches);
+        libusb_release_interface(g->boards[i].devh, INTERFACE_NUMBER);
+        libusb_close(g->boards[i].devh);
+    }
+    g->board_count = 0;
+    free_hex_image(&g->base);
+}
+
+/*
+ * Flash every attached bootloader, the gang counterpart of setupChiptoBoot().
+ *
+ * return: 0 if every board flashed, libusb error code otherwise
+ */
+int gang_flash(libusb_context *ctx, uint16_t vid, uint16_t pid, const char *path)
+{
+    TGang *g = malloc(sizeof(TGang));
+    TLatencyStats latency;
+    TConfirm confirm;
+    uint8_t confirming = 0;
+    int result = 0;
+    int i = 0;
+
+    if (g == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    result = gang_open(g, ctx, vid, pid, path);
+    if (result == 0)
+        fprintf(stderr, "Unable to find the device.\n");
+    if (result <= 0)
+    {
+        free(g);
+        return (result == 0) ? LIBUSB_ERROR_NOT_FOUND : result;
+    }
+
+    // registered before the first board can re-boot
+    if (options.confirm && session_confirm_open(&confirm, ctx, vid, pid) == 0)
+    {
+        for (i = 0; i < g->board_count; i++)
+            confirm_add(&confirm, g->boards[i].devh);
+        confirming = 1;
+    }
+
+    result = gang_run(ctx, g);
+
+    // boards that flashed, one wait covers them all
+    if (confirming)
+    {
+        for (i = 0; i < g->board_count; i++)
+        {
+            if (g->boards[i].session->result == 0)
+                confirm.boards[i].rebooted_ns = g->boards[i].session->rebooted;
+        }
+        confirm_wait(&confirm, options.confirm_timeout);
+        for (i = 0; i < g->board_count; i++)
+        {
+            if (confirm.boards[i].rebooted_ns != 0 && session_confirmed(g->boards[i].session, &confirm.boards[i]) < 0 && result == 0)
+                result = LIBUSB_ERROR_TIMEOUT;
+        }
+        confirm_close(&confirm);
+    }
+
+    latency_reset(&latency);
+    for (i = 0; i < g->board_count; i++)
+        latency_merge(&latency, &g->boards[i].session->latency);
+    latency_print("transfer latency", &latency);
+    for (i = 0; i < g->hub_count; i++)
+        printf("hub %s : %d boards : best %.1f kB/s at %d\n", g->hubs[i].path, g->hubs[i].done, g->hubs[i].best_rate / 1e3, g->hubs[i].best_active);
+
+    gang_close(g);
+    free(g);
+
+    if (options.metrics_file[0] != '\0')
+        metrics_write_textfile(options.metrics_file);
+    return result;
+}
@@ -7,6 +7,8 @@
 #include "HexFile.h"
 #include "Types.h"
 #include "Utils.h"
+#include "Window.h"
+#include "Shared.h"
 
 // 1 = file size |
 // 2 = address info |
@@ -21,35 +23,133 @@ const uint8_t boot_line[][16] = {{0x1F, 0xBD, 0x1E, 0x3C, 0x00, 0x40, 0xDE, 0x37
 
 const uint32_t _PIC32Mn_STARTFLASH = 0x1D000000;
 const uint32_t _PIC32Mn_STARTCONF = 0x1FC00000;
-const uint32_t vector[] = {_PIC32Mn_STARTFLASH, _PIC32Mn_STARTFLASH, _PIC32Mn_STARTCONF};
 
-// memory to hold flash data and maintain initial pointers addresses
-uint8_t *prg_ptr = 0;
-uint8_t *prg_ptr_start = 0;
-uint8_t *conf_ptr = 0;
-uint8_t *conf_ptr_start = 0;
+// program flash and config buffers, erased to 0xff
+int hex_image_alloc(THexImage *image, TBootInfo *bootinfo)
+{
+    // allocate memory to image->prg to the size of the mcu flash,
+    // the buffer offset is indexed by address
+    image->prg = (uint8_t *)malloc(bootinfo->ulMcuSize.fValue);
 
-// write program memor variable
-uint32_t bootaddress_space = 0;
+    // allocate memory for configuration data, use size for now,
+    // once I know how many bytes are allocated to configuration
+    // I can reduce this size.
+    image->conf = (uint8_t *)malloc(CONF_BUFFER_SIZE); // bootinfo->uiWriteBlock.fValue.intVal + 1);
+    if (image->prg == NULL || image->conf == NULL)
+    {
+        fprintf(stderr, "Out of memory for the image!\n");
+        free(image->prg);
+        free(image->conf);
+        image->prg = image->conf = NULL;
+        return -1;
+    }
+    memset(image->prg, 0xff, bootinfo->ulMcuSize.fValue);
+    memset(image->conf, 0xff, CONF_BUFFER_SIZE);
 
-// keep track of how many bytes have been extracted form each line
-uint32_t prg_mem_count = 0;
-uint32_t conf_mem_count = 0;
+    image->prg_size = bootinfo->ulMcuSize.fValue;
+    image->block_size = bootinfo->uiEraseBlock.fValue.intVal;
+    image->owned = IMAGE_OWNS_PRG | IMAGE_OWNS_CONF;
+    return 0;
+}
 
-// iterate the vector array in state machine
-int vector_index = 0;
+/*
+ * Decode a converted hex lines header, report types 02 and 04 move the
+ * root address for the lines that follow, data lines are counted into
+ * the cursor. Only the first 6 bytes of line are read.
+ *
+ * return: the lines report type, 01 = end of file
+ */
+uint8_t hex_record_locate(const uint8_t *line, THexCursor *cursor, uint32_t *address, uint8_t *count)
+{
+    // temp struct of type hex descriptors
+    _HEX_ hex = {0};
+
+    // extract byte count and address and report type
+    memcpy((uint8_t *)&hex, line, sizeof(_HEX_));
 
-void overwrite_bootflash_program(void);
-uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity);
+    hex.report.add_lsw = swap_wordbytes(hex.report.add_lsw);
+    *count = hex.report.data_quant;
+
+    // intel hex report type 02 and 04 are Address data types
+    if (hex.report.report == 0x02 | hex.report.report == 0x04)
+    {
+        hex.add_msw = swap_wordbytes(hex.add_msw);
+        cursor->root_address = transform_2words_long(hex.add_msw, hex.report.add_lsw);
+    }
+    else if (hex.report.report == 00)
+    {
+        *address = cursor->root_address + hex.report.add_lsw;
+
+#if DEBUG == 6 // 6 to output memory address read from hex file
+        printf("%08x\n", *address);
+#endif
+        if (*address >= _PIC32Mn_STARTFLASH && *address < _PIC32Mn_STARTCONF)
+        {
+            uint32_t temp_prg_add = (*address - _PIC32Mn_STARTFLASH);
+            cursor->prg_mem_count += temp_prg_add - cursor->prg_mem_last;
+            cursor->prg_mem_last = temp_prg_add;
+        }
+        else if (*address >= _PIC32Mn_STARTCONF)
+        {
+            cursor->conf_mem_count += (uint32_t)hex.report.data_quant;
+        }
+    }
+
+    return hex.report.report;
+}
 
 /*
- * To get chip into bootloader mode to usb needs to interrupt transfer a sequence of packets
- * Packet A : send [STX][cmdSYNC]
- * Packet B : send [STX][cmdINFO]
- * Packet C : send [STX][cmdBOOT]
- * Packet D : send [STX][cmdSYNC]
- * Find the file to send
+ * Place one converted hex line in the image buffers. A record reaching
+ * past program flash or config data is not written and counted in
+ * cursor->rejected, whether or not the file was validated.
+ *
+ * return: the lines report type, 01 = end of file
  */
+uint8_t hex_record_apply(THexImage *image, uint8_t *line, THexCursor *cursor)
+{
+    uint32_t address = 0;
+    uint8_t count = 0;
+    uint8_t report = hex_record_locate(line, cursor, &address, &count);
+
+    if (report != 00)
+        return report;
+
+    if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
+    {
+        uint32_t temp_prg_add = (address - _PIC32Mn_STARTFLASH);
+#if DEBUG == 6
+        printf("prg [%08x] : [%u]\n", temp_prg_add, cursor->prg_mem_count);
+#endif
+
+        if (temp_prg_add > image->prg_size || count > image->prg_size - temp_prg_add)
+        {
+            fprintf(stderr, "record at %08x..%08x is outside program flash, not written\n", address, address + count);
+            cursor->rejected++;
+            return report;
+        }
+        for (uint32_t k = 0; k < count; k++)
+        {
+            *(image->prg + (temp_prg_add) + k) = line[k + sizeof(_HEX_REPORT_)];
+        }
+    }
+    else if (address >= _PIC32Mn_STARTCONF)
+    {
+        uint32_t temp_add = address - _PIC32Mn_STARTCONF;
+
+        if (temp_add > CONF_BUFFER_SIZE || count > CONF_BUFFER_SIZE - temp_add)
+        {
+            fprintf(stderr, "record at %08x..%08x is outside config data, not written\n", address, address + count);
+            cursor->rejected++;
+            return report;
+        }
+        for (int k = 0; k < count; k++)
+        {
+            *(image->conf + (temp_add) + k) = line[k + sizeof(_HEX_REPORT_)];
+        }
+    }
+
+    return report;
+}
 
 /***************************************************
  * Open the hex file extract each line and iterate
@@ -62,23 +162,14 @@ uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity);
  * 2 buffers are used
  *  1) program data,
  *  2) configuration data
+ * then the boot start up page is built from them.
  ***************************************************/
-uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
+uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo, THexImage *image)
 {
-    uint32_t prg_mem_last = 0;
-    uint32_t conf_mem_last = 0;
-    uint32_t prg_byte_count = 0;
-    uint32_t con_byte_count = 0;
-    uint32_t count = 0;
-    uint32_t address = 0;
-    uint32_t root_address = 0;
-
+    THexCursor cursor = {0};
     int c_ = 0;
     // temp buffers
-    uint8_t line[64] = {0};
-
-    // temp struct of type hex descriptors
-    _HEX_ hex = {0};
+    uint8_t line[HEX_LINE_BYTES] = {0};
 
     // get file size to allocate memory
     FILE *fp = NULL;
@@ -92,6 +183,9 @@ uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
         }
     }
 
+    if (digest_file(path, image->digest) != 0)
+        strcpy(image->digest, "unknown");
+
     // need the size ofthe file to allocate memory for linear buffer
     uint32_t size = file_byte_count(fp);
 
@@ -99,487 +193,258 @@ uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
     printf("fc = %u\n", size);
 #endif
 
-    // allocate memory to prg_ptr to the size of chars in the file,
-    // this isn't quite correct as it will over allocate by the
-    // size of 12 bytes "[1][4][2][4]....[1]" I may want to save
-    // space later by using this value
-    prg_ptr = (uint8_t *)malloc(bootinfo->ulMcuSize.fValue);
-    memset(prg_ptr, 0xff, bootinfo->ulMcuSize.fValue);
-    prg_ptr_start = prg_ptr;
-
-    // allocate memory for configuration data, use size for now,
-    // once I know how many bytes are allocated to configuration
-    // I can reduce this size.
-    conf_ptr = (uint8_t *)malloc(0xffff); // bootinfo->uiWriteBlock.fValue.intVal + 1);
-    memset(conf_ptr, 0xff, 0xffff);
-    conf_ptr_start = conf_ptr;
+    if (hex_image_alloc(image, bootinfo) < 0)
+    {
+        fclose(fp);
+        return 0;
+    }
 
     // make sure file starts from begining
     fseek(fp, 0, SEEK_SET);
 
-    // rest the counters if they hold values?
-    prg_mem_count = conf_mem_count = 0;
-
     // iterate through file line by line
     while (c_ != EOF)
     {
-        file_extract_line(fp, line, c_);
+        c_ = file_extract_line(fp, line, c_);
 
-        // extract byte count and address and report type
-        memcpy((uint8_t *)&hex, &line, sizeof(_HEX_));
+        if (hex_record_apply(image, line, &cursor) == 0x01)
+            break;
+    }
+    fclose(fp);
 
-        hex.report.add_lsw = swap_wordbytes(hex.report.add_lsw);
+    // a partial image is never flashed
+    if (cursor.rejected > 0)
+    {
+        fprintf(stderr, "%s: %u records outside the image\n", path, cursor.rejected);
+        free_hex_image(image);
+        return 0;
+    }
 
-        // intel hex report type 02 and 04 are Address data types
-        if (hex.report.report == 0x02 | hex.report.report == 0x04)
-        {
-            hex.add_msw = swap_wordbytes(hex.add_msw);
-            root_address = transform_2words_long(hex.add_msw, hex.report.add_lsw);
-        }
-        else if (hex.report.report == 00)
-        {
-            address = root_address + hex.report.add_lsw;
+    image->prg_mem_count = cursor.prg_mem_count;
+    image->conf_mem_count = cursor.conf_mem_count;
 
-#if DEBUG == 6 // 6 to output memory address read from hex file
-            printf("%08x\n", address);
-#endif
-            if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
-            {
-                uint32_t temp_prg_add = (address - _PIC32Mn_STARTFLASH);
-                prg_byte_count = temp_prg_add - prg_mem_last;
-                prg_mem_count += prg_byte_count;
-                prg_mem_last = temp_prg_add;
-                //  prg_byte_count = (prg_byte_count == 0) ? (uint32_t)hex.report.data_quant : prg_byte_count;
-                prg_byte_count = (uint32_t)hex.report.data_quant;
-                printf("prg [%08x] : [%u]\n", temp_prg_add, prg_mem_count);
-
-                for (uint32_t k = 0; k < prg_byte_count; k++)
-                //  for (int k = 0; k < hex.report.data_quant; k++)
-                {
-                    *(prg_ptr + (temp_prg_add) + k) = line[k + sizeof(_HEX_REPORT_)];
-                }
-            }
-            else if (address >= _PIC32Mn_STARTCONF)
-            {
-                uint32_t temp_add = address - _PIC32Mn_STARTCONF;
-                conf_mem_count += (uint32_t)hex.report.data_quant;
-                // conf_mem_count += (temp_add - conf_mem_last);
-                // conf_mem_last = temp_add;
-                // printf("conf [%u]\n", conf_mem_count);
+    // pre-condition the boot start up page and config vector for bootloading
+    overwrite_bootflash_program(image, bootinfo);
 
-                for (int k = 0; k < hex.report.data_quant; k++)
-                {
-                    *(conf_ptr + (temp_add) + k) = line[k + sizeof(_HEX_REPORT_)];
-                }
-            }
-        }
+    image->file_size = size;
+    return size;
+}
 
-        if (hex.report.report == 0x01)
-            break;
+// ascii record to binary as file_extract_line() does, ':' is skipped wherever it is
+void hex_line_decode(const char *text, uint8_t *line, size_t size)
+{
+    uint8_t pair[2];
+    size_t i = 0;
+
+    memset(line, 0, size);
+    for (; *text != '\0' && *text != '\n' && i < size * 2; text++)
+    {
+        if (*text == ':' || *text == '\r')
+            continue;
+        pair[i & 1] = transform_char_bin((unsigned char)*text);
+        if (i++ & 1)
+            line[i / 2 - 1] = transform_2chars_1bin(pair);
     }
+}
 
-    return size;
+static void compose_conflict(const char *paths[], uint32_t start, uint32_t end, int under, int over)
+{
+    if (end > start)
+        fprintf(stderr, "%s overrides %s at %08x..%08x\n", paths[over], paths[under], start, end);
 }
 
 /*
- * Work engine of bootloader
+ * Several hex files into one image, applied in order so a later file
+ * overlays an earlier one. A byte owner map finds where a later file
+ * changes bytes an earlier one set, those ranges are reported. The digest
+ * covers every file in order so the composition has its own identity.
  *
- * Args: usb_device_handle = from libusb device attach
- *       path = the folder/file path of the hexfile to be loaded
- *
- * return: nothing
+ * return: total size of the files, 0 on failure
  */
-void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
+uint32_t compose_hexfile_data(const char *paths[], int count, TBootInfo *bootinfo, THexImage *image)
 {
-
-    // utils
-    static int8_t trigger = 0;
-    int16_t result = 0;
-    uint8_t _out_only = 0;
-
-    // flash size
-    uint32_t size = 0;
-    uint32_t _temp_flash_erase_ = 0;
-    uint32_t _boot_flash_start = 0;
-    uint32_t _pages_to_flash = 0;
-    uint32_t _page_tracking = 0;
-
-    uint16_t _blocks_to_flash_ = 0, modulo = 0; //(uint32_t)(size / bootinfo_t.ulMcuSize.fValue);
-    double _blocks_temp = 0.0, fractional = 0.0, integer = 0.0, _write_row_error = 0.0;
-    TCmd tcmd_t = cmdINFO;
-    TBootInfo bootinfo_t = {0};
-
-    // hex loading
-    uint32_t load_calc_result = 0;
-    uint16_t hex_load_limit = 0;
-    uint16_t hex_load_tracking = 0;
-    uint16_t hex_load_modulo = 0;
-    uint32_t hex_load_page_tracking = 0;
-
-    // file handling
+    THexCursor cursor;
+    TDigest digest;
+    uint8_t bin[DIGEST_SIZE];
+    uint8_t line[HEX_LINE_BYTES];
+    uint8_t *owner = NULL;
+    uint8_t *dst = NULL;
+    char *text = NULL;
+    size_t cap = 0;
+    ssize_t len = 0;
+    uint32_t address = 0;
+    uint32_t index = 0;
+    uint32_t total = 0;
+    uint32_t conflicts = 0;
+    uint32_t c_start = 0, c_end = 0;
+    int c_under = 0, c_over = 0;
+    uint8_t data_count = 0;
+    uint8_t report = 0;
+    uint8_t done = 0;
+    uint32_t k = 0;
     FILE *fp = NULL;
+    int f = 0;
 
-    // usb specific data
-    static char data_in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
-    static char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    if (hex_image_alloc(image, bootinfo) < 0)
+        return 0;
 
-    while (tcmd_t != cmdDONE)
+    // file index + 1 of the last writer of each prg then conf byte
+    owner = calloc(image->prg_size + CONF_BUFFER_SIZE, 1);
+    if (owner == NULL)
     {
-        /*
-         * main state mc to handle the sequence need by
-         * MikroC bootloader firmware, I believe this conforms
-         * closely to the UHB standard.
-         */
-        {
-            switch (tcmd_t)
-            {
+        fprintf(stderr, "Out of memory for the image!\n");
+        free_hex_image(image);
+        return 0;
+    }
+    digest_init(&digest);
 
-            case cmdSYNC:
-            {
-                _out_only = 0;
-                data_out[0] = 0x0f;
-                data_out[1] = (char)cmdSYNC;
-                for (int i = 9; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
-                {
-                    data_out[i] = 0x0;
-                }
-            }
+    for (f = 0; f < count; f++)
+    {
+        fp = fopen(paths[f], "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Could not find or open %s\n", paths[f]);
+            total = 0;
             break;
-            case cmdINFO:
+        }
+
+        memset(&cursor, 0, sizeof(cursor));
+        done = 0;
+        while ((len = getline(&text, &cap, fp)) >= 0)
+        {
+            total += len;
+            digest_update(&digest, text, len);
+            if (done)
+                continue;
+
+            hex_line_decode(text, line, sizeof(line));
+            report = hex_record_locate(line, &cursor, &address, &data_count);
+            if (report == 0x01)
+                done = 1;
+            if (report != 0x00)
+                continue;
+
+            for (k = 0; k < data_count; k++, address++)
             {
-                _out_only = 0;
-                data_out[0] = 0x0f;
-                data_out[1] = (char)cmdINFO;
-                for (int i = 2; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
+                if (address >= _PIC32Mn_STARTFLASH && address - _PIC32Mn_STARTFLASH < image->prg_size)
                 {
-                    data_out[i] = 0x0;
+                    index = address - _PIC32Mn_STARTFLASH;
+                    dst = image->prg + index;
                 }
-            }
-            break;
-            case cmdBOOT:
-            {
-                _out_only = 0;
-                bootInfo_buffer(&bootinfo_t, data_in);
-                data_out[0] = 0x0f;
-                data_out[1] = (char)cmdBOOT;
-                for (int i = 2; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
+                else if (address >= _PIC32Mn_STARTCONF && address - _PIC32Mn_STARTCONF < CONF_BUFFER_SIZE)
                 {
-                    data_out[i] = 0x0;
+                    index = image->prg_size + (address - _PIC32Mn_STARTCONF);
+                    dst = image->conf + (address - _PIC32Mn_STARTCONF);
                 }
-                // start at address space 1d00
-                vector_index = 0;
-            }
-            break;
-            case cmdNON: // A wait state between commands
-            {
-                // expect a data response back from device
-                _out_only = 0;
-
-                // handle address space from vector array, 1st 1d00 then 1fc0
-                if (vector_index == 1) // boot startup page
-                {
-
-                    prg_ptr = prg_ptr_start; // reset place holder
-
-                    // pre-condition the hex file for bootloading
-                    overwrite_bootflash_program();
-
-                    prg_ptr = prg_ptr_start;                      // reset place holder
-                    size = bootinfo_t.uiEraseBlock.fValue.intVal; // 0x4000
-
-                    //  Work out the boot start vector for a sanity check, MikroC bootloader uses program flash
-                    //  depending on the mcu ie. pic32mz1024efh 0x100000 in size
-                    _boot_flash_start = bootinfo_t.ulBootStart.fValue & V2P;
-                    _boot_flash_start -= bootinfo_t.uiEraseBlock.fValue.intVal;
-
-                    // erase a whole page 0x4000 for configuration vector
-                    hex_load_limit = (bootinfo_t.uiEraseBlock.fValue.intVal / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
-
-                    _temp_flash_erase_ = (_boot_flash_start); //+ (uint32_t)(1 * bootinfo_t.uiEraseBlock.fValue.intVal)) - 1;
-
-#if DEBUG == 2
-                    printf("%08x : %08x : %08x\n", vector[vector_index], _boot_flash_start, _temp_flash_erase_);
-#endif
-                    // pages to flash
-                    _blocks_to_flash_ = 1;
-                    // write hex data from address
-                    bootaddress_space = _boot_flash_start;
-                }
-                else if (vector_index == 2) // config data
-                {
-                    // reset place holders to load from the begining
-                    prg_ptr = prg_ptr_start;
-                    conf_ptr = conf_ptr_start;
-
-                    // offset decided on memory size of chip
-                    if (bootinfo_t.ulMcuSize.fValue == MZ2048)
-                        memcpy(conf_ptr, boot_line[0], sizeof(boot_line[0]));
-                    else
-                        memcpy(conf_ptr, boot_line[1], sizeof(boot_line[1]));
-
-                    // transfer the config data over to program flash data pointer
-                    memcpy(prg_ptr, conf_ptr, 0xffff); // bootinfo_t.uiWriteBlock.fValue.intVal);
-
-                    // hex_load_limit = (0xffff + 1) / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
-                    hex_load_limit = (bootinfo_t.uiWriteBlock.fValue.intVal / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
-
-                    // set the start address to flash erase
-                    _temp_flash_erase_ = (vector[vector_index]);
-
-                    // set erase block to multiple pages of data [1page = 0x4000 for mz]
-                    //_blocks_to_flash_ = (0xffff + 1) / 0x4000;
-                    _blocks_to_flash_ = 1;
+                else
+                    continue;
 
-                    // set the write hex data address space
-                    bootaddress_space = vector[vector_index];
-                }
-                else // program flash region
+                if (owner[index] != 0 && owner[index] != f + 1 && *dst != line[k + sizeof(_HEX_REPORT_)])
                 {
-                    // open hexx file read it line for line and extract the data according
-                    //  to the address, buffer offset is indexed by address
-                    size = condition_hexfile_data(path, &bootinfo_t);
-
-                    // reset place holder
-                    prg_ptr = prg_ptr_start;
-
-                    // hex page tracking works out how many pages will be loaded into PFM 1 page at a time
-                    // bootload firmware has 16bit int so can't load more than 0x8000 bytes at a time
-                    // calculate size of erasing preperation
-                    _pages_to_flash = page_iteration_calc(bootinfo_t.uiEraseBlock.fValue.intVal, prg_mem_count);
-
-                    // set how many iterations of 64byte packets to send over wire with row boundry
-                    //_write_row_error = (double)prg_mem_count / (double)bootinfo_t.uiWriteBlock.fValue.intVal;
-                    // fractional = modf(_write_row_error, &integer);
-                    // load_calc_result = (fractional > 0.0) ? 1 : 0;
-                    // load_calc_result += (uint32_t)integer;
-                    if (_pages_to_flash == 1)
-                    {
-                        load_calc_result = page_iteration_calc(bootinfo_t.uiWriteBlock.fValue.intVal, prg_mem_count);
-                        prg_mem_count = bootinfo_t.uiWriteBlock.fValue.intVal * load_calc_result;
-
-                        load_calc_result = (prg_mem_count / MAX_INTERRUPT_OUT_TRANSFER_SIZE); // + load_calc_result;
-                        hex_load_limit = load_calc_result - 1;                                // size / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
-#if DEBUG == 2
-                        printf("[%u] : [%02f] [%02f] [%u] [%u]\n", _pages_to_flash, _write_row_error, integer, load_calc_result, prg_mem_count);
-#endif
-                    }
-                    else
+                    if (address != c_end || owner[index] - 1 != c_under || f != c_over)
                     {
-                        // load the full page into the chip
-                        hex_load_limit = (bootinfo_t.uiEraseBlock.fValue.intVal - MAX_INTERRUPT_OUT_TRANSFER_SIZE) / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+                        compose_conflict(paths, c_start, c_end, c_under, c_over);
+                        c_start = address;
+                        c_under = owner[index] - 1;
+                        c_over = f;
                     }
-
-                    printf("%u : %u : %u : %d\n", _pages_to_flash, prg_mem_count, load_calc_result, _blocks_to_flash_);
-
-                    // erase at least 1 page if there are zero blocks to flash.
-                    _blocks_to_flash_ = _pages_to_flash;
-                    if (_blocks_to_flash_ == 0)
-                        _blocks_to_flash_ = 1;
-
-                    _page_tracking = 0;
-                    bootaddress_space = vector[vector_index];
-
-                    _temp_flash_erase_ = (vector[vector_index]) + (uint32_t)(_blocks_to_flash_ * bootinfo_t.uiEraseBlock.fValue.intVal);
-                }
-
-#if DEBUG == 4
-                printf("trnsfer size:= %d\n", size);
-#endif
-
-                if (size > 0)
-                {
-                    trigger = 1;
-                    // reset flash pointer to start
-                    prg_ptr = prg_ptr_start;
-                }
-                else
-                {
-                    // no point in continuing if the file is empty
-                    exit(EXIT_FAILURE);
-                }
-
-#if DEBUG == 3
-                printf("vector indexed at [%02x]\n", vector_index);
-#elif DEBUG == 4
-                printf("bootaddress_space [%08x]\tflash erase start [%08x]\tblock to flash [%04x]\n", bootaddress_space, _temp_flash_erase_, _blocks_to_flash_);
-#endif
-            }
-            break;
-            case cmdERASE:
-            {
-                // expect a data response back from device
-                _out_only = 0;
-                // bootloader needs startaddress "page boundry" and quantity of pages to to erase
-                // erase for MikroC starts high and subracts from quantity after each page has
-                // been erased and quantity == 0
-                data_out[0] = 0x0f;
-                data_out[1] = (char)cmdERASE;
-                memcpy(data_out + 2, &_temp_flash_erase_, sizeof(uint32_t));
-                memcpy(data_out + 6, &_blocks_to_flash_, sizeof(int16_t));
-                for (int i = 9; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
-                {
-                    data_out[i] = 0x0;
+                    c_end = address + 1;
+                    conflicts++;
                 }
+                *dst = line[k + sizeof(_HEX_REPORT_)];
+                owner[index] = f + 1;
             }
-            break;
-            case cmdWRITE:
-            {
-                // expect no data back continously stream data.
-                _out_only = 1;
+        }
+        fclose(fp);
 
-                if (vector_index == 2)
-                    size = bootinfo_t.uiWriteBlock.fValue.intVal; // 2048;
-                else if (vector_index == 1)
-                    size = bootinfo_t.uiEraseBlock.fValue.intVal; // 0x4000;
-                else
-                {
-                    if (_pages_to_flash <= 1)
-                        size = prg_mem_count;
-                    else
-                    {
-                        size = bootinfo_t.uiEraseBlock.fValue.intVal;
-                        if (_page_tracking > 0)
-                            bootaddress_space += (bootinfo_t.uiEraseBlock.fValue.intVal);
-                    }
-                }
+        // the furthest any file reaches into program flash
+        if (cursor.prg_mem_count > image->prg_mem_count)
+            image->prg_mem_count = cursor.prg_mem_count;
+        image->conf_mem_count += cursor.conf_mem_count;
+    }
+    compose_conflict(paths, c_start, c_end, c_under, c_over);
+    free(text);
+    free(owner);
 
-                hex_load_tracking = 0;
-                data_out[0] = 0x0f;
-                data_out[1] = (char)cmdWRITE;
-                memcpy(data_out + 2, &bootaddress_space, sizeof(uint32_t));
-                memcpy(data_out + 6, &size, sizeof(int16_t));
-                for (int i = 9; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
-                {
-                    data_out[i] = 0x0;
-                }
+    if (total == 0)
+    {
+        free_hex_image(image);
+        return 0;
+    }
+    if (conflicts > 0)
+        fprintf(stderr, "%u bytes differ between files, later files win\n", conflicts);
 
-                // reset the pointer position
-                if (_page_tracking == 0)
-                    prg_ptr = prg_ptr_start;
-            }
-            break;
-            case cmdHEX:
-            {
-                // expect no data back continously stream data.
-                _out_only = 1;
+    digest_final(&digest, bin);
+    digest_hex(bin, image->digest);
 
-                hex_load_tracking++;
+    // pre-condition the boot start up page and config vector for bootloading
+    overwrite_bootflash_program(image, bootinfo);
 
-                // use the flash buffer to stream 64 byte slices at a time
-                if (hex_load_tracking > hex_load_limit)
-                {
-                    if (_page_tracking > _pages_to_flash)
-                        tcmd_t = cmdREBOOT;
-                    else
-                    {
-                        tcmd_t = cmdERASE;
-                        _page_tracking++;
-                    }
-                    _out_only = 0;
-                }
+    image->file_size = total;
+    return total;
+}
 
-                load_hex_buffer(data_out, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
-            }
-            break;
-            case cmdREBOOT:
-            {
-                _out_only = 2;
+void free_hex_image(THexImage *image)
+{
+    uint32_t i = 0;
 
-#if DEBUG == 0
-                printf("%u : %u\n", prg_mem_count, conf_mem_count);
-#endif
+    if (image->prg_blocks != NULL)
+    {
+        for (i = 0; i < image->prg_size / image->block_size; i++)
+            free(image->prg_blocks[i]);
+        free(image->prg_blocks);
+    }
+    if (image->owned & IMAGE_OWNS_PRG)
+        free(image->prg);
+    if (image->owned & IMAGE_OWNS_CONF)
+        free(image->conf);
+    if (image->owned & IMAGE_OWNS_BOOT)
+        free(image->boot);
+    hex_window_free(image->window);
+    shared_release(image->shared);
+    memset(image, 0, sizeof(THexImage));
+}
 
-                // free memory created for flas_pointer
+/*
+ * Make image a per device view of base without copying or re-parsing,
+ * base must outlive the view.
+ */
+void hex_image_share(THexImage *image, const THexImage *base)
+{
+    memcpy(image, base, sizeof(THexImage));
+    image->owned = 0;
+    image->prg_blocks = NULL;
+    image->window = NULL;
+    image->shared = NULL;
+}
 
-                /*
-                 * re-boot command will cause the app to exit due to timeout from
-                 * usb response, may want to set _out_only to 1 to sto exception.
-                 * extra handling of usb may be needed if _out_only set to 1.
-                 */
+/*
+ * Where the bytes for offset into one of the image buffers are read from.
+ * A page never straddles an erase block so the pointer is good for one page.
+ * NULL only if a windowed block couldn't be read back.
+ */
+uint8_t *hex_image_data(const THexImage *image, THexSource source, uint32_t offset)
+{
+    uint8_t *src = NULL;
+    uint32_t block = 0;
 
-                vector_index++;
-                if (vector_index > 2)
-                {
-                    if (prg_ptr != NULL)
-                    {
-                        prg_ptr = prg_ptr_start;
-                        // free(flash_ptr);
-                        // flash_ptr = flash_ptr_start = NULL;
-                    }
-                    data_out[0] = 0x0f;
-                    data_out[1] = (char)cmdREBOOT;
-                    for (int i = 2; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
-                    {
-                        // prg_ptr = prg_ptr_start;
-                        data_out[i] = 0x0;
-                    }
-                }
-                else
-                {
-                    // start back at data prep for config vector
-                    tcmd_t = cmdNON;
-                }
-            }
-            break;
-            default:
-                break;
-            }
-        }
-        // Sendin the data via usb
-        if (tcmd_t != cmdNON && !(tcmd_t == cmdREBOOT && _out_only == 1))
-        {
-            if (boot_interrupt_transfers(devh, data_in, data_out, _out_only))
-            {
-                fprintf(stderr, "Transfered data complete...\n");
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (source == hsBOOT)
+        return image->boot + offset;
+    if (source == hsCONF)
+        return image->conf + offset;
 
-        /*
-         * extra state machine to help sequencer? this may be taken away in
-         * for refinement.
-         */
-        {
-            switch (tcmd_t)
-            {
-            case cmdINFO:
-                tcmd_t = cmdBOOT;
-                break;
-            case cmdBOOT:
-                tcmd_t = cmdNON;
-                break;
-            case cmdNON:
-                if (trigger == 1)
-                {
-                    if (vector_index == 0)
-                        tcmd_t = cmdSYNC;
-                    else
-                        tcmd_t = cmdERASE;
-                    trigger = 0;
-                }
-                break;
-            case cmdSYNC:
-                tcmd_t = cmdERASE;
-                printf("Erase\n");
-                break;
-            case cmdERASE:
-                tcmd_t = cmdWRITE /*cmdREBOOT*/;
-                printf("Write\n");
-                break;
-            case cmdWRITE:
-                tcmd_t = cmdHEX;
-                printf("HEX\n");
-                break;
-            case cmdHEX:
-
-                break;
-            case cmdREBOOT:
-                break;
-            default:
-                break;
-            }
-        }
+    if (image->prg_blocks != NULL)
+    {
+        block = offset / image->block_size;
+        if (image->prg_blocks[block] != NULL)
+            return image->prg_blocks[block] + (offset % image->block_size);
+    }
+    if (image->window != NULL)
+    {
+        src = hex_window_block(image->window, offset / image->block_size);
+        return (src != NULL) ? src + (offset % image->block_size) : NULL;
     }
+    return image->prg + offset;
 }
 
 /*Display the boot info need for erase and write data*/
@@ -602,16 +467,16 @@ void bootInfo_buffer(void *boot_info, const void *buffer)
 /*
  * @param uint32_t size
  *
- * Stream the data 64 byte slices using
+ * Stream the data 64 byte slices from the src cursor using
  *
  * return none
  */
-void load_hex_buffer(char *data, uint16_t iterable)
+void load_hex_buffer(char *data, uint8_t **src, uint16_t iterable)
 {
     uint32_t i = 0;
     for (i = 0; i < iterable; i++)
     {
-        *(data + i) = *(prg_ptr++);
+        *(data + i) = *((*src)++);
 #if DEBUG == 3
         printf("%02x", *(data + i) & 0xff);
 #endif
@@ -637,13 +502,20 @@ uint32_t file_byte_count(FILE *fp)
     return size;
 }
 
-void file_extract_line(FILE *fp, char *buf, int fp_result)
+/*
+ * Convert the next line to binary in buf, HEX_LINE_BYTES long, anything
+ * a longer line has past that is dropped.
+ *
+ * return: the last character read, EOF once the file has been read
+ */
+int file_extract_line(FILE *fp, char *buf, int fp_result)
 {
     int i = 0, j = 0;
     char c;
     uint8_t temp_[3] = {0};
 
-    while (fp_result = fgetc(fp))
+    // a file without an end of file record runs out here
+    while ((fp_result = fgetc(fp)) != EOF)
     {
 
         c = (unsigned char)fp_result;
@@ -665,7 +537,8 @@ void file_extract_line(FILE *fp, char *buf, int fp_result)
 
         if (j > 1)
         {
-            *(buf + i) = transform_2chars_1bin(temp_);
+            if (i < HEX_LINE_BYTES)
+                *(buf + i) = transform_2chars_1bin(temp_);
             j = 0;
 #if DEBUG == 4
             printf("[%02x] ", buf[i]);
@@ -673,18 +546,29 @@ void file_extract_line(FILE *fp, char *buf, int fp_result)
             i++;
         }
     }
+    return fp_result;
 }
 
-void overwrite_bootflash_program(void)
+/*
+ * The applications start up line at 1fc00000 moves to the last 16 bytes
+ * of the page below the bootloader, the bootloaders own line takes its
+ * place in the config data.
+ */
+void overwrite_bootflash_program(THexImage *image, TBootInfo *bootinfo)
 {
-    int i = 0;
-    uint8_t line[16];
-    memcpy(line, conf_ptr, 16);
-    for (i = 0; i < (0x4000 - 16); i++)
-    {
-        *(prg_ptr++) = 0xff;
-    }
-    memcpy(prg_ptr, line, 16);
+    uint16_t page_size = bootinfo->uiEraseBlock.fValue.intVal;
+
+    image->boot_address = (bootinfo->ulBootStart.fValue & V2P) - page_size;
+    image->boot = (uint8_t *)malloc(page_size);
+    image->owned |= IMAGE_OWNS_BOOT;
+    memset(image->boot, 0xff, page_size - 16);
+    memcpy(image->boot + (page_size - 16), image->conf, 16);
+
+    // offset decided on memory size of chip
+    if (bootinfo->ulMcuSize.fValue == MZ2048)
+        memcpy(image->conf, boot_line[0], sizeof(boot_line[0]));
+    else
+        memcpy(image->conf, boot_line[1], sizeof(boot_line[1]));
 }
 
 uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity)
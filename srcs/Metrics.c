@@ -0,0 +1,605 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+
+#include "Metrics.h"
+#include "USB.h"
+
+#define METRICS_LINE_SIZE 256
+#define METRICS_MAX_LINES 1024
+
+// upper bounds of the flash duration histogram in seconds
+static const double flash_buckets[METRICS_FLASH_BUCKETS] = {5, 10, 15, 20, 30, 45, 60, 90, 120, 300};
+// re-boot to the application enumerating
+static const double enumerate_buckets[METRICS_FLASH_BUCKETS] = {0.1, 0.25, 0.5, 1, 1.5, 2, 3, 5, 10, 30};
+
+static const char *fail_reasons[failCOUNT] = {"timeout", "no_device", "stall", "io", "image", "other"};
+
+static TMetricsSlot slots[METRICS_SLOTS];
+static char fixture_label[METRICS_LABEL_SIZE * 2] = "default";
+
+// transfer level counters, [0] = out, [1] = in
+static uint64_t usb_transfers[2];
+static uint64_t usb_bytes[2];
+static uint64_t usb_errors[2];
+
+/*
+ * Families in the order they are written, histograms are
+ * matched on their _bucket / _sum / _count series as well.
+ */
+static const struct
+{
+    const char *name;
+    const char *type;
+    const char *help;
+} families[] = {
+    {"mikro_hb_boards_total", "counter", "Boards flashed, by result."},
+    {"mikro_hb_board_failures_total", "counter", "Failed boards, by reason."},
+    {"mikro_hb_bytes_written_total", "counter", "Image bytes streamed to the device."},
+    {"mikro_hb_flash_duration_seconds", "histogram", "Time from the first packet to re-boot."},
+    {"mikro_hb_boards_confirmed_total", "counter", "Re-booted boards, by whether the application was seen."},
+    {"mikro_hb_reenumeration_seconds", "histogram", "Time from re-boot to the application enumerating."},
+    {"mikro_hb_cycle_seconds", "histogram", "Time from the bootloader being opened to the application enumerating."},
+    {"mikro_hb_usb_transfers_total", "counter", "Interrupt transfers, by direction."},
+    {"mikro_hb_usb_bytes_total", "counter", "Interrupt transfer bytes, by direction."},
+    {"mikro_hb_usb_errors_total", "counter", "Failed interrupt transfers, by direction."},
+};
+
+#define FAMILY_COUNT (sizeof(families) / sizeof(families[0]))
+
+typedef struct
+{
+    char key[METRICS_LINE_SIZE];
+    double value;
+} TMetricLine;
+
+// what has already been added to the textfile by this process
+static TMetricLine *flushed;
+static int flushed_count;
+
+static void counter_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// labels come from the device, keep them printable and quote free
+static void label_copy(char *dst, const char *src, size_t size)
+{
+    size_t i = 0;
+
+    for (i = 0; i + 1 < size && src[i] != '\0'; i++)
+        dst[i] = (src[i] == '"' || src[i] == '\\' || src[i] < ' ' || src[i] > '~') ? '_' : src[i];
+    dst[i] = '\0';
+    if (i == 0)
+        strcpy(dst, "unknown");
+}
+
+void metrics_init(const char *fixture)
+{
+    char host[64] = {0};
+
+    if (fixture != NULL && fixture[0] != '\0')
+        label_copy(fixture_label, fixture, sizeof(fixture_label));
+    else if (gethostname(host, sizeof(host) - 1) == 0)
+        label_copy(fixture_label, host, sizeof(fixture_label));
+}
+
+/*
+ * Find or claim the slot for a label pair without locking, a slot
+ * being claimed is waited on so two callers never publish the same pair.
+ *
+ * return: slot index, -1 when all slots are taken
+ */
+int metrics_slot(const char *profile, const char *digest)
+{
+    char p[METRICS_LABEL_SIZE];
+    char d[METRICS_LABEL_SIZE];
+    int expected = 0;
+    int state = 0;
+    int i = 0;
+
+    label_copy(p, profile, sizeof(p));
+    label_copy(d, digest, sizeof(d));
+
+    for (;;)
+    {
+        for (i = 0; i < METRICS_SLOTS; i++)
+        {
+            while ((state = __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE)) == 1)
+                ;
+            if (state == 0)
+                break;
+            if (strcmp(slots[i].profile, p) == 0 && strcmp(slots[i].digest, d) == 0)
+                return i;
+        }
+
+        if (i == METRICS_SLOTS)
+            return -1;
+
+        expected = 0;
+        if (__atomic_compare_exchange_n(&slots[i].state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            strcpy(slots[i].profile, p);
+            strcpy(slots[i].digest, d);
+            __atomic_store_n(&slots[i].state, 2, __ATOMIC_RELEASE);
+            return i;
+        }
+        // lost the race, scan again in case it was for the same labels
+    }
+}
+
+TFailReason metrics_fail_reason(int result)
+{
+    switch (result)
+    {
+    case LIBUSB_ERROR_TIMEOUT:
+        return failTIMEOUT;
+    case LIBUSB_ERROR_NO_DEVICE:
+        return failNO_DEVICE;
+    case LIBUSB_ERROR_PIPE:
+        return failSTALL;
+    case LIBUSB_ERROR_IO:
+        return failIO;
+    default:
+        return failOTHER;
+    }
+}
+
+static void histogram_add(uint64_t *buckets, const double *bounds, uint64_t *count, uint64_t *sum_us, uint64_t ns)
+{
+    double seconds = (double)ns / 1e9;
+    int i = 0;
+
+    counter_add(count, 1);
+    counter_add(sum_us, ns / 1000);
+    for (i = 0; i < METRICS_FLASH_BUCKETS; i++)
+    {
+        if (seconds <= bounds[i])
+        {
+            counter_add(&buckets[i], 1);
+            break;
+        }
+    }
+}
+
+// result = zero on success or the libusb error code the session ended on, reason labels a failure
+void metrics_board_done(int slot, int result, TFailReason reason, uint64_t duration_ns, uint64_t bytes)
+{
+    TMetricsSlot *m = NULL;
+
+    if (slot < 0 || slot >= METRICS_SLOTS)
+        return;
+    m = &slots[slot];
+
+    if (result != 0)
+    {
+        counter_add(&m->boards_failed[reason], 1);
+        return;
+    }
+
+    counter_add(&m->boards_ok, 1);
+    counter_add(&m->bytes_written, bytes);
+    histogram_add(m->duration_buckets, flash_buckets, &m->duration_count, &m->duration_sum_us, duration_ns);
+}
+
+// confirmed = the application came up, the times are only used then
+void metrics_board_confirmed(int slot, int confirmed, uint64_t enumerate_ns, uint64_t cycle_ns)
+{
+    TMetricsSlot *m = NULL;
+
+    if (slot < 0 || slot >= METRICS_SLOTS)
+        return;
+    m = &slots[slot];
+
+    if (!confirmed)
+    {
+        counter_add(&m->unconfirmed, 1);
+        return;
+    }
+    counter_add(&m->confirmed, 1);
+    histogram_add(m->enumerate_buckets, enumerate_buckets, &m->enumerate_count, &m->enumerate_sum_us, enumerate_ns);
+    histogram_add(m->cycle_buckets, flash_buckets, &m->cycle_count, &m->cycle_sum_us, cycle_ns);
+}
+
+// called for every OUT and IN transfer, result = bytes or libusb error code
+void metrics_transfer(uint8_t in, int result)
+{
+    in = in ? 1 : 0;
+    counter_add(&usb_transfers[in], 1);
+    if (result < 0)
+        counter_add(&usb_errors[in], 1);
+    else
+        counter_add(&usb_bytes[in], (uint64_t)result);
+}
+
+static void render_family(FILE *fp, size_t f)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", families[f].name, families[f].help, families[f].name, families[f].type);
+}
+
+#define LABELS "fixture=\"%s\",profile=\"%s\",digest=\"%s\""
+static void render_histogram(FILE *fp, const char *name, const TMetricsSlot *m, const double *bounds,
+                             const uint64_t *buckets, const uint64_t *count, const uint64_t *sum_us)
+{
+    uint64_t cumulative = 0;
+    int j = 0;
+
+    for (j = 0; j < METRICS_FLASH_BUCKETS; j++)
+    {
+        cumulative += counter_get(&buckets[j]);
+        fprintf(fp, "%s_bucket{" LABELS ",le=\"%g\"} %lu\n",
+                name, fixture_label, m->profile, m->digest, bounds[j], (unsigned long)cumulative);
+    }
+    fprintf(fp, "%s_bucket{" LABELS ",le=\"+Inf\"} %lu\n",
+            name, fixture_label, m->profile, m->digest, (unsigned long)counter_get(count));
+    fprintf(fp, "%s_sum{" LABELS "} %.6f\n", name, fixture_label, m->profile, m->digest, (double)counter_get(sum_us) / 1e6);
+    fprintf(fp, "%s_count{" LABELS "} %lu\n", name, fixture_label, m->profile, m->digest, (unsigned long)counter_get(count));
+}
+
+// samples only, one "name{labels} value" per line
+static void render_samples(FILE *fp)
+{
+    static const char *dir[2] = {"out", "in"};
+    TMetricsSlot *m = NULL;
+    uint64_t failed = 0;
+    int i = 0, j = 0;
+
+    for (i = 0; i < METRICS_SLOTS; i++)
+    {
+        m = &slots[i];
+        if (__atomic_load_n(&m->state, __ATOMIC_ACQUIRE) != 2)
+            continue;
+
+        for (failed = 0, j = 0; j < failCOUNT; j++)
+            failed += counter_get(&m->boards_failed[j]);
+        fprintf(fp, "mikro_hb_boards_total{" LABELS ",result=\"ok\"} %lu\n",
+                fixture_label, m->profile, m->digest, (unsigned long)counter_get(&m->boards_ok));
+        fprintf(fp, "mikro_hb_boards_total{" LABELS ",result=\"failed\"} %lu\n",
+                fixture_label, m->profile, m->digest, (unsigned long)failed);
+        for (j = 0; j < failCOUNT; j++)
+            fprintf(fp, "mikro_hb_board_failures_total{" LABELS ",reason=\"%s\"} %lu\n",
+                    fixture_label, m->profile, m->digest, fail_reasons[j], (unsigned long)counter_get(&m->boards_failed[j]));
+        fprintf(fp, "mikro_hb_bytes_written_total{" LABELS "} %lu\n",
+                fixture_label, m->profile, m->digest, (unsigned long)counter_get(&m->bytes_written));
+
+        render_histogram(fp, "mikro_hb_flash_duration_seconds", m, flash_buckets,
+                         m->duration_buckets, &m->duration_count, &m->duration_sum_us);
+
+        // only once a run has asked for confirmation
+        if (counter_get(&m->confirmed) + counter_get(&m->unconfirmed) == 0)
+            continue;
+        fprintf(fp, "mikro_hb_boards_confirmed_total{" LABELS ",result=\"up\"} %lu\n",
+                fixture_label, m->profile, m->digest, (unsigned long)counter_get(&m->confirmed));
+        fprintf(fp, "mikro_hb_boards_confirmed_total{" LABELS ",result=\"missing\"} %lu\n",
+                fixture_label, m->profile, m->digest, (unsigned long)counter_get(&m->unconfirmed));
+        render_histogram(fp, "mikro_hb_reenumeration_seconds", m, enumerate_buckets,
+                         m->enumerate_buckets, &m->enumerate_count, &m->enumerate_sum_us);
+        render_histogram(fp, "mikro_hb_cycle_seconds", m, flash_buckets,
+                         m->cycle_buckets, &m->cycle_count, &m->cycle_sum_us);
+    }
+#undef LABELS
+
+    for (i = 0; i < 2; i++)
+    {
+        fprintf(fp, "mikro_hb_usb_transfers_total{fixture=\"%s\",direction=\"%s\"} %lu\n",
+                fixture_label, dir[i], (unsigned long)counter_get(&usb_transfers[i]));
+        fprintf(fp, "mikro_hb_usb_bytes_total{fixture=\"%s\",direction=\"%s\"} %lu\n",
+                fixture_label, dir[i], (unsigned long)counter_get(&usb_bytes[i]));
+        fprintf(fp, "mikro_hb_usb_errors_total{fixture=\"%s\",direction=\"%s\"} %lu\n",
+                fixture_label, dir[i], (unsigned long)counter_get(&usb_errors[i]));
+    }
+}
+
+// family index of a sample key, -1 if it isn't one of ours
+static int line_family(const char *key)
+{
+    size_t f = 0;
+    size_t n = 0;
+
+    for (f = 0; f < FAMILY_COUNT; f++)
+    {
+        n = strlen(families[f].name);
+        if (strncmp(key, families[f].name, n) != 0)
+            continue;
+        if (key[n] == '{' || key[n] == '\0')
+            return (int)f;
+        if (strcmp(families[f].type, "histogram") == 0 &&
+            (strncmp(key + n, "_bucket{", 8) == 0 || strncmp(key + n, "_sum{", 5) == 0 || strncmp(key + n, "_count{", 7) == 0))
+            return (int)f;
+    }
+    return -1;
+}
+
+// split "key value" lines into the table, returns lines read
+static int parse_lines(FILE *fp, TMetricLine *lines, int max)
+{
+    char buf[METRICS_LINE_SIZE + 64];
+    char *space = NULL;
+    int count = 0;
+
+    while (count < max && fgets(buf, sizeof(buf), fp) != NULL)
+    {
+        if (buf[0] == '#' || (space = strrchr(buf, ' ')) == NULL)
+            continue;
+        *space = '\0';
+        if (strlen(buf) >= METRICS_LINE_SIZE || line_family(buf) < 0)
+            continue;
+        strcpy(lines[count].key, buf);
+        lines[count].value = strtod(space + 1, NULL);
+        count++;
+    }
+    return count;
+}
+
+static TMetricLine *find_line(TMetricLine *lines, int count, const char *key)
+{
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (strcmp(lines[i].key, key) == 0)
+            return &lines[i];
+    }
+    return NULL;
+}
+
+void metrics_render(FILE *fp)
+{
+    TMetricLine *lines = NULL;
+    char *text = NULL;
+    size_t size = 0;
+    FILE *mem = open_memstream(&text, &size);
+    int count = 0;
+    int i = 0;
+    size_t f = 0;
+
+    if (mem == NULL)
+        return;
+    render_samples(mem);
+    fclose(mem);
+
+    lines = malloc(sizeof(TMetricLine) * METRICS_MAX_LINES);
+    mem = fmemopen(text, size, "r");
+    if (lines != NULL && mem != NULL)
+    {
+        count = parse_lines(mem, lines, METRICS_MAX_LINES);
+        for (f = 0; f < FAMILY_COUNT; f++)
+        {
+            render_family(fp, f);
+            for (i = 0; i < count; i++)
+            {
+                if (line_family(lines[i].key) == (int)f)
+                    fprintf(fp, "%s %.15g\n", lines[i].key, lines[i].value);
+            }
+        }
+    }
+
+    if (mem != NULL)
+        fclose(mem);
+    free(lines);
+    free(text);
+}
+
+/*
+ * node_exporter textfile collector output. Several mikro_hb processes
+ * may share one file so under an flock the file is read back, the
+ * increase since this process last wrote is added on, and the result
+ * is written to a temp file and renamed over the old one.
+ *
+ * return: 0 on success, -1 on failure
+ */
+int metrics_write_textfile(const char *path)
+{
+    char tmp_path[512];
+    char lock_path[512];
+    TMetricLine *now = NULL;
+    TMetricLine *file = NULL;
+    TMetricLine *line = NULL;
+    TMetricLine *prev = NULL;
+    char *text = NULL;
+    size_t size = 0;
+    int now_count = 0, file_count = 0;
+    int lock_fd = -1;
+    int result = -1;
+    int i = 0;
+    size_t f = 0;
+    FILE *fp = NULL;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+
+    now = malloc(sizeof(TMetricLine) * METRICS_MAX_LINES);
+    file = malloc(sizeof(TMetricLine) * METRICS_MAX_LINES);
+    if (flushed == NULL)
+        flushed = calloc(METRICS_MAX_LINES, sizeof(TMetricLine));
+    if (now == NULL || file == NULL || flushed == NULL)
+        goto done;
+
+    fp = open_memstream(&text, &size);
+    if (fp == NULL)
+        goto done;
+    render_samples(fp);
+    fclose(fp);
+    fp = fmemopen(text, size, "r");
+    if (fp == NULL)
+        goto done;
+    now_count = parse_lines(fp, now, METRICS_MAX_LINES);
+    fclose(fp);
+
+    lock_fd = open(lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0)
+    {
+        fprintf(stderr, "metrics: unable to lock %s (%s)\n", lock_path, strerror(errno));
+        goto done;
+    }
+
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        file_count = parse_lines(fp, file, METRICS_MAX_LINES);
+        fclose(fp);
+    }
+
+    // add what changed since the last write onto the file's totals
+    for (i = 0; i < now_count; i++)
+    {
+        prev = find_line(flushed, flushed_count, now[i].key);
+        line = find_line(file, file_count, now[i].key);
+        if (line == NULL && file_count < METRICS_MAX_LINES)
+        {
+            line = &file[file_count++];
+            strcpy(line->key, now[i].key);
+            line->value = 0;
+        }
+        if (line != NULL)
+            line->value += now[i].value - ((prev != NULL) ? prev->value : 0);
+    }
+
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "metrics: unable to write %s (%s)\n", tmp_path, strerror(errno));
+        goto done;
+    }
+    for (f = 0; f < FAMILY_COUNT; f++)
+    {
+        render_family(fp, f);
+        for (i = 0; i < file_count; i++)
+        {
+            if (line_family(file[i].key) == (int)f)
+                fprintf(fp, "%s %.15g\n", file[i].key, file[i].value);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "metrics: unable to replace %s (%s)\n", path, strerror(errno));
+        unlink(tmp_path);
+        goto done;
+    }
+
+    memcpy(flushed, now, sizeof(TMetricLine) * now_count);
+    flushed_count = now_count;
+    result = 0;
+
+done:
+    if (lock_fd >= 0)
+        close(lock_fd);
+    free(now);
+    free(file);
+    free(text);
+    return result;
+}
+
+static void *metrics_http_thread(void *arg)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\n\r\n";
+    int listen_fd = (int)(intptr_t)arg;
+    char request[1024];
+    char *body = NULL;
+    size_t size = 0;
+    FILE *fp = NULL;
+    int fd = 0;
+
+    for (;;)
+    {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // any request gets the metrics, the request itself is not inspected
+        if (read(fd, request, sizeof(request)) >= 0)
+        {
+            fp = open_memstream(&body, &size);
+            if (fp != NULL)
+            {
+                metrics_render(fp);
+                fclose(fp);
+                write(fd, header, sizeof(header) - 1);
+                write(fd, body, size);
+                free(body);
+                body = NULL;
+            }
+        }
+        close(fd);
+    }
+
+    close(listen_fd);
+    return NULL;
+}
+
+/*
+ * Serve the metrics over http from a detached thread.
+ * address = "port" (binds 127.0.0.1) or "ip:port"
+ *
+ * return: 0 on success, -1 on failure
+ */
+int metrics_listen(const char *address)
+{
+    struct sockaddr_in addr = {0};
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+    pthread_attr_t attr;
+    pthread_t thread;
+    int one = 1;
+    int fd = 0;
+
+    if (colon != NULL)
+    {
+        if ((size_t)(colon - address) >= sizeof(host))
+            return -1;
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        address = colon + 1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(address));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "metrics: bad listen address %s\n", host);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0)
+    {
+        fprintf(stderr, "metrics: unable to listen on %s:%s (%s)\n", host, address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, metrics_http_thread, (void *)(intptr_t)fd) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        close(fd);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
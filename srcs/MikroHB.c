@@ -36,8 +36,16 @@ Use the -I option if needed to specify the path to the libusb.h header file. For
 #include "HexFile.h"
 #include "Utils.h"
 #include "USB.h"
-
-const int INTERFACE_NUMBER = 0;
+#include "Session.h"
+#include "Options.h"
+#include "Metrics.h"
+#include "Capture.h"
+#include "Watch.h"
+#include "Gang.h"
+#include "Probe.h"
+#include "Progress.h"
+#include "Coordinator.h"
+#include "Worker.h"
 
 int main(int argc, char **argv)
 {
@@ -50,37 +58,68 @@ int main(int argc, char **argv)
 	struct libusb_init_option *opts = {0};
 	int device_ready = 0;
 	int result = 0;
-	// path to file
-	char _path[250] = {0};
 
 	// condition file path
-	if (argc < 2)
+	if (parse_options(argc, argv) < 0)
 	{
-		fprintf(stderr, "No path to hex!\n");
 		return 0;
 	}
-	else
+	// pre-warm the image cache from build output, no device involved
+	if (options.watch_count > 0)
+	{
+		return (watch_run(options.watch, options.watch_count, options.cache) < 0) ? EXIT_FAILURE : 0;
+	}
+	// the batch goes out to workers, no device on this host
+	if (options.coordinate[0] != '\0')
 	{
-		size_t len_s = strlen(argv[1]);
+		return (coordinator_run(options.coordinate, options.path, options.workers) < 0) ? EXIT_FAILURE : 0;
+	}
 
-#if DEBUG == 5
-		printf("\nEnter the path of the hex file... ");
-		fgets(path, sizeof(path), stdin);
-#endif
+	// show the path? sanity check.
+	if (options.probe == 0 && options.worker[0] == '\0')
+		printf("\t*** %s ***\n", options.path);
 
-		// remove the carriage return and or newline feed from path if it exists
-		if (len_s > 0 && (argv[1][len_s - 1] == '\r' || argv[1][len_s - 1] == '\n'))
-		{
-			argv[1][len_s - 1] = '\0'; // remove \r | \n
-		}
-		strcpy(_path, argv[1]);
-		// show the path? sanity check.
-		printf("\t*** %s ***\n", _path);
+	metrics_init(options.fixture);
+	if (options.progress[0] != '\0' && progress_open(options.progress) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (options.metrics_listen[0] != '\0')
+	{
+		metrics_listen(options.metrics_listen);
 	}
 
 	result = libusb_init_context(NULL, NULL, 0);
 
-	if (result >= 0)
+	if (result >= 0 && options.worker[0] != '\0')
+	{
+		// one board per job until the coordinator runs out
+		result = worker_run(NULL, options.worker, VENDOR_ID, PRODUCT_ID);
+		libusb_exit(NULL);
+		return (result < 0) ? EXIT_FAILURE : 0;
+	}
+	else if (result >= 0 && options.gang)
+	{
+		// every board on the bus, scheduled by hub
+		result = gang_flash(NULL, VENDOR_ID, PRODUCT_ID, options.path);
+		libusb_exit(NULL);
+		if (result != 0)
+		{
+			fprintf(stderr, "Transfer failed %d\n", result);
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "Transfered data complete...\n");
+		return 0;
+	}
+	else if (result >= 0 && options.replay[0] != '\0')
+	{
+		// the capture stands in for the device
+		if (replay_open(options.replay, options.replay_speed) == 0)
+		{
+			device_ready = 1;
+		}
+	}
+	else if (result >= 0)
 	{
 
 		devh = libusb_open_device_with_vid_pid(NULL, VENDOR_ID, PRODUCT_ID);
@@ -114,17 +153,32 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Unable to initialize libusb.\n");
 	}
 
+	if (device_ready && options.capture[0] != '\0')
+	{
+		device_ready = (capture_open(options.capture) == 0);
+	}
+
 	if (device_ready)
 	{
 		// Send and receive data.
 		// exchange_input_and_output_reports_via_interrupt_transfers(devh);
 		// exchange_input_and_output_reports_via_control_transfers(devh);
 		// exchange_feature_reports_via_control_transfers(devh);
-		setupChiptoBoot(devh, _path);
+		if (options.probe > 0)
+		{
+			result = probe_run(devh, options.probe);
+			capture_close();
+			replay_close();
+		}
+		else
+			setupChiptoBoot(devh, options.path);
 		// Finished using the device.
-		libusb_release_interface(devh, 0);
+		if (devh != NULL)
+		{
+			libusb_release_interface(devh, 0);
+		}
 	}
 	libusb_close(devh);
 	libusb_exit(NULL);
-	return 0;
+	return (options.probe > 0 && (!device_ready || result != 0)) ? EXIT_FAILURE : 0;
 }
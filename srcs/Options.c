@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "Options.h"
+#include "Channel.h"
+
+TOptions options = {
+    .rt_priority = 80,
+    .rt_cpu = -1,
+    .replay_speed = 1.0,
+    .parse_thread = 1,
+    .validate = 1,
+    .gang_hub_max = 4,
+    .out_channel = chINTERRUPT,
+    .confirm_timeout = 10000,
+    .workers = 2,
+};
+
+enum
+{
+  optRT = 256,
+  optRT_PRIORITY,
+  optRT_CPU,
+  optMETRICS_LISTEN,
+  optMETRICS_FILE,
+  optFIXTURE,
+  optCAPTURE,
+  optREPLAY,
+  optREPLAY_SPEED,
+  optPATCH,
+  optPATCH_DEVICE,
+  optNO_PARSE_THREAD,
+  optNO_VALIDATE,
+  optWINDOW,
+  optGANG,
+  optGANG_HUB_MAX,
+  optOUT_CHANNEL,
+  optPROBE,
+  optCONFIRM,
+  optCONFIRM_TIMEOUT,
+  optPROGRESS,
+  optCOORDINATE,
+  optWORKERS,
+  optWORKER,
+  optRANGE,
+  optREGION,
+  optCACHE,
+  optSHARED,
+  optWATCH,
+  optHELP
+};
+
+static const struct option long_options[] = {
+    {"rt", no_argument, NULL, optRT},
+    {"rt-priority", required_argument, NULL, optRT_PRIORITY},
+    {"rt-cpu", required_argument, NULL, optRT_CPU},
+    {"metrics-listen", required_argument, NULL, optMETRICS_LISTEN},
+    {"metrics-file", required_argument, NULL, optMETRICS_FILE},
+    {"fixture", required_argument, NULL, optFIXTURE},
+    {"capture", required_argument, NULL, optCAPTURE},
+    {"replay", required_argument, NULL, optREPLAY},
+    {"replay-speed", required_argument, NULL, optREPLAY_SPEED},
+    {"patch", required_argument, NULL, optPATCH},
+    {"patch-device", required_argument, NULL, optPATCH_DEVICE},
+    {"no-parse-thread", no_argument, NULL, optNO_PARSE_THREAD},
+    {"no-validate", no_argument, NULL, optNO_VALIDATE},
+    {"window", required_argument, NULL, optWINDOW},
+    {"gang", no_argument, NULL, optGANG},
+    {"gang-hub-max", required_argument, NULL, optGANG_HUB_MAX},
+    {"out-channel", required_argument, NULL, optOUT_CHANNEL},
+    {"probe", required_argument, NULL, optPROBE},
+    {"confirm", optional_argument, NULL, optCONFIRM},
+    {"confirm-timeout", required_argument, NULL, optCONFIRM_TIMEOUT},
+    {"progress", required_argument, NULL, optPROGRESS},
+    {"coordinate", required_argument, NULL, optCOORDINATE},
+    {"workers", required_argument, NULL, optWORKERS},
+    {"worker", required_argument, NULL, optWORKER},
+    {"range", required_argument, NULL, optRANGE},
+    {"region", required_argument, NULL, optREGION},
+    {"cache", required_argument, NULL, optCACHE},
+    {"shared", no_argument, NULL, optSHARED},
+    {"watch", required_argument, NULL, optWATCH},
+    {"help", no_argument, NULL, optHELP},
+    {NULL, 0, NULL, 0}};
+
+static int copy_argument(char *dst, size_t size, const char *arg)
+{
+    if (strlen(arg) >= size)
+    {
+        fprintf(stderr, "Argument too long: %s\n", arg);
+        return -1;
+    }
+    strcpy(dst, arg);
+    return 0;
+}
+
+// start:end in hex, end exclusive
+static int parse_range(const char *arg)
+{
+    const char *text = arg;
+    char *end = NULL;
+
+    options.range_start = (uint32_t)strtoul(arg, &end, 16);
+    if (end == arg || *end != ':')
+    {
+        fprintf(stderr, "Range must be start:end, got %s\n", text);
+        return -1;
+    }
+    arg = end + 1;
+    options.range_end = (uint32_t)strtoul(arg, &end, 16);
+    if (end == arg || *end != '\0' || options.range_end <= options.range_start)
+    {
+        fprintf(stderr, "Range must be start:end with end above start, got %s\n", text);
+        return -1;
+    }
+    return 0;
+}
+
+// vid:pid in hex
+static int parse_confirm(const char *arg)
+{
+    char *end = NULL;
+    unsigned long vid = strtoul(arg, &end, 16);
+    unsigned long pid = 0;
+
+    if (end == arg || *end != ':' || vid == 0 || vid > 0xffff)
+    {
+        fprintf(stderr, "Confirm must be vid:pid, got %s\n", arg);
+        return -1;
+    }
+    pid = strtoul(end + 1, &end, 16);
+    if (*end != '\0' || pid > 0xffff)
+    {
+        fprintf(stderr, "Confirm must be vid:pid, got %s\n", arg);
+        return -1;
+    }
+    options.confirm_vid = (uint16_t)vid;
+    options.confirm_pid = (uint16_t)pid;
+    return 0;
+}
+
+void print_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <path to hex> [overlay hex...]\n"
+                    "       %s --cache <dir> --watch <dir> [--watch <dir>...]\n"
+                    "       %s --probe <n>\n"
+                    "       %s --coordinate <[ip:]port> [--workers <n>] <batch file>\n"
+                    "       %s --worker <ip:port> --cache <dir>\n"
+                    "  --rt                 run usb transfers on a SCHED_FIFO thread with mlockall\n"
+                    "  --rt-priority <n>    SCHED_FIFO priority 1..99 (default %d)\n"
+                    "  --rt-cpu <n>         pin the transfer thread to cpu n\n"
+                    "  --metrics-listen <[ip:]port>  serve prometheus metrics over http (default ip 127.0.0.1)\n"
+                    "  --metrics-file <path>         add this run to a node_exporter textfile\n"
+                    "  --fixture <name>              fixture label for the metrics (default host name)\n"
+                    "  --capture <path>     record every usb transfer with timestamps and results\n"
+                    "  --replay <path>      replay a capture against the hex instead of a device\n"
+                    "  --replay-speed <x>   replay latency divisor, 1 = as captured, 0 = no delay\n"
+                    "  --patch <csv>        per device records, device,address,bytes[,crc_start,crc_end,crc_at]\n"
+                    "  --patch-device <id>  apply the csv rows for this device, --gang and --worker match the port path\n"
+                    "  --no-parse-thread    read the whole hex before erasing\n"
+                    "  --no-validate        skip the pre-flight check of the hex\n"
+                    "  --window <n>         hold only n erase blocks of the image, parsed as they are written\n"
+                    "  --gang               flash every attached bootloader, scheduled per hub\n"
+                    "  --gang-hub-max <n>   most boards at once behind one hub (default %d)\n"
+                    "  --probe <n>          time n SYNC round trips, nothing is erased or written\n"
+                    "  --out-channel <ch>   interrupt, control (HID SET_REPORT) or auto, the faster (default interrupt)\n"
+                    "  --confirm[=vid:pid]  after re-boot wait for the bootloader to go, or vid:pid to arrive\n"
+                    "  --confirm-timeout <ms>  how long --confirm waits (default %d)\n"
+                    "  --progress <name>    publish live progress to shared memory, read with mikro_hb_progress\n"
+                    "  --coordinate <[ip:]port>  hand the batch file jobs, \"<hex> [boards]\" lines, to workers\n"
+                    "  --workers <n>        workers the batch is sharded over (default %d), more may join\n"
+                    "  --worker <ip:port>   flash the jobs a coordinator hands out, images are kept in --cache\n"
+                    "  --range <start:end>  only erase and write the blocks in start..end, hex addresses\n"
+                    "  --region <name>      only erase and write the program, boot or config region\n"
+                    "  --cache <dir>        conditioned image cache, skips the parse on a hit\n"
+                    "  --shared             parse each image once per host, other processes map it read-only\n"
+                    "  --watch <dir>        condition hex files written to dir into the cache\n",
+            prog, prog, prog, prog, prog, options.rt_priority, options.gang_hub_max, options.confirm_timeout, options.workers);
+}
+
+/*
+ * Fill the global options from argv, the hex path is the first
+ * positional argument, any more are overlays composed over it.
+ *
+ * return: 0 on success, -1 on a bad or missing argument
+ */
+int parse_options(int argc, char **argv)
+{
+    int c = 0;
+    size_t len_s = 0;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case optRT:
+            options.rt = 1;
+            break;
+        case optRT_PRIORITY:
+            options.rt_priority = atoi(optarg);
+            if (options.rt_priority < 1 || options.rt_priority > 99)
+            {
+                fprintf(stderr, "rt priority must be 1..99\n");
+                return -1;
+            }
+            break;
+        case optRT_CPU:
+            options.rt_cpu = atoi(optarg);
+            break;
+        case optMETRICS_LISTEN:
+            if (copy_argument(options.metrics_listen, sizeof(options.metrics_listen), optarg) < 0)
+                return -1;
+            break;
+        case optMETRICS_FILE:
+            if (copy_argument(options.metrics_file, sizeof(options.metrics_file), optarg) < 0)
+                return -1;
+            break;
+        case optFIXTURE:
+            if (copy_argument(options.fixture, sizeof(options.fixture), optarg) < 0)
+                return -1;
+            break;
+        case optCAPTURE:
+            if (copy_argument(options.capture, sizeof(options.capture), optarg) < 0)
+                return -1;
+            break;
+        case optREPLAY:
+            if (copy_argument(options.replay, sizeof(options.replay), optarg) < 0)
+                return -1;
+            break;
+        case optREPLAY_SPEED:
+            options.replay_speed = atof(optarg);
+            if (options.replay_speed < 0)
+            {
+                fprintf(stderr, "replay speed must be >= 0\n");
+                return -1;
+            }
+            break;
+        case optPATCH:
+            if (copy_argument(options.patch, sizeof(options.patch), optarg) < 0)
+                return -1;
+            break;
+        case optPATCH_DEVICE:
+            if (copy_argument(options.patch_device, sizeof(options.patch_device), optarg) < 0)
+                return -1;
+            break;
+        case optNO_PARSE_THREAD:
+            options.parse_thread = 0;
+            break;
+        case optNO_VALIDATE:
+            options.validate = 0;
+            break;
+        case optWINDOW:
+            options.window = atoi(optarg);
+            if (options.window < 1)
+            {
+                fprintf(stderr, "window must be >= 1 erase block\n");
+                return -1;
+            }
+            break;
+        case optGANG:
+            options.gang = 1;
+            break;
+        case optGANG_HUB_MAX:
+            options.gang_hub_max = atoi(optarg);
+            if (options.gang_hub_max < 1)
+            {
+                fprintf(stderr, "gang hub max must be >= 1\n");
+                return -1;
+            }
+            break;
+        case optOUT_CHANNEL:
+            if (channel_parse(optarg, &options.out_channel) < 0)
+            {
+                fprintf(stderr, "Out channel must be interrupt, control or auto\n");
+                return -1;
+            }
+            break;
+        case optPROBE:
+            options.probe = (uint32_t)strtoul(optarg, NULL, 10);
+            if (options.probe == 0)
+            {
+                fprintf(stderr, "probe needs at least 1 round trip\n");
+                return -1;
+            }
+            break;
+        case optCONFIRM:
+            options.confirm = 1;
+            if (optarg != NULL && parse_confirm(optarg) < 0)
+                return -1;
+            break;
+        case optCONFIRM_TIMEOUT:
+            options.confirm_timeout = atoi(optarg);
+            if (options.confirm_timeout < 1)
+            {
+                fprintf(stderr, "confirm timeout must be >= 1 ms\n");
+                return -1;
+            }
+            break;
+        case optPROGRESS:
+            if (copy_argument(options.progress, sizeof(options.progress), optarg) < 0)
+                return -1;
+            break;
+        case optCOORDINATE:
+            if (copy_argument(options.coordinate, sizeof(options.coordinate), optarg) < 0)
+                return -1;
+            break;
+        case optWORKERS:
+            options.workers = atoi(optarg);
+            if (options.workers < 1)
+            {
+                fprintf(stderr, "workers must be >= 1\n");
+                return -1;
+            }
+            break;
+        case optWORKER:
+            if (copy_argument(options.worker, sizeof(options.worker), optarg) < 0)
+                return -1;
+            break;
+        case optRANGE:
+            if (parse_range(optarg) < 0)
+                return -1;
+            break;
+        case optREGION:
+            if (copy_argument(options.region, sizeof(options.region), optarg) < 0)
+                return -1;
+            break;
+        case optCACHE:
+            if (copy_argument(options.cache, sizeof(options.cache), optarg) < 0)
+                return -1;
+            break;
+        case optSHARED:
+            options.shared = 1;
+            break;
+        case optWATCH:
+            if (options.watch_count >= MAX_WATCH_DIRS)
+            {
+                fprintf(stderr, "At most %d watch directories\n", MAX_WATCH_DIRS);
+                return -1;
+            }
+            if (copy_argument(options.watch[options.watch_count], sizeof(options.watch[0]), optarg) < 0)
+                return -1;
+            options.watch_count++;
+            break;
+        case optHELP:
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (options.gang && (options.capture[0] != '\0' || options.replay[0] != '\0'))
+    {
+        fprintf(stderr, "--gang can't be combined with --capture or --replay\n");
+        return -1;
+    }
+
+    // watch mode flashes nothing
+    if (options.watch_count > 0)
+    {
+        if (options.cache[0] == '\0')
+        {
+            fprintf(stderr, "--watch needs a --cache directory\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // jobs bring their own hex
+    if (options.worker[0] != '\0')
+    {
+        if (options.cache[0] == '\0' || options.gang || options.coordinate[0] != '\0')
+        {
+            fprintf(stderr, "--worker needs a --cache directory and can't be combined with --gang or --coordinate\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // the link alone, no hex involved
+    if (options.probe > 0)
+    {
+        if (options.gang)
+        {
+            fprintf(stderr, "--probe can't be combined with --gang\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // condition file path
+    if (optind >= argc)
+    {
+        fprintf(stderr, "No path to hex!\n");
+        return -1;
+    }
+
+    len_s = strlen(argv[optind]);
+    if (len_s >= sizeof(options.path))
+    {
+        fprintf(stderr, "Path to hex is too long!\n");
+        return -1;
+    }
+
+    // remove the carriage return and or newline feed from path if it exists
+    strcpy(options.path, argv[optind]);
+    if (len_s > 0 && (options.path[len_s - 1] == '\r' || options.path[len_s - 1] == '\n'))
+        options.path[len_s - 1] = '\0'; // remove \r | \n
+
+    // bootloader, application, calibration... later files win
+    for (optind++; optind < argc; optind++)
+    {
+        if (options.overlay_count >= MAX_HEX_FILES - 1)
+        {
+            fprintf(stderr, "At most %d hex files\n", MAX_HEX_FILES);
+            return -1;
+        }
+        if (copy_argument(options.overlays[options.overlay_count], sizeof(options.overlays[0]), argv[optind]) < 0)
+            return -1;
+        options.overlay_count++;
+    }
+
+    // blocks are parsed from the one file as they are written
+    if (options.window > 0 && (options.patch[0] != '\0' || options.overlay_count > 0 || options.gang || options.shared))
+    {
+        fprintf(stderr, "--window can't be combined with --patch, overlays, --gang or --shared\n");
+        return -1;
+    }
+
+    return 0;
+}
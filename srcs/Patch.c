@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "Patch.h"
+#include "Types.h"
+#include "Utils.h"
+
+// 2 = patched addresses
+#define DEBUG 2
+
+#define PATCH_LINE_SIZE 512
+#define PATCH_FIELDS 6
+
+/*
+ * Find the region and offset an address falls in,
+ * the boot page sits inside program flash so it is checked first.
+ *
+ * return: the buffer, -1 if the image doesn't cover address
+ */
+static int patch_locate(const THexImage *image, uint32_t address, uint32_t *offset)
+{
+    address &= V2P;
+
+    if (address >= image->boot_address && address < image->boot_address + image->block_size)
+    {
+        *offset = address - image->boot_address;
+        return hsBOOT;
+    }
+    if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTFLASH + image->prg_size)
+    {
+        *offset = address - _PIC32Mn_STARTFLASH;
+        return hsPRG;
+    }
+    if (address >= _PIC32Mn_STARTCONF && address < _PIC32Mn_STARTCONF + CONF_BUFFER_SIZE)
+    {
+        *offset = address - _PIC32Mn_STARTCONF;
+        return hsCONF;
+    }
+    return -1;
+}
+
+static uint8_t *copy_buffer(const uint8_t *src, uint32_t size)
+{
+    uint8_t *copy = malloc(size);
+
+    if (copy != NULL)
+        memcpy(copy, src, size);
+    return copy;
+}
+
+/*
+ * Writable byte for a region offset, program flash is copied an erase
+ * block at a time the first time it is touched, the boot page and config
+ * data are copied whole if the image doesn't own them.
+ */
+static uint8_t *patch_cow(THexImage *image, THexSource source, uint32_t offset)
+{
+    uint32_t block = offset / image->block_size;
+    uint8_t *copy = NULL;
+
+    if (source == hsBOOT && !(image->owned & IMAGE_OWNS_BOOT))
+    {
+        if ((copy = copy_buffer(image->boot, image->block_size)) == NULL)
+            return NULL;
+        image->boot = copy;
+        image->owned |= IMAGE_OWNS_BOOT;
+    }
+    else if (source == hsCONF && !(image->owned & IMAGE_OWNS_CONF))
+    {
+        if ((copy = copy_buffer(image->conf, CONF_BUFFER_SIZE)) == NULL)
+            return NULL;
+        image->conf = copy;
+        image->owned |= IMAGE_OWNS_CONF;
+    }
+    else if (source == hsPRG)
+    {
+        if (image->prg_blocks == NULL)
+        {
+            image->prg_blocks = calloc(image->prg_size / image->block_size, sizeof(uint8_t *));
+            if (image->prg_blocks == NULL)
+                return NULL;
+        }
+        if (image->prg_blocks[block] == NULL)
+        {
+            image->prg_blocks[block] = copy_buffer(image->prg + block * image->block_size, image->block_size);
+            if (image->prg_blocks[block] == NULL)
+                return NULL;
+        }
+
+        // the streamed length has to reach the patch
+        if (offset >= image->prg_mem_count)
+            image->prg_mem_count = offset + 1;
+    }
+
+    return hex_image_data(image, source, offset);
+}
+
+static int patch_write(THexImage *image, uint32_t address, const uint8_t *data, uint32_t len)
+{
+    uint32_t offset = 0;
+    uint32_t i = 0;
+    uint8_t *dst = NULL;
+    int source = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        source = patch_locate(image, address + i, &offset);
+        if (source < 0)
+        {
+            fprintf(stderr, "Patch address %08x is outside the image\n", address + i);
+            return -1;
+        }
+        dst = patch_cow(image, (THexSource)source, offset);
+        if (dst == NULL)
+        {
+            fprintf(stderr, "Out of memory patching %08x\n", address + i);
+            return -1;
+        }
+        *dst = data[i];
+    }
+    return 0;
+}
+
+// CRC-32 (IEEE 802.3) over the patched view
+static int patch_crc(THexImage *image, uint32_t start, uint32_t end, uint32_t *crc)
+{
+    uint32_t offset = 0;
+    uint32_t address = 0;
+    int source = 0;
+    int bit = 0;
+
+    *crc = 0xffffffff;
+    for (address = start; address < end; address++)
+    {
+        source = patch_locate(image, address, &offset);
+        if (source < 0)
+        {
+            fprintf(stderr, "CRC range %08x..%08x is outside the image\n", start, end);
+            return -1;
+        }
+        *crc ^= *hex_image_data(image, (THexSource)source, offset);
+        for (bit = 0; bit < 8; bit++)
+            *crc = (*crc >> 1) ^ (0xedb88320 & -(*crc & 1));
+    }
+    *crc ^= 0xffffffff;
+    return 0;
+}
+
+/*
+ * Apply the per device records from next() to an image, best on a view
+ * from hex_image_share() so the shared base stays as parsed.
+ *
+ * return: number of records applied, -1 on failure
+ */
+int patch_image(THexImage *image, TPatchSource next, void *user)
+{
+    TPatch patch;
+    uint8_t crc_bytes[4];
+    uint32_t crc = 0;
+    int result = 0;
+    int i = 0;
+
+    for (i = 0; (result = next(user, i, &patch)) > 0; i++)
+    {
+        if (patch_write(image, patch.address, patch.data, patch.len) < 0)
+            return -1;
+
+        if (patch.crc_end > patch.crc_start)
+        {
+            if (patch_crc(image, patch.crc_start, patch.crc_end, &crc) < 0)
+                return -1;
+            crc_bytes[0] = crc & 0xff;
+            crc_bytes[1] = (crc >> 8) & 0xff;
+            crc_bytes[2] = (crc >> 16) & 0xff;
+            crc_bytes[3] = (crc >> 24) & 0xff;
+            if (patch_write(image, patch.crc_at, crc_bytes, sizeof(crc_bytes)) < 0)
+                return -1;
+        }
+#if DEBUG == 2
+        printf("patch [%08x] : [%u]\n", patch.address, patch.len);
+#endif
+    }
+
+    return (result < 0) ? -1 : i;
+}
+
+static int parse_bytes(const char *hex, TPatch *patch)
+{
+    uint8_t pair[2];
+    size_t len = strlen(hex);
+    size_t i = 0;
+
+    if (len == 0 || len % 2 != 0 || len / 2 > PATCH_MAX_DATA)
+        return -1;
+
+    for (i = 0; i < len; i += 2)
+    {
+        if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]))
+            return -1;
+        pair[0] = transform_char_bin(hex[i]);
+        pair[1] = transform_char_bin(hex[i + 1]);
+        patch->data[i / 2] = transform_2chars_1bin(pair);
+    }
+    patch->len = (uint16_t)(len / 2);
+    return 0;
+}
+
+static int parse_address(const char *field, uint32_t *address)
+{
+    char *end = NULL;
+
+    errno = 0;
+    *address = (uint32_t)strtoul(field, &end, 0);
+    return (errno != 0 || end == field || *end != '\0') ? -1 : 0;
+}
+
+/*
+ * Read the records for one device from a CSV file, blank lines and
+ * lines starting with # are skipped.
+ *   device,address,bytes[,crc_start,crc_end,crc_at]
+ *   SN0001,0x9D1F0000,534E30303031
+ *   *,0x9D1F0100,00,0x9D1F0000,0x9D1F0100,0x9D1F0100
+ * bytes are hex digits, a device of * matches every device.
+ *
+ * return: 0 on success, -1 with the line number reported on failure
+ */
+int patch_csv_load(const char *path, const char *device, TPatchList *list)
+{
+    char line[PATCH_LINE_SIZE];
+    char *field[PATCH_FIELDS];
+    TPatch *items = NULL;
+    TPatch *p = NULL;
+    FILE *fp = NULL;
+    char *c = NULL;
+    int line_no = 0;
+    int fields = 0;
+    int bad = 0;
+
+    memset(list, 0, sizeof(TPatchList));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open patch file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        for (fields = 1, field[0] = line, c = line; *c != '\0'; c++)
+        {
+            if (*c != ',')
+                continue;
+            *c = '\0';
+            if (fields == PATCH_FIELDS)
+            {
+                fields++;
+                break;
+            }
+            field[fields++] = c + 1;
+        }
+
+        if (fields != 3 && fields != PATCH_FIELDS)
+        {
+            fprintf(stderr, "%s:%d: expected 3 or %d fields\n", path, line_no, PATCH_FIELDS);
+            bad = 1;
+            break;
+        }
+        if (strcmp(field[0], "*") != 0 && (device == NULL || strcmp(field[0], device) != 0))
+            continue;
+
+        items = realloc(list->items, (list->count + 1) * sizeof(TPatch));
+        if (items == NULL)
+        {
+            fprintf(stderr, "Out of memory loading %s\n", path);
+            bad = 1;
+            break;
+        }
+        list->items = items;
+        p = &list->items[list->count];
+        memset(p, 0, sizeof(TPatch));
+        if (strlen(field[0]) >= sizeof(p->device))
+        {
+            fprintf(stderr, "%s:%d: device name too long\n", path, line_no);
+            bad = 1;
+            break;
+        }
+        memcpy(p->device, field[0], strlen(field[0]) + 1);
+
+        if (parse_address(field[1], &p->address) < 0 || parse_bytes(field[2], p) < 0 ||
+            (fields == PATCH_FIELDS && (parse_address(field[3], &p->crc_start) < 0 ||
+                                        parse_address(field[4], &p->crc_end) < 0 ||
+                                        parse_address(field[5], &p->crc_at) < 0)))
+        {
+            fprintf(stderr, "%s:%d: bad address or bytes\n", path, line_no);
+            bad = 1;
+            break;
+        }
+        list->count++;
+    }
+    fclose(fp);
+
+    if (bad)
+    {
+        patch_list_free(list);
+        return -1;
+    }
+    return 0;
+}
+
+// TPatchSource over a loaded list, user = TPatchList
+int patch_list_next(void *user, int index, TPatch *patch)
+{
+    TPatchList *list = user;
+
+    if (index >= list->count)
+        return 0;
+    memcpy(patch, &list->items[index], sizeof(TPatch));
+    return 1;
+}
+
+void patch_list_free(TPatchList *list)
+{
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+}
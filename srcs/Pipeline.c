@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "Pipeline.h"
+#include "Utils.h"
+
+// 2 = prepass and release info
+#define DEBUG 2
+
+// ':' + count, address, type and an 04 records upper address
+#define HEX_HEADER_BYTES 6
+
+static int release_cmp(const void *a, const void *b)
+{
+    const THexRelease *ra = a;
+    const THexRelease *rb = b;
+
+    if (ra->line != rb->line)
+        return (ra->line < rb->line) ? -1 : 1;
+    return (ra->block < rb->block) ? -1 : (ra->block > rb->block);
+}
+
+/*
+ * Read only the record headers, note the last line each erase block is
+ * touched on and the counts the session needs before the data is in.
+ *
+ * return: 0 on success, -1 if the file can't be read
+ */
+static int hex_prepass(THexPipeline *p, FILE *fp)
+{
+    THexCursor cursor = {0};
+    uint8_t header[HEX_HEADER_BYTES];
+    uint8_t pair[2];
+    uint32_t line_no = 0;
+    uint32_t address = 0;
+    uint32_t offset = 0;
+    uint32_t block = 0;
+    uint32_t last = 0;
+    uint8_t count = 0;
+    size_t cap = 0;
+    char *line = NULL;
+    char *c = NULL;
+    int i = 0;
+
+    while (getline(&line, &cap, fp) >= 0)
+    {
+        line_no++;
+
+        // same conversion as file_extract_line(), ':' is skipped wherever it is
+        memset(header, 0, sizeof(header));
+        for (c = line, i = 0; *c != '\0' && *c != '\n' && i < HEX_HEADER_BYTES * 2; c++)
+        {
+            if (*c == ':')
+                continue;
+            pair[i & 1] = transform_char_bin((unsigned char)*c);
+            if (i++ & 1)
+                header[i / 2 - 1] = transform_2chars_1bin(pair);
+        }
+
+        if (hex_record_locate(header, &cursor, &address, &count) == 0x01)
+            break;
+
+        if (header[3] != 0x00 || count == 0)
+            continue;
+        // hex_record_apply() won't write it, refused before anything is erased
+        if ((address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF && address - _PIC32Mn_STARTFLASH + count > p->image->prg_size) ||
+            (address >= _PIC32Mn_STARTCONF && address - _PIC32Mn_STARTCONF + count > CONF_BUFFER_SIZE))
+        {
+            fprintf(stderr, "line %u: record at %08x..%08x is outside the image\n", line_no, address, address + count);
+            cursor.rejected++;
+        }
+        if (address < _PIC32Mn_STARTFLASH || address >= _PIC32Mn_STARTCONF || address - _PIC32Mn_STARTFLASH >= p->image->prg_size)
+            continue;
+
+        offset = address - _PIC32Mn_STARTFLASH;
+        last = (offset + count - 1) / p->image->block_size;
+        for (block = offset / p->image->block_size; block <= last && block < p->block_count; block++)
+        {
+            p->release[block].line = line_no;
+            p->touched[block] = 1;
+        }
+    }
+    free(line);
+
+    p->image->prg_mem_count = cursor.prg_mem_count;
+    p->image->conf_mem_count = cursor.conf_mem_count;
+    qsort(p->release, p->block_count, sizeof(THexRelease), release_cmp);
+
+#if DEBUG == 2
+    printf("prepass %u lines : %u blocks : %u\n", line_no, p->block_count, cursor.prg_mem_count);
+#endif
+    return (ferror(fp) || cursor.rejected > 0) ? -1 : 0;
+}
+
+// wake the session's event loop, it only looks at the ring when stalled
+static void hex_signal(THexPipeline *p)
+{
+    uint64_t one = 1;
+
+    if (write(p->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "parser eventfd error %d\n", errno);
+}
+
+// producer side, only the parser thread calls this
+static void hex_publish(THexPipeline *p, uint32_t block)
+{
+    uint32_t head = p->head;
+
+    p->ring[head & p->ring_mask] = block;
+    __atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+    hex_signal(p);
+}
+
+static void hex_parser_done(THexPipeline *p, int result)
+{
+    p->result = result;
+    __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+    hex_signal(p);
+}
+
+static void *hex_parser(void *arg)
+{
+    THexPipeline *p = arg;
+    THexImage *image = p->image;
+    THexCursor cursor = {0};
+    uint8_t line[HEX_LINE_BYTES] = {0};
+    uint32_t next = 0;
+    uint32_t line_no = 0;
+    uint8_t report = 0;
+    FILE *fp = NULL;
+    int c_ = 0;
+
+    fp = fopen(p->path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not find or open a file!!\n");
+        hex_parser_done(p, -1);
+        return NULL;
+    }
+
+    // blocks no record touches are final already
+    while (next < p->block_count && p->release[next].line == 0)
+        hex_publish(p, p->release[next++].block);
+
+    while (c_ != EOF)
+    {
+        c_ = file_extract_line(fp, (char *)line, c_);
+        line_no++;
+        report = hex_record_apply(image, line, &cursor);
+
+        while (next < p->block_count && p->release[next].line <= line_no)
+            hex_publish(p, p->release[next++].block);
+
+        if (report == 0x01)
+            break;
+    }
+    fclose(fp);
+
+    while (next < p->block_count)
+        hex_publish(p, p->release[next++].block);
+
+    // blocks already written stay, the session fails before the boot page
+    if (cursor.rejected > 0)
+    {
+        fprintf(stderr, "%s: %u records outside the image\n", p->path, cursor.rejected);
+        hex_parser_done(p, -1);
+        return NULL;
+    }
+
+    overwrite_bootflash_program(image, &p->bootinfo);
+    if (digest_file(p->path, image->digest) != 0)
+        strcpy(image->digest, "unknown");
+
+    hex_parser_done(p, 0);
+    return NULL;
+}
+
+/*
+ * The parser is ordinary work, under --rt it must not inherit the
+ * session thread's SCHED_FIFO or its cpu pin, pinned to one cpu at one
+ * priority it would run to the end before the transfers go on.
+ *
+ * return: 0 on success, an errno value otherwise
+ */
+static int hex_parser_create(THexPipeline *p)
+{
+    struct sched_param param = {0};
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    long i = 0;
+    int result = 0;
+
+    CPU_ZERO(&cpus);
+    for (i = 0; i < cpu_count && i < CPU_SETSIZE; i++)
+        CPU_SET(i, &cpus);
+
+    result = pthread_attr_init(&attr);
+    if (result != 0)
+        return result;
+    result = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    if (result == 0)
+        result = pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    if (result == 0)
+        result = pthread_attr_setschedparam(&attr, &param);
+    if (result == 0 && cpu_count > 0)
+        result = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (result == 0)
+        result = pthread_create(&p->thread, &attr, hex_parser, p);
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
+// an idle pipeline, hex_pipeline_finish() is safe on it
+void hex_pipeline_init(THexPipeline *p)
+{
+    memset(p, 0, sizeof(THexPipeline));
+    p->event_fd = -1;
+}
+
+/*
+ * Index the file, allocate the image and start the parser thread,
+ * prg_mem_count and file_size are valid on return, the buffers fill in
+ * behind hex_pipeline_ready().
+ *
+ * return: the file size as condition_hexfile_data() does, 0 on failure
+ */
+uint32_t hex_pipeline_start(THexPipeline *p, const char *path, TBootInfo *bootinfo, THexImage *image)
+{
+    struct stat st;
+    uint32_t ring_size = 1;
+    uint32_t i = 0;
+    FILE *fp = NULL;
+
+    hex_pipeline_init(p);
+    p->image = image;
+    memcpy(&p->bootinfo, bootinfo, sizeof(TBootInfo));
+    strncpy(p->path, path, sizeof(p->path) - 1);
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not find or open a file!!\n");
+        return 0;
+    }
+
+    if (hex_image_alloc(image, bootinfo) < 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    p->block_count = image->prg_size / image->block_size;
+    while (ring_size < p->block_count)
+        ring_size <<= 1;
+    p->ring_mask = ring_size - 1;
+    p->release = calloc(p->block_count, sizeof(THexRelease));
+    p->ring = calloc(ring_size, sizeof(uint32_t));
+    p->ready = calloc(p->block_count, sizeof(uint8_t));
+    p->touched = calloc(p->block_count, sizeof(uint8_t));
+    if (p->release == NULL || p->ring == NULL || p->ready == NULL || p->touched == NULL)
+    {
+        fprintf(stderr, "Out of memory for the parse index!\n");
+        fclose(fp);
+        hex_pipeline_finish(p);
+        return 0;
+    }
+    for (i = 0; i < p->block_count; i++)
+        p->release[i].block = i;
+
+    if (hex_prepass(p, fp) < 0 || fstat(fileno(fp), &st) < 0)
+    {
+        fprintf(stderr, "Could not index %s\n", path);
+        fclose(fp);
+        hex_pipeline_finish(p);
+        return 0;
+    }
+    fclose(fp);
+    image->file_size = (uint32_t)st.st_size;
+
+    p->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p->event_fd < 0 || hex_parser_create(p) != 0)
+    {
+        fprintf(stderr, "Unable to start the parser thread\n");
+        hex_pipeline_finish(p);
+        return 0;
+    }
+    p->running = 1;
+    return image->file_size;
+}
+
+/*
+ * Consumer side, can [offset, offset + size) of a buffer be streamed yet,
+ * the boot page and config data are only final once the parse is done.
+ *
+ * return: 1 = ready, 0 = not yet, -1 the parse failed
+ */
+int hex_pipeline_ready(THexPipeline *p, THexSource source, uint32_t offset, uint32_t size)
+{
+    uint32_t head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+    uint32_t block = 0;
+
+    while (p->tail != head)
+        p->ready[p->ring[p->tail++ & p->ring_mask]] = 1;
+
+    if (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE))
+        return (p->result < 0) ? -1 : 1;
+    if (source != hsPRG)
+        return 0;
+
+    for (block = offset / p->image->block_size; size > 0 && block <= (offset + size - 1) / p->image->block_size; block++)
+    {
+        if (block < p->block_count && !p->ready[block])
+            return 0;
+    }
+    return 1;
+}
+
+// does any record in the file write to [offset, offset + size) of program flash
+int hex_pipeline_touched(const THexPipeline *p, uint32_t offset, uint32_t size)
+{
+    uint32_t block = 0;
+
+    for (block = offset / p->image->block_size; size > 0 && block <= (offset + size - 1) / p->image->block_size; block++)
+    {
+        if (block < p->block_count && p->touched[block])
+            return 1;
+    }
+    return 0;
+}
+
+// clear the wakeups, the session looks at the ring right after
+void hex_pipeline_drain(THexPipeline *p)
+{
+    uint64_t count = 0;
+
+    if (p->event_fd >= 0 && read(p->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "parser eventfd error %d\n", errno);
+}
+
+/*
+ * Wait for the parser and drop the index, safe to call more than once.
+ *
+ * return: 0 if the whole file was parsed, -1 otherwise
+ */
+int hex_pipeline_finish(THexPipeline *p)
+{
+    if (p->running)
+    {
+        pthread_join(p->thread, NULL);
+        p->running = 0;
+    }
+
+    free(p->release);
+    free(p->ring);
+    free(p->ready);
+    free(p->touched);
+    if (p->event_fd >= 0)
+        close(p->event_fd);
+    p->event_fd = -1;
+    p->release = NULL;
+    p->ring = NULL;
+    p->ready = NULL;
+    p->touched = NULL;
+    return p->result;
+}
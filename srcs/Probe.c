@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "Probe.h"
+#include "USB.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Stats.h"
+#include "Utils.h"
+#include "Options.h"
+
+typedef struct
+{
+  TLatencyStats latency; // round trips that were acked
+  uint32_t sent;
+  uint32_t timeouts;
+  uint32_t errors; // transfer errors and replies that weren't the SYNC ack
+  uint64_t elapsed_ns;
+} TProbeResult;
+
+// one framed command and its reply, 0 = acked with the same command
+static int probe_command(libusb_device_handle *devh, TCmd cmd, char *data_in, char *data_out)
+{
+    int result = 0;
+
+    memset(data_in, 0, MAX_INTERRUPT_IN_TRANSFER_SIZE);
+    boot_frame_command(data_out, cmd, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+    result = boot_interrupt_transfers(devh, data_in, data_out, 0);
+    if (result != 0)
+        return (result < 0) ? result : LIBUSB_ERROR_IO;
+    if (cmd != cmdINFO && (data_in[0] != 0x0f || data_in[1] != (char)cmd))
+        return LIBUSB_ERROR_IO;
+    return 0;
+}
+
+// fixture, profile, report size then the numbers, one line whatever the fixture
+static void probe_print(const TProbeResult *r, const TBootInfo *bootinfo)
+{
+    char fixture[64] = {0};
+    double seconds = r->elapsed_ns / 1e9;
+    uint32_t ok = r->latency.count;
+
+    if (options.fixture[0] != '\0')
+        snprintf(fixture, sizeof(fixture), "%s", options.fixture);
+    else if (gethostname(fixture, sizeof(fixture) - 1) != 0)
+        strcpy(fixture, "unknown");
+
+    latency_print("sync round trip", &r->latency);
+    printf("probe fixture=%s profile=%s report=%u sent=%u ok=%u timeouts=%u errors=%u "
+           "timeout_rate=%.4f error_rate=%.4f min_us=%.1f p50_us=%lu p99_us=%lu max_us=%.1f pps=%.0f\n",
+           fixture, bootinfo->sDevDsc.fValue, MAX_INTERRUPT_OUT_TRANSFER_SIZE, r->sent, ok, r->timeouts, r->errors,
+           r->sent ? (double)r->timeouts / r->sent : 0.0, r->sent ? (double)r->errors / r->sent : 0.0,
+           ok ? r->latency.min_ns / 1000.0 : 0.0, (unsigned long)latency_percentile(&r->latency, 50.0),
+           (unsigned long)latency_percentile(&r->latency, 99.0), ok ? r->latency.max_ns / 1000.0 : 0.0,
+           (seconds > 0) ? ok / seconds : 0.0);
+}
+
+/*
+ * INFO for the profile, BOOT to hold the board in the bootloader and a
+ * SYNC to start, then count SYNC round trips. Timeouts and errors are
+ * counted and the probe goes on, PROBE_MAX_FAILURES in a row or a board
+ * gone from the bus stop it.
+ *
+ * return: zero if every round trip was acked, libusb error code otherwise
+ */
+int probe_run(libusb_device_handle *devh, uint32_t count)
+{
+    char data_in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+    char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    TBootInfo bootinfo;
+    TProbeResult r;
+    uint64_t started = 0;
+    uint64_t submitted = 0;
+    uint32_t failures = 0;
+    int result = 0;
+
+    memset(&bootinfo, 0, sizeof(bootinfo));
+    memset(&r, 0, sizeof(r));
+    latency_reset(&r.latency);
+
+    result = probe_command(devh, cmdINFO, data_in, data_out);
+    if (result == 0)
+    {
+        bootInfo_buffer(&bootinfo, data_in);
+        result = probe_command(devh, cmdBOOT, data_in, data_out);
+    }
+    if (result == 0)
+        result = probe_command(devh, cmdSYNC, data_in, data_out);
+    if (result != 0)
+    {
+        fprintf(stderr, "Probe handshake failed %d\n", result);
+        return result;
+    }
+
+    // the per packet dump would be in every round trip
+    boot_transfer_trace(0);
+    started = time_now_ns();
+    for (r.sent = 0; r.sent < count && failures < PROBE_MAX_FAILURES; r.sent++)
+    {
+        submitted = time_now_ns();
+        result = probe_command(devh, cmdSYNC, data_in, data_out);
+        if (result == 0)
+        {
+            latency_add(&r.latency, time_now_ns() - submitted);
+            failures = 0;
+            continue;
+        }
+
+        failures++;
+        if (result == LIBUSB_ERROR_TIMEOUT)
+            r.timeouts++;
+        else
+            r.errors++;
+        if (result == LIBUSB_ERROR_NO_DEVICE)
+        {
+            r.sent++;
+            break;
+        }
+    }
+    r.elapsed_ns = time_now_ns() - started;
+    boot_transfer_trace(1);
+
+    if (failures >= PROBE_MAX_FAILURES)
+        fprintf(stderr, "Probe stopped after %u failures in a row\n", failures);
+    probe_print(&r, &bootinfo);
+
+    // back to the application, nothing was changed
+    boot_frame_command(data_out, cmdREBOOT, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+    boot_interrupt_transfers(devh, data_in, data_out, 2);
+
+    return (r.latency.count == r.sent) ? 0 : LIBUSB_ERROR_IO;
+}
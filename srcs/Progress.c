@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Progress.h"
+
+static TProgressShm *shm_out;
+
+// shm_open() wants a leading slash and no other
+static int progress_name(char *out, size_t size, const char *name)
+{
+    if (snprintf(out, size, "%s%s", (name[0] == '/') ? "" : "/", name) >= (int)size || strchr(out + 1, '/') != NULL)
+    {
+        fprintf(stderr, "Bad progress name %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Pid of the process still writing an existing segment, 0 if it has
+ * exited or the segment is unreadable.
+ */
+static pid_t progress_owner(const char *shm_name)
+{
+    const TProgressShm *shm = NULL;
+    void *map = NULL;
+    pid_t pid = 0;
+    int fd = -1;
+
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    map = mmap(NULL, sizeof(TProgressShm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    shm = map;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == PROGRESS_MAGIC)
+        pid = shm->pid;
+    munmap(map, sizeof(TProgressShm));
+
+    if (pid <= 0 || pid == getpid() || (kill(pid, 0) < 0 && errno == ESRCH))
+        return 0;
+    return pid;
+}
+
+/*
+ * Create the segment. One left by an exited process is unlinked first so
+ * readers still mapping it keep their copy of its final state, one a live
+ * process is writing is refused.
+ *
+ * return: 0 on success, -1 on failure
+ */
+int progress_open(const char *name)
+{
+    char shm_name[PROGRESS_NAME_SIZE];
+    void *map = NULL;
+    pid_t owner = 0;
+    int fd = -1;
+
+    if (progress_name(shm_name, sizeof(shm_name), name) < 0)
+        return -1;
+
+    fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        owner = progress_owner(shm_name);
+        if (owner > 0)
+        {
+            fprintf(stderr, "progress %s is in use by pid %d\n", shm_name, (int)owner);
+            return -1;
+        }
+        shm_unlink(shm_name);
+        fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0 || ftruncate(fd, sizeof(TProgressShm)) < 0)
+    {
+        fprintf(stderr, "progress %s error %d\n", shm_name, errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(TProgressShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "progress mmap error %d\n", errno);
+        return -1;
+    }
+
+    // a fresh segment is zeroed, the header goes in before the magic
+    shm_out = map;
+    shm_out->version = PROGRESS_VERSION;
+    shm_out->pid = getpid();
+    __atomic_store_n(&shm_out->magic, PROGRESS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Claim a slot for one board, safe from any thread.
+ *
+ * return: slot index, -1 when no segment is open or all slots are taken
+ */
+int progress_slot(const char *path)
+{
+    TProgress progress;
+    uint32_t slot = 0;
+
+    if (shm_out == NULL)
+        return -1;
+
+    slot = __atomic_fetch_add(&shm_out->count, 1, __ATOMIC_RELAXED);
+    if (slot >= MAX_PROGRESS_SLOTS)
+        return -1;
+
+    memset(&progress, 0, sizeof(progress));
+    strncpy(progress.path, path, sizeof(progress.path) - 1);
+    progress_publish((int)slot, &progress);
+    return (int)slot;
+}
+
+// only ever called by the slots own session
+void progress_publish(int slot, const TProgress *progress)
+{
+    TProgressSlot *s = NULL;
+    uint32_t seq = 0;
+
+    if (shm_out == NULL || slot < 0 || slot >= MAX_PROGRESS_SLOTS)
+        return;
+    s = &shm_out->slots[slot];
+
+    seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&s->progress, progress, sizeof(TProgress));
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// return: the mapped segment read only, NULL if there is none or it isn't ready
+const TProgressShm *progress_attach(const char *name)
+{
+    char shm_name[PROGRESS_NAME_SIZE];
+    const TProgressShm *shm = NULL;
+    void *map = NULL;
+    int fd = -1;
+
+    if (progress_name(shm_name, sizeof(shm_name), name) < 0)
+        return NULL;
+
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    map = mmap(NULL, sizeof(TProgressShm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    shm = map;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != PROGRESS_MAGIC || shm->version != PROGRESS_VERSION)
+    {
+        munmap(map, sizeof(TProgressShm));
+        return NULL;
+    }
+    return shm;
+}
+
+/*
+ * Copy one slot as a whole update, never half of two.
+ *
+ * return: 0 on success, -1 if the slot is unclaimed or never settled
+ */
+int progress_read(const TProgressShm *shm, int slot, TProgress *progress)
+{
+    const TProgressSlot *s = NULL;
+    uint32_t before = 0;
+    uint32_t after = 0;
+    int tries = 0;
+
+    if (slot < 0 || slot >= MAX_PROGRESS_SLOTS || (uint32_t)slot >= __atomic_load_n(&shm->count, __ATOMIC_RELAXED))
+        return -1;
+    s = &shm->slots[slot];
+
+    for (tries = 0; tries < PROGRESS_READ_TRIES; tries++)
+    {
+        before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (before & 1 || before == 0)
+            continue;
+        memcpy(progress, &s->progress, sizeof(TProgress));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        if (before == after)
+            return 0;
+    }
+    return -1;
+}
+
+void progress_detach(const TProgressShm *shm)
+{
+    if (shm != NULL)
+        munmap((void *)shm, sizeof(TProgressShm));
+}
@@ -0,0 +1,96 @@
+/*
+ * ProgressTop.c
+ *
+ * Reader for the --progress segment, built with make as mikro_hb_progress.
+ *   mikro_hb_progress [--watch <ms>] <name>
+ * Prints one line per board, once or every ms until every board is done,
+ * waiting for the segment to appear when watching.
+ * Reading never blocks or slows the flashing process.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "Progress.h"
+
+static void print_progress(const TProgress *p)
+{
+    double percent = (p->bytes_total > 0) ? 100.0 * p->bytes_done / p->bytes_total : 0;
+
+    printf("%-16s %-8s 0x%08x %10lu/%-10lu %5.1f%% %8.1f kB/s %s",
+           p->path, (p->phase[0] != '\0') ? p->phase : "waiting", p->address, (unsigned long)p->bytes_done, (unsigned long)p->bytes_total,
+           percent, p->rate / 1e3, !p->done ? "running" : (p->result == 0) ? "ok" : "failed");
+    if (p->done && p->result != 0)
+        printf(" %d", p->result);
+    printf("\n");
+}
+
+// return: boards still running, -1 if the segment isn't there
+static int print_segment(const char *name)
+{
+    const TProgressShm *shm = progress_attach(name);
+    TProgress p;
+    int running = 0;
+    int i = 0;
+
+    if (shm == NULL)
+        return -1;
+
+    printf("pid %d\n", shm->pid);
+    for (i = 0; i < MAX_PROGRESS_SLOTS; i++)
+    {
+        if (progress_read(shm, i, &p) < 0)
+            continue;
+        print_progress(&p);
+        running += !p.done;
+    }
+    progress_detach(shm);
+    return running;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"watch", required_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0}};
+    int watch_ms = 0;
+    int running = 0;
+    int c = 0;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        if (c != 'w')
+        {
+            fprintf(stderr, "Usage: %s [--watch <ms>] <name>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        watch_ms = atoi(optarg);
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [--watch <ms>] <name>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // attached again each time, a new run replaces the segment
+    for (;;)
+    {
+        running = print_segment(argv[optind]);
+        if (watch_ms <= 0 || running == 0)
+            break;
+        usleep(watch_ms * 1000);
+        if (running > 0)
+            printf("\n");
+    }
+
+    if (running < 0)
+    {
+        fprintf(stderr, "No progress segment %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "Realtime.h"
+#include "Session.h"
+#include "Options.h"
+
+// stack touched up front so page faults don't land in the transfer loop
+#define RT_STACK_PREFAULT (64 * 1024)
+#define RT_STACK_SIZE (512 * 1024)
+
+typedef struct
+{
+    libusb_context *ctx;
+    TSession **sessions;
+    int count;
+    int result;
+} TRtJob;
+
+static void realtime_prefault_stack(void)
+{
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+/*
+ * Apply affinity and SCHED_FIFO to the calling thread, failures are
+ * reported but not fatal, the transfers still run just with more jitter.
+ */
+static void realtime_configure_thread(void)
+{
+    struct sched_param param = {0};
+    cpu_set_t cpus;
+    int result = 0;
+
+    if (options.rt_cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(options.rt_cpu, &cpus);
+        result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result != 0)
+            fprintf(stderr, "rt: unable to pin to cpu %d (%s)\n", options.rt_cpu, strerror(result));
+    }
+
+    param.sched_priority = options.rt_priority;
+    result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (result != 0)
+        fprintf(stderr, "rt: unable to set SCHED_FIFO %d (%s), needs CAP_SYS_NICE\n", options.rt_priority, strerror(result));
+
+    realtime_prefault_stack();
+}
+
+// the thread handles libusb events itself, the caller only waits on it
+static void *realtime_thread(void *arg)
+{
+    TRtJob *job = arg;
+
+    realtime_configure_thread();
+    job->result = session_run(job->ctx, job->sessions, job->count);
+    return NULL;
+}
+
+/*
+ * Sessions and their transfers and buffers are allocated before the
+ * thread starts, mlockall keeps those pages and any later ones resident.
+ *
+ * return: result of session_run()
+ */
+int realtime_run(libusb_context *ctx, TSession *sessions[], int count)
+{
+    TRtJob job = {ctx, sessions, count, 0};
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result = 0;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "rt: mlockall failed (%s)\n", strerror(errno));
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+    result = pthread_create(&thread, &attr, realtime_thread, &job);
+    pthread_attr_destroy(&attr);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "rt: pthread_create failed (%s)\n", strerror(result));
+        munlockall();
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    pthread_join(thread, NULL);
+    munlockall();
+    return job.result;
+}
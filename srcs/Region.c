@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "Region.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Window.h"
+
+// 2 = region plan
+#define DEBUG 2
+
+// return: 0 on success, -1 if the list is full
+int region_add(TRegionList *list, const TRegion *region)
+{
+    if (list->count >= MAX_REGIONS)
+    {
+        fprintf(stderr, "No room for region %s\n", region->name);
+        return -1;
+    }
+    memcpy(&list->items[list->count++], region, sizeof(TRegion));
+    return 0;
+}
+
+// by order, regions of equal order keep the order they were added in
+void region_sort(TRegionList *list)
+{
+    TRegion tmp;
+    int i = 0;
+    int j = 0;
+
+    for (i = 1; i < list->count; i++)
+    {
+        memcpy(&tmp, &list->items[i], sizeof(TRegion));
+        for (j = i; j > 0 && list->items[j - 1].order > tmp.order; j--)
+            memcpy(&list->items[j], &list->items[j - 1], sizeof(TRegion));
+        memcpy(&list->items[j], &tmp, sizeof(TRegion));
+    }
+}
+
+/*
+ * Add the MikroC layout behind any regions already in the list, 1st 1d00
+ * program flash, then the boot start up page and last 1fc0 config data,
+ * and sort the lot into write order.
+ *
+ * return: 0 on success, -1 if the list is full
+ */
+int region_plan(TRegionList *list, const THexImage *image, const TBootInfo *bootinfo)
+{
+    uint16_t erase_block = bootinfo->uiEraseBlock.fValue.intVal;
+    uint16_t write_block = bootinfo->uiWriteBlock.fValue.intVal;
+    TRegion r;
+    uint32_t pages = 0;
+    int i = 0;
+
+    // hex page tracking works out how many pages will be loaded into PFM 1 page at a time
+    // bootload firmware has 16bit int so can't load more than 0x8000 bytes at a time
+    pages = page_iteration_calc(erase_block, image->prg_mem_count);
+
+    memset(&r, 0, sizeof(TRegion));
+    strcpy(r.name, "program");
+    r.source = hsPRG;
+    r.base = _PIC32Mn_STARTFLASH;
+    r.erase = erBLOCKS;
+    r.order = 0;
+    if (pages == 1)
+    {
+        // round up to whole rows
+        r.page_size = write_block * page_iteration_calc(write_block, image->prg_mem_count);
+    }
+    else
+    {
+        // load the full page into the chip
+        r.page_size = erase_block;
+    }
+    r.size = pages * r.page_size;
+    r.erase_blocks = (uint16_t)pages;
+
+    // erase for MikroC starts high and subtracts
+    r.erase_address = r.base + pages * erase_block;
+    if (region_add(list, &r) < 0)
+        return -1;
+
+    //  the boot start vector page, MikroC bootloader uses program flash
+    //  depending on the mcu ie. pic32mz1024efh 0x100000 in size, worked out
+    //  from bootinfo as the parser may not have got to the page yet
+    memset(&r, 0, sizeof(TRegion));
+    strcpy(r.name, "boot");
+    r.source = hsBOOT;
+    r.base = (bootinfo->ulBootStart.fValue & V2P) - erase_block;
+    r.size = erase_block;
+    r.page_size = erase_block;
+    r.erase = erBLOCKS;
+    r.erase_address = r.base;
+    r.erase_blocks = 1;
+    r.order = 1;
+    if (region_add(list, &r) < 0)
+        return -1;
+
+    // config data, one row
+    memset(&r, 0, sizeof(TRegion));
+    strcpy(r.name, "config");
+    r.source = hsCONF;
+    r.base = _PIC32Mn_STARTCONF;
+    r.size = write_block;
+    r.page_size = write_block;
+    r.erase = erBLOCKS;
+    r.erase_address = _PIC32Mn_STARTCONF;
+    r.erase_blocks = 1;
+    r.order = 2;
+    if (region_add(list, &r) < 0)
+        return -1;
+
+    region_sort(list);
+
+#if DEBUG == 2
+    for (i = 0; i < list->count; i++)
+        printf("region %s [%08x] : [%u] : [%u] erase [%08x] [%u]\n", list->items[i].name, list->items[i].base,
+               list->items[i].size, list->items[i].page_size, list->items[i].erase_address, list->items[i].erase_blocks);
+#endif
+    return 0;
+}
+
+/*
+ * Keep only the regions a selection touches, a range cuts a region down
+ * to the erase blocks it intersects. The boot page is dropped unless the
+ * range covers it, so the start up line is only rewritten when asked for.
+ *
+ * return: regions left, -1 if no region has the name
+ */
+int region_select(TRegionList *list, const TRegionSelect *select)
+{
+    TRegion *r = NULL;
+    uint32_t start = select->start & V2P;
+    uint32_t end = ((select->end - 1) & V2P) + 1;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    uint32_t unit = 0;
+    int named = 0;
+    int kept = 0;
+    int i = 0;
+
+    for (i = 0; i < list->count; i++)
+    {
+        r = &list->items[i];
+        if (select->name[0] != '\0')
+        {
+            if (strcmp(r->name, select->name) != 0)
+                continue;
+            named = 1;
+        }
+
+        if (select->end != 0)
+        {
+            if (end <= r->base || start >= r->base + r->size)
+                continue;
+
+            // a region of more than one block is written a block per page
+            unit = (r->erase_blocks > 1) ? r->page_size : r->size;
+            lo = (start > r->base) ? start : r->base;
+            hi = (end < r->base + r->size) ? end : r->base + r->size;
+            lo = r->base + (lo - r->base) / unit * unit;
+            hi = r->base + (hi - r->base + unit - 1) / unit * unit;
+
+            if (r->erase_blocks > 1)
+            {
+                r->erase_address -= r->base + r->size - hi;
+                r->erase_blocks = (uint16_t)((hi - lo) / unit);
+            }
+            r->offset += lo - r->base;
+            r->base = lo;
+            r->size = hi - lo;
+        }
+
+        if (kept != i)
+            memcpy(&list->items[kept], r, sizeof(TRegion));
+        kept++;
+    }
+    list->count = kept;
+
+    if (select->name[0] != '\0' && !named)
+    {
+        fprintf(stderr, "No region named %s\n", select->name);
+        return -1;
+    }
+
+#if DEBUG == 2
+    for (i = 0; i < list->count; i++)
+        printf("selected %s [%08x] : [%u] erase [%08x] [%u]\n", list->items[i].name, list->items[i].base,
+               list->items[i].size, list->items[i].erase_address, list->items[i].erase_blocks);
+#endif
+    return kept;
+}
+
+/*
+ * Does the region have anything to write, program flash nothing in the
+ * file touches is left alone. The boot page and config data always carry
+ * the start up lines. The pipeline's prepass answers while the parse is
+ * still going, pass NULL once the image is complete.
+ */
+int region_changed(const TRegion *region, const THexImage *image, const THexPipeline *pipeline)
+{
+    const uint8_t *src = NULL;
+    uint32_t offset = region->offset;
+    uint32_t end = region->offset + region->size;
+    uint32_t chunk = 0;
+    uint32_t i = 0;
+
+    if (region->size == 0)
+        return 0;
+    if (region->hook != NULL || region->source != hsPRG)
+        return 1;
+    if (pipeline != NULL && pipeline->touched != NULL)
+        return hex_pipeline_touched(pipeline, region->offset, region->size);
+    if (image->window != NULL)
+        return hex_window_touched(image->window, region->offset, region->size);
+
+    // a copied block is only good to its end
+    for (; offset < end; offset += chunk)
+    {
+        chunk = image->block_size - (offset % image->block_size);
+        if (chunk > end - offset)
+            chunk = end - offset;
+        src = hex_image_data(image, hsPRG, offset);
+        for (i = 0; i < chunk; i++)
+        {
+            if (src[i] != 0xff)
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1215 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "Session.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Utils.h"
+#include "USB.h"
+#include "Options.h"
+#include "Realtime.h"
+#include "Metrics.h"
+#include "Capture.h"
+#include "Cache.h"
+#include "Validate.h"
+#include "Window.h"
+#include "Shared.h"
+#include "Channel.h"
+
+// 2 = address info |
+// 4 = Report transfer size, erase and write addresses
+#define DEBUG 2
+
+#define MAX_EPOLL_EVENTS 16
+
+// build() result, the state can't go on until evREADY
+#define BUILD_WAIT 2
+
+/*
+ * To get chip into bootloader mode to usb needs to interrupt transfer a sequence of packets
+ * Packet A : send [STX][cmdSYNC]
+ * Packet B : send [STX][cmdINFO]
+ * Packet C : send [STX][cmdBOOT]
+ * Packet D : send [STX][cmdSYNC]
+ * Find the file to send
+ */
+
+/*
+ * State table, one row per UHB command.
+ *  build = frame data_out for the state, returns > 0 if the packet must be
+ *          sent, 0 if the state needs no usb traffic, < 0 on failure.
+ *  next  = transition once the state's transfer has completed.
+ */
+typedef struct
+{
+    const char *name;
+    uint8_t out_only;
+    int (*build)(TSession *s);
+    TCmd (*next)(TSession *s);
+} TSessionState;
+
+static int build_non(TSession *s);
+static int build_sync(TSession *s);
+static int build_info(TSession *s);
+static int build_boot(TSession *s);
+static int build_erase(TSession *s);
+static int build_write(TSession *s);
+static int build_hex(TSession *s);
+static int build_reboot(TSession *s);
+static TCmd next_non(TSession *s);
+static TCmd next_sync(TSession *s);
+static TCmd next_info(TSession *s);
+static TCmd next_boot(TSession *s);
+static TCmd next_erase(TSession *s);
+static TCmd next_write(TSession *s);
+static TCmd next_hex(TSession *s);
+static TCmd next_reboot(TSession *s);
+static int build_stream(TSession *s);
+static TCmd next_stream(TSession *s);
+static void session_channel_page(TSession *s);
+
+static const TSessionState session_table[cmdHEX + 1] = {
+    [cmdNON] = {"Prepare", 0, build_non, next_non},
+    [cmdSYNC] = {"Sync", 0, build_sync, next_sync},
+    [cmdINFO] = {"Info", 0, build_info, next_info},
+    [cmdBOOT] = {"Boot", 0, build_boot, next_boot},
+    [cmdREBOOT] = {"Reboot", 2, build_reboot, next_reboot},
+    [cmdWRITE] = {"Write", 1, build_write, next_write},
+    [cmdERASE] = {"Erase", 0, build_erase, next_erase},
+    [cmdHEX] = {"HEX", 1, build_hex, next_hex},
+};
+
+// the transition out of the current state, from the stream once it has taken over
+static TCmd session_next(TSession *s)
+{
+    return s->streaming ? next_stream(s) : session_table[s->tcmd].next(s);
+}
+
+static void frame_command(TSession *s, TCmd cmd)
+{
+    boot_frame_command(s->data_out, cmd, s->report_out);
+}
+
+// the hex, not the board or the link, a failure metrics count as "image"
+static int session_image_error(TSession *s)
+{
+    s->image_failed = 1;
+    return LIBUSB_ERROR_OTHER;
+}
+
+/*
+ * Move on to the next region with something to write,
+ * regions with nothing changed are skipped without any usb traffic.
+ *
+ * return: 1 = s->region_index is set up, 0 = none left
+ */
+static int region_next(TSession *s)
+{
+    const THexPipeline *pipeline = s->pipeline.running ? &s->pipeline : NULL;
+    const TRegion *r = NULL;
+
+    while (++s->region_index < s->regions.count)
+    {
+        r = &s->regions.items[s->region_index];
+        if (!region_changed(r, &s->image, pipeline))
+        {
+            printf("%s unchanged, skipped\n", r->name);
+            continue;
+        }
+
+        s->region_entered = 0;
+        s->page_tracking = 0;
+        s->pages_to_flash = r->size / r->page_size;
+        s->hex_load_limit = (r->page_size / s->report_out) - 1;
+        s->bootaddress_space = r->base;
+        return 1;
+    }
+    return 0;
+}
+
+// the command a region starts with
+static TCmd region_first(TSession *s)
+{
+    return (s->regions.items[s->region_index].erase == erBLOCKS) ? cmdERASE : cmdWRITE;
+}
+
+/*
+ * Run the region's patch hook ahead of its first command, when parsing
+ * while flashing the hook waits until the whole region is final.
+ *
+ * return: 0 to go on, BUILD_WAIT or a libusb error code
+ */
+static int region_enter(TSession *s)
+{
+    TRegion *r = &s->regions.items[s->region_index];
+    int ready = 1;
+
+    if (s->region_entered)
+        return 0;
+
+    if (r->hook != NULL)
+    {
+        if (s->pipeline.running)
+            ready = hex_pipeline_ready(&s->pipeline, r->source, r->offset, r->size);
+        if (ready < 0)
+            return session_image_error(s);
+        if (ready == 0)
+            return BUILD_WAIT;
+        if (r->hook(r, &s->image, r->hook_user) < 0)
+            return session_image_error(s);
+    }
+    s->region_entered = 1;
+    return 0;
+}
+
+// share or compile the packet stream for the complete image, on failure the regions are walked as before
+static void session_stream_compile(TSession *s)
+{
+    char key[STREAM_KEY_SIZE];
+
+    stream_key(key, sizeof(key), s->image.digest, &s->bootinfo, s->report_out, &s->select);
+    s->stream = stream_find(key);
+    if (s->stream != NULL)
+        return;
+
+    s->stream = stream_compile(key, &s->regions, &s->image, s->report_out);
+#if DEBUG == 2
+    if (s->stream != NULL)
+        printf("packet stream %u reports of %u : compiled\n", s->stream->count, s->stream->report_size);
+#endif
+}
+
+/*
+ * The image another process on this host published, otherwise parsed
+ * here, from the cache if it has it, and published for the next ones.
+ *
+ * return: 1 = image ready, 0 = not shared, parse as usual, libusb error code on failure
+ */
+static int session_shared_image(TSession *s)
+{
+    TBootInfo *bootinfo_t = &s->bootinfo;
+    TSharedImage *shared = NULL;
+    char digest[DIGEST_HEX_SIZE];
+    int result = 0;
+
+    if (digest_file(s->path, digest) != 0)
+        return 0;
+    result = shared_open(&shared, digest, bootinfo_t, &s->image);
+    if (result != 0)
+        return (result > 0) ? 1 : 0;
+
+    // first on the host, validated once like the parse
+    if (s->validate && hex_validate(s->path, bootinfo_t) != 0)
+    {
+        fprintf(stderr, "%s failed validation, nothing was erased\n", s->path);
+        shared_release(shared);
+        return session_image_error(s);
+    }
+    if (s->cache_dir != NULL && cache_load(s->cache_dir, s->path, bootinfo_t, &s->image) == 0)
+        s->cache_hit = 1;
+    else
+        condition_hexfile_data(s->path, bootinfo_t, &s->image);
+
+    // an empty file or no segment, this process keeps its own copy
+    if (s->image.file_size == 0 || shared_publish(shared, &s->image) < 0)
+        shared_release(shared);
+    return 1;
+}
+
+// a stalled session steps on when the parser signals, not on a timer
+static void session_watch_parser(TSession *s)
+{
+    struct epoll_event ev = {0};
+
+    if (s->epfd < 0)
+        return;
+    // edge triggered, the session drains it only while stalled
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = s->pipeline.event_fd;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->pipeline.event_fd, &ev) < 0)
+        fprintf(stderr, "parser epoll_ctl error %d\n", errno);
+}
+
+/*
+ * The image every board of a run is patched from, the first session to
+ * need it conditions it and the rest take a hex_image_share() view. A
+ * board with another device profile parses its own.
+ *
+ * return: 1 = image views the base, 0 = parse as usual, libusb error code on failure
+ */
+static int session_base_image(TSession *s, const char *paths[], int count)
+{
+    TBootInfo *bootinfo_t = &s->bootinfo;
+    THexImage *base = s->base;
+    int i = 0;
+
+    if (base->file_size == 0)
+    {
+        for (i = 0; s->validate && i < count; i++)
+        {
+            if (hex_validate(paths[i], bootinfo_t) != 0)
+            {
+                fprintf(stderr, "%s failed validation, nothing was erased\n", paths[i]);
+                return session_image_error(s);
+            }
+        }
+
+        free_hex_image(base);
+        if (count > 1)
+            compose_hexfile_data(paths, count, bootinfo_t, base);
+        else if (s->cache_dir != NULL && cache_load(s->cache_dir, s->path, bootinfo_t, base) == 0)
+            s->cache_hit = 1;
+        else
+            condition_hexfile_data(s->path, bootinfo_t, base);
+    }
+
+    if (base->prg_size != bootinfo_t->ulMcuSize.fValue || base->block_size != bootinfo_t->uiEraseBlock.fValue.intVal ||
+        base->boot_address != (bootinfo_t->ulBootStart.fValue & V2P) - base->block_size)
+        return 0;
+    hex_image_share(&s->image, base);
+    return 1;
+}
+
+/*
+ * A wait state ahead of the first erase, conditions the image and lays
+ * the regions out, see region_plan().
+ */
+static int build_non(TSession *s)
+{
+    TBootInfo *bootinfo_t = &s->bootinfo;
+    const char *paths[MAX_HEX_FILES] = {s->path};
+    char digest[DIGEST_HEX_SIZE];
+    char key[STREAM_KEY_SIZE];
+    int count = 1 + s->overlay_count;
+    int result = 0;
+    int i = 0;
+
+    for (i = 1; i < count; i++)
+        paths[i] = s->overlays[i - 1];
+
+    // another board already has this file framed for the same profile
+    if (count == 1 && s->base == NULL && s->patch == NULL && stream_shared() > 0 && digest_file(s->path, digest) == 0)
+    {
+        stream_key(key, sizeof(key), digest, bootinfo_t, s->report_out, &s->select);
+        s->stream = stream_find(key);
+        // nothing is parsed, the digest still labels the boards metrics and progress
+        if (s->stream != NULL)
+        {
+            memcpy(s->image.digest, digest, sizeof(s->image.digest));
+            return 0;
+        }
+    }
+
+    // the watcher conditions new files for every device seen
+    if (s->cache_dir != NULL)
+        cache_profile_save(s->cache_dir, bootinfo_t);
+
+    // open hex file read it line for line and extract the data according
+    //  to the address, buffer offset is indexed by address
+    if (s->base != NULL && (result = session_base_image(s, paths, count)) != 0)
+    {
+        if (result < 0)
+            return result;
+    }
+    else if (count == 1 && s->window == 0 && s->shared && (result = session_shared_image(s)) != 0)
+    {
+        if (result < 0)
+            return result;
+    }
+    else if (count == 1 && s->window == 0 && s->cache_dir != NULL && cache_load(s->cache_dir, s->path, bootinfo_t, &s->image) == 0)
+        s->cache_hit = 1;
+    else
+    {
+        // a bad file is refused before anything is erased, a window validates what it indexed
+        for (i = 0; s->validate && s->window == 0 && i < count; i++)
+        {
+            if (hex_validate(paths[i], bootinfo_t) != 0)
+            {
+                fprintf(stderr, "%s failed validation, nothing was erased\n", paths[i]);
+                return session_image_error(s);
+            }
+        }
+
+        // the cache and the parse thread key on one file
+        if (s->window > 0)
+        {
+            if (hex_window_open(&s->image, s->path, bootinfo_t, s->window) > 0 && s->validate &&
+                hex_validate_window(s->path, bootinfo_t, s->image.window) != 0)
+            {
+                fprintf(stderr, "%s failed validation, nothing was erased\n", s->path);
+                return session_image_error(s);
+            }
+        }
+        else if (count > 1)
+            compose_hexfile_data(paths, count, bootinfo_t, &s->image);
+        else if (s->parse_thread && s->patch == NULL)
+        {
+            if (hex_pipeline_start(&s->pipeline, s->path, bootinfo_t, &s->image) > 0)
+                session_watch_parser(s);
+        }
+        else
+            condition_hexfile_data(s->path, bootinfo_t, &s->image);
+    }
+
+    // no point in continuing if the file is empty
+    if (s->image.file_size == 0)
+    {
+        fprintf(stderr, "Nothing to flash!\n");
+        return session_image_error(s);
+    }
+
+    // serial number, MAC... only the touched erase blocks are copied
+    if (s->patch != NULL && patch_image(&s->image, s->patch, s->patch_user) < 0)
+        return session_image_error(s);
+
+    if (region_plan(&s->regions, &s->image, bootinfo_t) < 0)
+        return session_image_error(s);
+
+    // targeted update, only the selected blocks are erased and written
+    if ((s->select.end != 0 || s->select.name[0] != '\0') && region_select(&s->regions, &s->select) < 0)
+        return session_image_error(s);
+
+    s->region_index = -1;
+    if (!region_next(s))
+    {
+        fprintf(stderr, "Nothing to flash!\n");
+        return session_image_error(s);
+    }
+
+    // the image is final, frame every report once, a window never holds it all
+    if (!s->pipeline.running && s->patch == NULL && s->window == 0)
+        session_stream_compile(s);
+    return 0;
+}
+
+static TCmd next_non(TSession *s)
+{
+    return cmdSYNC;
+}
+
+static int build_sync(TSession *s)
+{
+    frame_command(s, cmdSYNC);
+    return 1;
+}
+
+static TCmd next_sync(TSession *s)
+{
+    uint32_t i = 0;
+
+    // what a monitor shows the bytes done against
+    s->bytes_total = 0;
+    if (s->stream != NULL)
+    {
+        for (i = 0; i < s->stream->count; i++)
+            s->bytes_total += (s->stream->marks[i].cmd == cmdHEX) ? s->stream->report_size : 0;
+    }
+    // only what region_next() will write, --range / --region already trimmed the list
+    for (i = 0; s->stream == NULL && i < (uint32_t)s->regions.count; i++)
+    {
+        if (region_changed(&s->regions.items[i], &s->image, s->pipeline.running ? &s->pipeline : NULL))
+            s->bytes_total += s->regions.items[i].size;
+    }
+
+    if (s->stream != NULL)
+    {
+        s->streaming = 1;
+        s->packet = 0;
+        return (TCmd)s->stream->marks[0].cmd;
+    }
+    return region_first(s);
+}
+
+static int build_info(TSession *s)
+{
+    frame_command(s, cmdINFO);
+    return 1;
+}
+
+static TCmd next_info(TSession *s)
+{
+    return cmdBOOT;
+}
+
+static int build_boot(TSession *s)
+{
+    bootInfo_buffer(&s->bootinfo, s->data_in);
+    frame_command(s, cmdBOOT);
+
+    // a page has to be whole reports
+    while (s->report_out > s->bootinfo.uiWriteBlock.fValue.intVal && s->report_out > MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+        s->report_out /= 2;
+
+    return 1;
+}
+
+static TCmd next_boot(TSession *s)
+{
+    return cmdNON;
+}
+
+/*
+ * bootloader needs startaddress "page boundry" and quantity of pages to to erase
+ * erase for MikroC starts high and subracts from quantity after each page has
+ * been erased and quantity == 0
+ */
+static int build_erase(TSession *s)
+{
+    const TRegion *r = &s->regions.items[s->region_index];
+    int result = region_enter(s);
+
+    if (result != 0)
+        return result;
+
+    frame_command(s, cmdERASE);
+    memcpy(s->data_out + 2, &r->erase_address, sizeof(uint32_t));
+    memcpy(s->data_out + 6, &r->erase_blocks, sizeof(int16_t));
+    return 1;
+}
+
+static TCmd next_erase(TSession *s)
+{
+    return cmdWRITE;
+}
+
+// announce the address and byte count of the page about to be streamed
+static int build_write(TSession *s)
+{
+    const TRegion *r = &s->regions.items[s->region_index];
+    uint16_t size = (uint16_t)r->page_size;
+    uint32_t offset = r->offset + s->page_tracking * r->page_size;
+    int ready = region_enter(s);
+
+    if (ready != 0)
+        return ready;
+
+    // parse-while-flashing, hold the page until its erase blocks are final
+    ready = 1;
+    if (s->pipeline.running)
+        ready = hex_pipeline_ready(&s->pipeline, r->source, offset, r->page_size);
+    if (ready < 0)
+        return session_image_error(s);
+    if (ready == 0)
+        return BUILD_WAIT;
+
+    s->bootaddress_space = r->base + s->page_tracking * r->page_size;
+    s->page_started = time_now_ns();
+    s->src = hex_image_data(&s->image, r->source, offset);
+    if (s->src == NULL)
+        return session_image_error(s);
+
+    s->hex_load_tracking = 0;
+    frame_command(s, cmdWRITE);
+    memcpy(s->data_out + 2, &s->bootaddress_space, sizeof(uint32_t));
+    memcpy(s->data_out + 6, &size, sizeof(int16_t));
+    return 1;
+}
+
+static TCmd next_write(TSession *s)
+{
+    return cmdHEX;
+}
+
+// use the flash buffer to stream 64 byte slices at a time, the last one is acknowledged
+static int build_hex(TSession *s)
+{
+    s->hex_load_tracking++;
+    if (s->hex_load_tracking > s->hex_load_limit)
+        s->out_only = 0;
+
+    load_hex_buffer(s->data_out, &s->src, s->report_out);
+    return 1;
+}
+
+static TCmd next_hex(TSession *s)
+{
+    if (s->hex_load_tracking <= s->hex_load_limit)
+        return cmdHEX;
+    session_channel_page(s);
+
+    // next page of this region
+    if (++s->page_tracking < s->pages_to_flash)
+        return cmdWRITE;
+
+    // straight on to the next region, re-boot after the last
+    if (region_next(s))
+        return region_first(s);
+
+    return cmdREBOOT;
+}
+
+static int build_reboot(TSession *s)
+{
+#if DEBUG == 0
+    printf("%u : %u\n", s->image.prg_mem_count, s->image.conf_mem_count);
+#endif
+    frame_command(s, cmdREBOOT);
+    return 1;
+}
+
+static TCmd next_reboot(TSession *s)
+{
+    return cmdDONE;
+}
+
+// send report s->packet of the stream as compiled, nothing is framed or copied
+static int build_stream(TSession *s)
+{
+    s->frame = s->stream->frames + (size_t)s->packet * s->stream->report_size;
+    s->out_only = s->stream->marks[s->packet].out_only;
+    if (s->stream->marks[s->packet].cmd == cmdWRITE)
+        s->page_started = time_now_ns();
+    return 1;
+}
+
+static TCmd next_stream(TSession *s)
+{
+    // the acknowledged last report of a page
+    if (s->stream->marks[s->packet].cmd == cmdHEX && s->stream->marks[s->packet].out_only == 0)
+        session_channel_page(s);
+    if (++s->packet >= s->stream->count)
+        return cmdDONE;
+    return (TCmd)s->stream->marks[s->packet].cmd;
+}
+
+/*
+ * A page has been written and acknowledged. During the channel trial the
+ * first CHANNEL_TRIAL_PAGES go over interrupt, the next ones over control,
+ * then the faster takes the rest of the image and the hub.
+ */
+static void session_channel_page(TSession *s)
+{
+    if (!s->channel_trial)
+        return;
+
+    s->trial_ns[s->channel] += time_now_ns() - s->page_started;
+    s->trial_pages++;
+    if (s->trial_pages == CHANNEL_TRIAL_PAGES)
+        s->channel = chCONTROL;
+    else if (s->trial_pages == 2 * CHANNEL_TRIAL_PAGES)
+    {
+        s->channel = channel_record(s->devh, s->cache_dir, s->report_out, s->trial_bytes, s->trial_ns);
+        s->channel_trial = 0;
+    }
+}
+
+// a handful of stores, called for every report so monitors see it live
+static void session_progress(TSession *s)
+{
+    TProgress *p = &s->progress;
+    uint64_t now = 0;
+
+    if (s->progress_slot < 0)
+        return;
+
+    now = time_now_ns();
+    p->done = (s->tcmd == cmdDONE);
+    if (!p->done)
+        strncpy(p->phase, session_table[s->tcmd].name, sizeof(p->phase) - 1);
+    if (s->tcmd == cmdERASE || s->tcmd == cmdWRITE)
+        memcpy(&p->address, s->frame + 2, sizeof(uint32_t));
+    p->result = s->result;
+    p->bytes_done = s->bytes_written;
+    p->bytes_total = s->bytes_total;
+    if (now > s->started)
+        p->rate = s->bytes_written * 1000000000ull / (now - s->started);
+    p->updated_ns = now;
+    progress_publish(s->progress_slot, p);
+}
+
+static int session_finish(TSession *s, int result)
+{
+    char profile[MAX_STRING_FIELD_LENGTH + 1] = {0};
+    char digest[13] = {0};
+
+    s->tcmd = cmdDONE;
+    s->result = result;
+    s->deadline = -1;
+    s->stalled = 0;
+
+    // the digest is the parsers last job
+    if (hex_pipeline_finish(&s->pipeline) < 0 && result == 0)
+        s->result = result = session_image_error(s);
+
+    // parsed while flashing, boards still queued take the stream
+    if (result == 0 && s->stream_publish && s->stream == NULL && s->patch == NULL && s->window == 0 && s->regions.count > 0)
+        session_stream_compile(s);
+
+    // device profile and short image digest label the line statistics
+    memcpy(profile, s->bootinfo.sDevDsc.fValue, MAX_STRING_FIELD_LENGTH);
+    memcpy(digest, s->image.digest, sizeof(digest) - 1);
+    s->metrics_slot = metrics_slot(profile, digest);
+    metrics_board_done(s->metrics_slot, result, s->image_failed ? failIMAGE : metrics_fail_reason(result), time_now_ns() - s->started, s->bytes_written);
+    session_progress(s);
+    return result;
+}
+
+static int session_submit(TSession *s, TUsbTransfer *t, uint8_t in, char *data)
+{
+    int result = 0;
+
+    if (!in && s->channel == chCONTROL)
+        result = boot_control_submit(t, s->devh, data, s->report_out);
+    else
+        result = boot_interrupt_submit(t, s->devh, in, data, in ? s->report_in : s->report_out);
+
+    if (result < 0)
+    {
+        s->result = result;
+        return session_step(s, evERROR);
+    }
+
+    s->pending++;
+    s->deadline = (int64_t)time_now_ms() + TIMEOUT_MS;
+    return 0;
+}
+
+/*
+ * A report nothing waits on over the control channel, endpoint 0 keeps
+ * queued requests in order so the burst goes out back to back instead
+ * of one SET_REPORT per completion.
+ *
+ * return: zero on success, libusb error code on failure
+ */
+static int session_queue(TSession *s)
+{
+    int result = 0;
+    int i = 0;
+
+    while (s->queue_busy & (1 << i))
+        i++;
+    result = boot_control_submit(&s->xfer_queue[i], s->devh, s->frame, s->report_out);
+    if (result < 0)
+        return result;
+
+    s->queue_busy |= 1 << i;
+    s->queued++;
+    s->pending++;
+    s->deadline = (int64_t)time_now_ms() + TIMEOUT_MS;
+    return 0;
+}
+
+static void session_transfer_done(TUsbTransfer *t, int result)
+{
+    TSession *s = t->user_data;
+
+    latency_add(&s->latency, time_now_ns() - t->submitted);
+    if (t != &s->xfer_in && (s->tcmd == cmdHEX || t != &s->xfer_out) && result > 0)
+        s->bytes_written += result;
+    s->pending--;
+    s->deadline = (s->pending > 0) ? (int64_t)time_now_ms() + TIMEOUT_MS : -1;
+
+    // a queued report only holds the state machine up while the queue is full
+    if (t != &s->xfer_out && t != &s->xfer_in)
+    {
+        s->queue_busy &= ~(1 << (t - s->xfer_queue));
+        s->queued--;
+        if (s->tcmd == cmdDONE)
+            return;
+        if (result < 0)
+        {
+            s->result = result;
+            session_step(s, evERROR);
+        }
+        else if (s->queue_wait)
+        {
+            s->queue_wait = 0;
+            session_step(s, evREADY);
+        }
+        return;
+    }
+
+    // cancelled after a timeout, nothing left to drive
+    if (s->tcmd == cmdDONE)
+        return;
+
+    if (result < 0 || (t == &s->xfer_in && result == 0))
+    {
+        s->result = (result < 0) ? result : -1;
+        session_step(s, evERROR);
+    }
+    else
+        session_step(s, (t == &s->xfer_in) ? evIN_DONE : evOUT_DONE);
+}
+
+// Returns - zero on success, libusb error code on failure.
+int session_init(TSession *s, libusb_device_handle *devh, const char *path)
+{
+    int result = 0;
+    int i = 0;
+
+    memset(s, 0, sizeof(TSession));
+    s->devh = devh;
+    strncpy(s->path, path, sizeof(s->path) - 1);
+    s->tcmd = cmdNON;
+    s->last_tcmd = cmdDONE;
+    s->deadline = -1;
+    s->epfd = -1;
+    s->opened = time_now_ns();
+    s->metrics_slot = -1;
+    s->progress_slot = -1;
+    s->report_out = MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+    s->report_in = MAX_INTERRUPT_IN_TRANSFER_SIZE;
+    hex_pipeline_init(&s->pipeline);
+
+    result = boot_transfer_alloc(&s->xfer_out, session_transfer_done, s);
+    if (result == 0)
+        result = boot_transfer_alloc(&s->xfer_in, session_transfer_done, s);
+    for (i = 0; result == 0 && i < CONTROL_QUEUE_DEPTH; i++)
+        result = boot_transfer_alloc(&s->xfer_queue[i], session_transfer_done, s);
+
+    return result;
+}
+
+// the command line options every session takes
+void session_configure(TSession *s)
+{
+    char hub[PROGRESS_PATH_SIZE];
+
+    s->parse_thread = options.parse_thread;
+    s->validate = options.validate;
+    s->window = (uint32_t)options.window;
+    s->shared = options.shared;
+    for (s->overlay_count = 0; s->overlay_count < options.overlay_count; s->overlay_count++)
+        s->overlays[s->overlay_count] = options.overlays[s->overlay_count];
+    s->select.start = options.range_start;
+    s->select.end = options.range_end;
+    strcpy(s->select.name, options.region);
+    if (options.cache[0] != '\0')
+        s->cache_dir = options.cache;
+
+    // a replay has no port, it publishes under its own name
+    if (options.progress[0] != '\0' && s->progress_slot < 0)
+    {
+        if (s->devh != NULL)
+            boot_device_topology(libusb_get_device(s->devh), s->progress.path, hub, sizeof(s->progress.path));
+        else
+            strcpy(s->progress.path, "replay");
+        s->progress_slot = progress_slot(s->progress.path);
+    }
+}
+
+// only call once session_done(), libusb may still own the transfers before then
+void session_free(TSession *s)
+{
+    int i = 0;
+
+    hex_pipeline_finish(&s->pipeline);
+    stream_release(s->stream);
+    s->stream = NULL;
+    boot_transfer_free(&s->xfer_out);
+    boot_transfer_free(&s->xfer_in);
+    for (i = 0; i < CONTROL_QUEUE_DEPTH; i++)
+        boot_transfer_free(&s->xfer_queue[i]);
+    free_hex_image(&s->image);
+}
+
+/*
+ * Advance the state machine on an event, runs any states that need no
+ * usb traffic then queues the next transfer and returns, never blocks.
+ *
+ * return: zero while running or on success, libusb error code on failure
+ */
+int session_step(TSession *s, TSessionEvent ev)
+{
+    const TSessionState *st = NULL;
+    int result = 0;
+    int i = 0;
+
+    if (s->tcmd == cmdDONE)
+        return s->result;
+
+    switch (ev)
+    {
+    case evSTART:
+        s->started = time_now_ns();
+        s->tcmd = cmdINFO;
+        // measured on the image itself once the bootloader has taken cmdBOOT
+        if (s->channel == chAUTO)
+        {
+            s->channel = chINTERRUPT;
+            s->channel_trial = 1;
+        }
+        break;
+    case evOUT_DONE:
+        // expect a data response back from device
+        if (s->out_only == 0)
+            return session_submit(s, &s->xfer_in, 1, s->data_in);
+        s->tcmd = session_next(s);
+        break;
+    case evIN_DONE:
+        s->tcmd = session_next(s);
+        break;
+    case evTIMEOUT:
+        fprintf(stderr, "%s timed out after %d ms\n", session_table[s->tcmd].name, TIMEOUT_MS);
+        boot_transfer_cancel(&s->xfer_out);
+        boot_transfer_cancel(&s->xfer_in);
+        for (i = 0; i < CONTROL_QUEUE_DEPTH; i++)
+        {
+            if (s->queue_busy & (1 << i))
+                boot_transfer_cancel(&s->xfer_queue[i]);
+        }
+        return session_finish(s, LIBUSB_ERROR_TIMEOUT);
+    case evREADY:
+        s->stalled = 0;
+        break;
+    case evERROR:
+        // re-boot will drop the device off the bus
+        if (s->out_only == 2)
+        {
+            fprintf(stderr, "Device has been re-booted! %d\n", s->result);
+            return session_finish(s, 0);
+        }
+        fprintf(stderr, "Error during %s transfer %d\n", session_table[s->tcmd].name, s->result);
+        return session_finish(s, s->result);
+    }
+
+    while (s->tcmd != cmdDONE)
+    {
+        // every control queue slot is in flight, the first to finish steps on
+        if (s->queued == CONTROL_QUEUE_DEPTH)
+        {
+            s->queue_wait = 1;
+            return 0;
+        }
+
+        st = &session_table[s->tcmd];
+        if (s->tcmd != s->last_tcmd)
+        {
+            printf("%s\n", st->name);
+            s->last_tcmd = s->tcmd;
+        }
+
+        s->out_only = st->out_only;
+        s->frame = s->data_out;
+        result = s->streaming ? build_stream(s) : st->build(s);
+        if (result < 0)
+            return session_finish(s, result);
+        if (result == BUILD_WAIT)
+        {
+            s->stalled = 1;
+            return 0;
+        }
+        if (result > 0)
+        {
+            if (s->tcmd == cmdREBOOT)
+                s->rebooted = time_now_ns();
+            if (s->tcmd == cmdHEX && s->channel_trial)
+                s->trial_bytes[s->channel] += s->report_out;
+            session_progress(s);
+            if (s->channel != chCONTROL || s->out_only != 1)
+                return session_submit(s, &s->xfer_out, 0, s->frame);
+
+            result = session_queue(s);
+            if (result < 0)
+            {
+                fprintf(stderr, "Error during %s transfer %d\n", st->name, result);
+                return session_finish(s, result);
+            }
+        }
+
+        s->tcmd = session_next(s);
+    }
+
+    return session_finish(s, 0);
+}
+
+int session_done(const TSession *s)
+{
+    return s->tcmd == cmdDONE && s->pending == 0;
+}
+
+int64_t session_deadline(const TSession *s)
+{
+    return s->deadline;
+}
+
+/*
+ * Listen for the boards coming back up as applications, vid:pid is the
+ * bootloader, it leaving confirms unless --confirm named the application.
+ *
+ * return: 0 on success, libusb error code on failure
+ */
+int session_confirm_open(TConfirm *c, libusb_context *ctx, uint16_t vid, uint16_t pid)
+{
+    if (options.confirm_vid != 0)
+        return confirm_open(c, ctx, options.confirm_vid, options.confirm_pid, 1);
+    return confirm_open(c, ctx, vid, pid, 0);
+}
+
+/*
+ * Report a board confirm_wait() is done with, the cycle runs from the
+ * bootloader being opened to the application enumerating.
+ *
+ * return: 0 if the application came up, LIBUSB_ERROR_TIMEOUT if not
+ */
+int session_confirmed(TSession *s, const TConfirmBoard *board)
+{
+    if (board->seen_ns == 0)
+    {
+        fprintf(stderr, "%s : no application %d ms after re-boot\n", board->path, options.confirm_timeout);
+        metrics_board_confirmed(s->metrics_slot, 0, 0, 0);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    printf("%s : application up %.1f ms after re-boot, cycle %.2f s\n", board->path,
+           (double)(board->seen_ns - s->rebooted) / 1e6, (double)(board->seen_ns - s->opened) / 1e9);
+    metrics_board_confirmed(s->metrics_slot, 1, board->seen_ns - s->rebooted, board->seen_ns - s->opened);
+    return 0;
+}
+
+static void LIBUSB_CALL session_pollfd_added(int fd, short events, void *user_data)
+{
+    struct epoll_event ev = {0};
+
+    ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl((int)(intptr_t)user_data, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void LIBUSB_CALL session_pollfd_removed(int fd, void *user_data)
+{
+    epoll_ctl((int)(intptr_t)user_data, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Add libusb's file descriptors to an epoll set and keep it in step
+ * as libusb adds and removes them.
+ *
+ * return: zero on success, -1 if the fds are not available
+ */
+int session_epoll_register(libusb_context *ctx, int epfd)
+{
+    const struct libusb_pollfd **fds = libusb_get_pollfds(ctx);
+    int i = 0;
+
+    if (fds == NULL)
+        return -1;
+
+    for (i = 0; fds[i] != NULL; i++)
+        session_pollfd_added(fds[i]->fd, fds[i]->events, (void *)(intptr_t)epfd);
+    libusb_free_pollfds(fds);
+
+    libusb_set_pollfd_notifiers(ctx, session_pollfd_added, session_pollfd_removed, (void *)(intptr_t)epfd);
+    return 0;
+}
+
+void session_epoll_unregister(libusb_context *ctx)
+{
+    libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+}
+
+// ms until the nearest session deadline or libusb timeout, -1 = wait for fds only
+int session_poll_timeout(libusb_context *ctx, TSession *sessions[], int count)
+{
+    struct timeval tv = {0, 0};
+    int64_t now = (int64_t)time_now_ms();
+    int64_t timeout = -1;
+    int64_t t = 0;
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (sessions[i]->deadline < 0)
+            continue;
+        t = sessions[i]->deadline - now;
+        if (t < 0)
+            t = 0;
+        if (timeout < 0 || t < timeout)
+            timeout = t;
+    }
+
+    if (libusb_get_next_timeout(ctx, &tv) == 1)
+    {
+        t = (int64_t)tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        if (timeout < 0 || t < timeout)
+            timeout = t;
+    }
+
+    return (int)timeout;
+}
+
+// expire any sessions whose transfer overran its deadline, retry stalled ones
+void session_poll_deadlines(TSession *sessions[], int count)
+{
+    int64_t now = (int64_t)time_now_ms();
+    int i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (sessions[i]->stalled)
+        {
+            hex_pipeline_drain(&sessions[i]->pipeline);
+            session_step(sessions[i], evREADY);
+        }
+        if (sessions[i]->tcmd != cmdDONE && sessions[i]->deadline >= 0 && now >= sessions[i]->deadline)
+            session_step(sessions[i], evTIMEOUT);
+    }
+}
+
+/*
+ * Drive any number of sessions from this one thread, epoll waits on
+ * libusb's fds and the nearest deadline, completions step the sessions.
+ *
+ * return: zero if every session finished cleanly, otherwise the first failure
+ */
+int session_run(libusb_context *ctx, TSession *sessions[], int count)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct timeval zero_tv = {0, 0};
+    int epfd = 0;
+    int active = 0;
+    int result = 0;
+    int i = 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        fprintf(stderr, "epoll_create1 error %d\n", errno);
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    if (session_epoll_register(ctx, epfd) < 0)
+    {
+        fprintf(stderr, "libusb pollfds are not available\n");
+        close(epfd);
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        sessions[i]->epfd = epfd;
+        session_step(sessions[i], evSTART);
+    }
+
+    do
+    {
+        if (epoll_wait(epfd, events, MAX_EPOLL_EVENTS, session_poll_timeout(ctx, sessions, count)) < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "epoll_wait error %d\n", errno);
+            break;
+        }
+
+        libusb_handle_events_timeout_completed(ctx, &zero_tv, NULL);
+        session_poll_deadlines(sessions, count);
+
+        for (active = 0, i = 0; i < count; i++)
+            active += !session_done(sessions[i]);
+    } while (active > 0);
+
+    session_epoll_unregister(ctx);
+    close(epfd);
+
+    for (i = 0; i < count; i++)
+    {
+        if (result == 0)
+            result = sessions[i]->result;
+    }
+    return (active > 0) ? LIBUSB_ERROR_OTHER : result;
+}
+
+/*
+ * One board from the bootloader handshake to its re-boot, with the
+ * command line options, devh = NULL when a replay stands in for it.
+ * With --patch the csv rows for device apply, on a view of base when
+ * the caller keeps one image for several boards.
+ *
+ * return: zero on success, libusb error code on failure
+ */
+int session_flash(libusb_device_handle *devh, const char *path, THexImage *base, const char *device)
+{
+    TSession session;
+    TSession *sessions[] = {&session};
+    TPatchList patches = {0};
+    struct libusb_device_descriptor desc;
+    TConfirm confirm;
+    uint8_t confirming = 0;
+    int result = 0;
+
+    result = session_init(&session, devh, path);
+    session_configure(&session);
+
+    // largest reports the bootloader takes, fewer transfers per erase block
+    if (replay_active())
+        replay_report_sizes(&session.report_out, &session.report_in);
+    else if (result == 0)
+    {
+        boot_report_negotiate(devh, &session.report_out, &session.report_in);
+        session.channel = channel_select(devh, options.out_channel, session.cache_dir, session.report_out);
+    }
+    if (result == 0 && options.patch[0] != '\0')
+    {
+        if (patch_csv_load(options.patch, device, &patches) < 0)
+            result = LIBUSB_ERROR_OTHER;
+        session.patch = patch_list_next;
+        session.patch_user = &patches;
+        session.base = base;
+    }
+    // a capture has no board to come back
+    if (result == 0 && options.confirm && !replay_active() &&
+        libusb_get_device_descriptor(libusb_get_device(devh), &desc) == 0 &&
+        session_confirm_open(&confirm, NULL, desc.idVendor, desc.idProduct) == 0)
+    {
+        confirm_add(&confirm, devh);
+        confirming = 1;
+    }
+    if (result == 0)
+    {
+        if (replay_active())
+            result = replay_run(sessions, 1);
+        else if (options.rt)
+            result = realtime_run(NULL, sessions, 1);
+        else
+            result = session_run(NULL, sessions, 1);
+    }
+    latency_print("transfer latency", &session.latency);
+
+    // as parsed, the next run of this file skips the parse
+    if (result == 0 && session.cache_dir != NULL && !session.cache_hit && session.patch == NULL && session.overlay_count == 0 && session.image.prg != NULL && session.image.window == NULL)
+        cache_store(session.cache_dir, &session.image, &session.bootinfo);
+    if (confirming)
+    {
+        if (result == 0)
+        {
+            confirm.boards[0].rebooted_ns = session.rebooted;
+            confirm_wait(&confirm, options.confirm_timeout);
+            result = session_confirmed(&session, &confirm.boards[0]);
+        }
+        confirm_close(&confirm);
+    }
+    session_free(&session);
+    patch_list_free(&patches);
+    return result;
+}
+
+/*
+ * Work engine of bootloader
+ *
+ * Args: usb_device_handle = from libusb device attach
+ *       path = the folder/file path of the hexfile to be loaded
+ *
+ * return: nothing
+ */
+void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
+{
+    int result = session_flash(devh, path, NULL, options.patch_device);
+
+    capture_close();
+    replay_close();
+
+    if (options.metrics_file[0] != '\0')
+        metrics_write_textfile(options.metrics_file);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "Transfer failed %d\n", result);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Transfered data complete...\n");
+}
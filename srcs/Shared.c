@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Shared.h"
+#include "HexFile.h"
+
+// 2 = publish, attach and unlink info
+#define DEBUG 2
+
+// drop the pids of processes that are gone without releasing
+static void shared_prune(TSharedHeader *header)
+{
+    uint32_t i = 0;
+
+    while (i < header->user_count && i < SHARED_MAX_USERS)
+    {
+        if (kill(header->users[i], 0) < 0 && errno == ESRCH)
+            header->users[i] = header->users[--header->user_count];
+        else
+            i++;
+    }
+}
+
+/*
+ * Does the name still lead to the segment fd has open. The last user
+ * unlinks it while others may be waiting in flock(), they hold a segment
+ * nobody else can find any more.
+ */
+static int shared_linked(const TSharedImage *shared)
+{
+    char path[sizeof(SHARED_SHM_DIR) + SHARED_NAME_SIZE];
+    struct stat mine;
+    struct stat named;
+
+    snprintf(path, sizeof(path), "%s%s", SHARED_SHM_DIR, shared->name);
+    if (fstat(shared->fd, &mine) < 0 || stat(path, &named) < 0)
+        return 0;
+    return mine.st_ino == named.st_ino && mine.st_dev == named.st_dev;
+}
+
+static int shared_attach(TSharedHeader *header)
+{
+    shared_prune(header);
+    if (header->user_count >= SHARED_MAX_USERS)
+        return -1;
+    header->users[header->user_count++] = getpid();
+    return 0;
+}
+
+// the image reads the segment, nothing of it is owned
+static int shared_view(TSharedImage *shared, THexImage *image)
+{
+    const TCacheHeader *h = &shared->header->image;
+
+    shared->data_size = (size_t)h->prg_size + CONF_BUFFER_SIZE + h->block_size;
+    shared->data = mmap(NULL, shared->data_size, PROT_READ, MAP_SHARED, shared->fd, SHARED_HEADER_SIZE);
+    if (shared->data == MAP_FAILED)
+    {
+        fprintf(stderr, "shared image mmap error %d\n", errno);
+        shared->data = NULL;
+        return -1;
+    }
+
+    memset(image, 0, sizeof(THexImage));
+    image->prg = shared->data;
+    image->conf = shared->data + h->prg_size;
+    image->boot = shared->data + h->prg_size + CONF_BUFFER_SIZE;
+    image->prg_mem_count = h->prg_mem_count;
+    image->conf_mem_count = h->conf_mem_count;
+    image->file_size = h->file_size;
+    memcpy(image->digest, h->digest, sizeof(image->digest));
+    image->prg_size = h->prg_size;
+    image->block_size = h->block_size;
+    image->boot_address = h->boot_address;
+    image->shared = shared;
+    return 0;
+}
+
+/*
+ * Map the image another process published for this digest and device
+ * profile. On a miss the segment stays locked for this process to parse
+ * the file and shared_publish() it, processes opening it meanwhile wait.
+ *
+ * return: 1 = image maps the segment, 0 = publish it, -1 = not shared
+ */
+int shared_open(TSharedImage **shared, const char *digest, const TBootInfo *bootinfo, THexImage *image)
+{
+    TSharedImage *s = calloc(1, sizeof(TSharedImage));
+    const TCacheHeader *h = NULL;
+    struct stat st;
+    void *map = NULL;
+    int tries = 0;
+
+    *shared = NULL;
+    if (s == NULL)
+        return -1;
+    snprintf(s->name, sizeof(s->name), "/mikro_hb-%s-%x-%x-%x", digest, bootinfo->ulMcuSize.fValue,
+             bootinfo->uiEraseBlock.fValue.intVal, bootinfo->ulBootStart.fValue);
+
+    // owner only, the image is what every board gets flashed with
+    for (tries = 0; tries < SHARED_OPEN_TRIES; tries++)
+    {
+        s->fd = shm_open(s->name, O_CREAT | O_RDWR, 0600);
+        if (s->fd < 0)
+            break;
+        // unlinked while this process waited for the lock, open the name again
+        if (flock(s->fd, LOCK_EX) == 0 && fstat(s->fd, &st) == 0 && shared_linked(s))
+            break;
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->fd < 0)
+    {
+        fprintf(stderr, "shared image %s error %d\n", s->name, errno);
+        free(s);
+        return -1;
+    }
+    *shared = s;
+
+    if (st.st_size < SHARED_HEADER_SIZE)
+        return 0;
+
+    map = mmap(NULL, SHARED_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    s->header = map;
+    h = &s->header->image;
+
+    // a publisher that died mid write leaves it not ready, it is published again
+    if (memcmp(s->header->magic, SHARED_MAGIC, sizeof(s->header->magic)) != 0 || s->header->version != SHARED_VERSION ||
+        !s->header->ready || h->prg_size != bootinfo->ulMcuSize.fValue || h->block_size != bootinfo->uiEraseBlock.fValue.intVal ||
+        strcmp(h->digest, digest) != 0 || (off_t)(SHARED_HEADER_SIZE + h->prg_size + CONF_BUFFER_SIZE + h->block_size) > st.st_size)
+        return 0;
+
+    if (shared_attach(s->header) < 0 || shared_view(s, image) < 0)
+    {
+        shared_release(s);
+        *shared = NULL;
+        return -1;
+    }
+    flock(s->fd, LOCK_UN);
+
+#if DEBUG == 2
+    printf("shared image %s : %u users\n", s->name, s->header->user_count);
+#endif
+    return 1;
+}
+
+/*
+ * Copy a freshly conditioned image into the segment and switch image
+ * over to reading it, its own buffers are freed. The lock taken by
+ * shared_open() is dropped, waiting processes map it from here on.
+ *
+ * return: 0 on success, -1 on failure (image is untouched)
+ */
+int shared_publish(TSharedImage *shared, THexImage *image)
+{
+    size_t size = (size_t)image->prg_size + CONF_BUFFER_SIZE + image->block_size;
+    TSharedHeader *header = NULL;
+    THexImage view;
+    uint8_t *map = NULL;
+
+    if (image->prg == NULL || image->prg_blocks != NULL || image->window != NULL)
+        return -1;
+
+    if (shared->header != NULL)
+        munmap(shared->header, SHARED_HEADER_SIZE);
+    shared->header = NULL;
+
+    if (ftruncate(shared->fd, SHARED_HEADER_SIZE + size) < 0 ||
+        (map = mmap(NULL, SHARED_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "shared image %s publish error %d\n", shared->name, errno);
+        return -1;
+    }
+
+    header = (TSharedHeader *)map;
+    header->ready = 0;
+    memcpy(map + SHARED_HEADER_SIZE, image->prg, image->prg_size);
+    memcpy(map + SHARED_HEADER_SIZE + image->prg_size, image->conf, CONF_BUFFER_SIZE);
+    memcpy(map + SHARED_HEADER_SIZE + image->prg_size + CONF_BUFFER_SIZE, image->boot, image->block_size);
+
+    memset(&header->image, 0, sizeof(header->image));
+    memcpy(header->image.magic, CACHE_MAGIC, sizeof(header->image.magic));
+    header->image.version = CACHE_VERSION;
+    header->image.prg_size = image->prg_size;
+    header->image.block_size = image->block_size;
+    header->image.boot_address = image->boot_address;
+    header->image.prg_mem_count = image->prg_mem_count;
+    header->image.conf_mem_count = image->conf_mem_count;
+    header->image.file_size = image->file_size;
+    header->image.prg_len = image->prg_size;
+    header->image.conf_len = CONF_BUFFER_SIZE;
+    memcpy(header->image.digest, image->digest, sizeof(header->image.digest));
+
+    // users of a stale segment are gone or never got the image
+    memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+    header->version = SHARED_VERSION;
+    header->user_count = 0;
+    header->users[header->user_count++] = getpid();
+    header->ready = 1;
+    munmap(map, SHARED_HEADER_SIZE + size);
+
+    shared->header = mmap(NULL, SHARED_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0);
+    if (shared->header == MAP_FAILED)
+    {
+        shared->header = NULL;
+        return -1;
+    }
+    if (shared_view(shared, &view) < 0)
+        return -1;
+    free_hex_image(image);
+    memcpy(image, &view, sizeof(THexImage));
+    flock(shared->fd, LOCK_UN);
+
+#if DEBUG == 2
+    printf("shared image %s published : [%u]\n", shared->name, (uint32_t)size);
+#endif
+    return 0;
+}
+
+// leave the segment, the last user unlinks it
+void shared_release(TSharedImage *shared)
+{
+    struct stat st;
+    uint32_t i = 0;
+    int last = 1;
+
+    if (shared == NULL)
+        return;
+    if (shared->data != NULL)
+        munmap(shared->data, shared->data_size);
+
+    flock(shared->fd, LOCK_EX);
+    if (shared->header == NULL && fstat(shared->fd, &st) == 0 && st.st_size >= SHARED_HEADER_SIZE)
+    {
+        shared->header = mmap(NULL, SHARED_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0);
+        if (shared->header == MAP_FAILED)
+            shared->header = NULL;
+    }
+
+    // a segment nobody finished publishing is unlinked as well
+    if (shared->header != NULL && memcmp(shared->header->magic, SHARED_MAGIC, sizeof(shared->header->magic)) == 0)
+    {
+        for (i = 0; i < shared->header->user_count && i < SHARED_MAX_USERS; i++)
+        {
+            if (shared->header->users[i] == getpid())
+            {
+                shared->header->users[i] = shared->header->users[--shared->header->user_count];
+                break;
+            }
+        }
+        shared_prune(shared->header);
+        last = shared->header->user_count == 0;
+    }
+    // a newer segment may have taken the name since this one was unlinked
+    if (last && shared_linked(shared))
+    {
+        shm_unlink(shared->name);
+#if DEBUG == 2
+        printf("shared image %s unlinked\n", shared->name);
+#endif
+    }
+
+    if (shared->header != NULL)
+        munmap(shared->header, SHARED_HEADER_SIZE);
+    flock(shared->fd, LOCK_UN);
+    close(shared->fd);
+    free(shared);
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "Stats.h"
+
+static int latency_bucket(uint64_t us)
+{
+    int msb = 0;
+    int bucket = 0;
+
+    if (us < 64)
+        return (int)us;
+
+    msb = 63 - __builtin_clzll(us);
+    bucket = 64 + (msb - 6) * 32 + (int)((us >> (msb - 5)) & 31);
+    return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// lower edge of a bucket in us
+static uint64_t latency_bucket_value(int bucket)
+{
+    int msb = 0;
+
+    if (bucket < 64)
+        return (uint64_t)bucket;
+
+    msb = (bucket - 64) / 32 + 6;
+    return (uint64_t)(32 + (bucket - 64) % 32) << (msb - 5);
+}
+
+void latency_reset(TLatencyStats *st)
+{
+    memset(st, 0, sizeof(TLatencyStats));
+}
+
+void latency_add(TLatencyStats *st, uint64_t ns)
+{
+    double us = (double)ns / 1000.0;
+
+    if (st->count == 0 || ns < st->min_ns)
+        st->min_ns = ns;
+    if (ns > st->max_ns)
+        st->max_ns = ns;
+
+    st->count++;
+    st->sum_ns += ns;
+    st->sum_sq_us += us * us;
+    st->buckets[latency_bucket(ns / 1000)]++;
+}
+
+void latency_merge(TLatencyStats *dst, const TLatencyStats *src)
+{
+    int i = 0;
+
+    if (src->count == 0)
+        return;
+    if (dst->count == 0 || src->min_ns < dst->min_ns)
+        dst->min_ns = src->min_ns;
+    if (src->max_ns > dst->max_ns)
+        dst->max_ns = src->max_ns;
+
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    dst->sum_sq_us += src->sum_sq_us;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+// pct 0..100, returns us
+uint64_t latency_percentile(const TLatencyStats *st, double pct)
+{
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    int i = 0;
+
+    if (st->count == 0)
+        return 0;
+
+    target = (uint64_t)ceil(pct / 100.0 * st->count);
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += st->buckets[i];
+        if (seen >= target)
+            return latency_bucket_value(i);
+    }
+    return st->max_ns / 1000;
+}
+
+double latency_stddev(const TLatencyStats *st)
+{
+    double mean = 0.0;
+    double var = 0.0;
+
+    if (st->count < 2)
+        return 0.0;
+
+    mean = (double)st->sum_ns / 1000.0 / st->count;
+    var = st->sum_sq_us / st->count - mean * mean;
+    return (var > 0.0) ? sqrt(var) : 0.0;
+}
+
+void latency_print(const char *label, const TLatencyStats *st)
+{
+    uint64_t p50 = latency_percentile(st, 50.0);
+    uint64_t p99 = latency_percentile(st, 99.0);
+
+    if (st->count == 0)
+    {
+        fprintf(stderr, "%s: no samples\n", label);
+        return;
+    }
+
+    fprintf(stderr, "%s [us]: n=%u min=%.1f p50=%lu p99=%lu max=%.1f mean=%.1f sd=%.1f spread(p99-p50)=%lu\n",
+            label, st->count,
+            (double)st->min_ns / 1000.0, (unsigned long)p50, (unsigned long)p99, (double)st->max_ns / 1000.0,
+            (double)st->sum_ns / 1000.0 / st->count, latency_stddev(st), (unsigned long)(p99 - p50));
+}
@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "Stream.h"
+#include "USB.h"
+#include "HexFile.h"
+#include "Region.h"
+
+// compiled streams while any session holds them, only touched from the thread driving the sessions
+static TPacketStream *streams[MAX_STREAMS];
+
+void stream_key(char *key, size_t size, const char *digest, const TBootInfo *bootinfo, uint16_t report_size, const TRegionSelect *select)
+{
+    snprintf(key, size, "%s-%x-%x-%x-%x-%u-%x-%x-%s", digest, bootinfo->ulMcuSize.fValue, bootinfo->uiEraseBlock.fValue.intVal,
+             bootinfo->uiWriteBlock.fValue.intVal, bootinfo->ulBootStart.fValue, report_size, select->start, select->end, select->name);
+}
+
+// return: number of streams sessions could share
+int stream_shared(void)
+{
+    int count = 0;
+    int i = 0;
+
+    for (i = 0; i < MAX_STREAMS; i++)
+        count += (streams[i] != NULL);
+    return count;
+}
+
+// return: the stream compiled for key with a reference taken, NULL = none
+TPacketStream *stream_find(const char *key)
+{
+    int i = 0;
+
+    for (i = 0; i < MAX_STREAMS; i++)
+    {
+        if (streams[i] != NULL && strcmp(streams[i]->key, key) == 0)
+        {
+            streams[i]->refs++;
+            return streams[i];
+        }
+    }
+    return NULL;
+}
+
+static char *stream_frame(TPacketStream *stream, TCmd cmd, uint8_t out_only)
+{
+    char *frame = stream->frames + (size_t)stream->count * stream->report_size;
+
+    stream->marks[stream->count].cmd = (uint8_t)cmd;
+    stream->marks[stream->count].out_only = out_only;
+    stream->count++;
+    return frame;
+}
+
+// reports the regions with something to write take, erase, write + pages, re-boot
+static uint32_t stream_count(const TRegionList *regions, const THexImage *image, uint16_t report_size)
+{
+    const TRegion *r = NULL;
+    uint32_t count = 1;
+    int i = 0;
+
+    for (i = 0; i < regions->count; i++)
+    {
+        r = &regions->items[i];
+        if (!region_changed(r, image, NULL))
+            continue;
+        count += (r->erase == erBLOCKS) ? 1 : 0;
+        count += (r->size / r->page_size) * (1 + r->page_size / report_size);
+    }
+    return count;
+}
+
+/*
+ * Frame the regions of a complete image as the session would send them,
+ * regions with nothing to write are left out. The stream is registered
+ * under key for stream_find(), the caller holds the one reference.
+ *
+ * return: the stream, NULL if out of memory or regions have hooks
+ */
+TPacketStream *stream_compile(const char *key, const TRegionList *regions, const THexImage *image, uint16_t report_size)
+{
+    TPacketStream *stream = NULL;
+    const TRegion *r = NULL;
+    const uint8_t *src = NULL;
+    uint32_t address = 0;
+    uint32_t offset = 0;
+    uint32_t page = 0;
+    uint32_t k = 0;
+    uint16_t size = 0;
+    char *frame = NULL;
+    int slot = -1;
+    int i = 0;
+
+    // a hook may change bytes per device
+    for (i = 0; i < regions->count; i++)
+    {
+        if (regions->items[i].hook != NULL)
+            return NULL;
+    }
+
+    stream = calloc(1, sizeof(TPacketStream));
+    if (stream == NULL)
+        return NULL;
+    snprintf(stream->key, sizeof(stream->key), "%s", key);
+    stream->report_size = report_size;
+    stream->refs = 1;
+    stream->count = stream_count(regions, image, report_size);
+    stream->frames = calloc(stream->count, report_size);
+    stream->marks = calloc(stream->count, sizeof(TStreamMark));
+    if (stream->frames == NULL || stream->marks == NULL)
+    {
+        fprintf(stderr, "Out of memory for the packet stream!\n");
+        free(stream->frames);
+        free(stream->marks);
+        free(stream);
+        return NULL;
+    }
+    stream->count = 0;
+
+    for (i = 0; i < regions->count; i++)
+    {
+        r = &regions->items[i];
+        if (!region_changed(r, image, NULL))
+            continue;
+
+        if (r->erase == erBLOCKS)
+        {
+            frame = stream_frame(stream, cmdERASE, 0);
+            boot_frame_command(frame, cmdERASE, report_size);
+            memcpy(frame + 2, &r->erase_address, sizeof(uint32_t));
+            memcpy(frame + 6, &r->erase_blocks, sizeof(int16_t));
+        }
+
+        size = (uint16_t)r->page_size;
+        for (page = 0; page < r->size / r->page_size; page++)
+        {
+            address = r->base + page * r->page_size;
+            frame = stream_frame(stream, cmdWRITE, 1);
+            boot_frame_command(frame, cmdWRITE, report_size);
+            memcpy(frame + 2, &address, sizeof(uint32_t));
+            memcpy(frame + 6, &size, sizeof(int16_t));
+
+            // a report never crosses an erase block, copied blocks are whole
+            for (k = 0; k < r->page_size; k += report_size)
+            {
+                offset = r->offset + page * r->page_size + k;
+                src = hex_image_data(image, r->source, offset);
+                frame = stream_frame(stream, cmdHEX, (k + report_size < r->page_size) ? 1 : 0);
+                memcpy(frame, src, report_size);
+            }
+        }
+    }
+
+    frame = stream_frame(stream, cmdREBOOT, 2);
+    boot_frame_command(frame, cmdREBOOT, report_size);
+
+    for (i = 0; i < MAX_STREAMS && slot < 0; i++)
+    {
+        if (streams[i] == NULL)
+            slot = i;
+    }
+    if (slot >= 0)
+        streams[slot] = stream;
+    return stream;
+}
+
+// drop a reference, the last one frees the stream
+void stream_release(TPacketStream *stream)
+{
+    int i = 0;
+
+    if (stream == NULL || --stream->refs > 0)
+        return;
+
+    for (i = 0; i < MAX_STREAMS; i++)
+    {
+        if (streams[i] == stream)
+            streams[i] = NULL;
+    }
+    free(stream->frames);
+    free(stream->marks);
+    free(stream);
+}
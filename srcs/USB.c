@@ -12,6 +12,9 @@
 #include "USB.h"
 #include "Types.h"
 #include "HexFile.h"
+#include "Utils.h"
+#include "Metrics.h"
+#include "Capture.h"
 
 // 1 = print out info relating to usb transfers
 #define DEBUG 1
@@ -29,16 +32,46 @@ static const int HID_REPORT_TYPE_FEATURE = 0x03;
 
 // With firmware support, transfers can be > the endpoint's max packet size.
 
-static const int TIMEOUT_MS = 5000;
+const int INTERFACE_NUMBER = 0;
+const int TIMEOUT_MS = 5000;
+
+// per packet dumps, off while probing
+static uint8_t trace = 1;
+
+// Assumes interrupt endpoint 2 IN and OUT:
+static const int INTERRUPT_IN_ENDPOINT = 0x81;
+static const int INTERRUPT_OUT_ENDPOINT = 0x01;
+
+// One blocking transfer, answered by libusb or a loaded replay, captured when enabled.
+// Returns - zero on success, libusb error code on failure.
+static int interrupt_transfer(libusb_device_handle *devh, unsigned char endpoint, char *data, int size, int *bytes_transferred)
+{
+    uint8_t in = (endpoint & LIBUSB_ENDPOINT_IN) ? 1 : 0;
+    uint64_t submitted = time_now_ns();
+    int result = 0;
+
+    *bytes_transferred = 0;
+    if (replay_active())
+    {
+        result = replay_transfer(in, data, size);
+        if (result >= 0)
+        {
+            *bytes_transferred = result;
+            result = 0;
+        }
+    }
+    else
+        result = libusb_interrupt_transfer(devh, endpoint, (unsigned char *)data, size, bytes_transferred, TIMEOUT_MS);
+
+    capture_record(in, submitted, time_now_ns(), (result < 0) ? result : *bytes_transferred, data, size);
+    metrics_transfer(in, (result < 0) ? result : *bytes_transferred);
+    return result;
+}
 
 // Use interrupt transfers to to write data to the device and receive data from the device.
 // Returns - zero on success, libusb error code on failure.
 int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *data_out, uint8_t out_only)
 {
-    // Assumes interrupt endpoint 2 IN and OUT:
-    static const int INTERRUPT_IN_ENDPOINT = 0x81;
-    static const int INTERRUPT_OUT_ENDPOINT = 0x01;
-
     // With firmware support, transfers can be > the endpoint's max packet size.
     int bytes_transferred;
     int i = 0;
@@ -46,23 +79,23 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
 
     // Write data to the device.
 
-    result = libusb_interrupt_transfer(
+    result = interrupt_transfer(
         devh,
         INTERRUPT_OUT_ENDPOINT,
         data_out,
         MAX_INTERRUPT_OUT_TRANSFER_SIZE,
-        &bytes_transferred,
-        TIMEOUT_MS);
+        &bytes_transferred);
 
     if (result >= 0 | out_only == 1)
     {
 #if DEBUG == 1
         //  printf("Data sent via interrupt transfer:\n");
-        for (i = 0; i < bytes_transferred; i++)
+        for (i = 0; trace && i < bytes_transferred; i++)
         {
             printf("%02x ", data_out[i] & 0xff);
         }
-        printf("\n");
+        if (trace)
+            printf("\n");
 #endif
 
         if (out_only > 0)
@@ -70,13 +103,12 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
 
         // Read data from the device.
 
-        result = libusb_interrupt_transfer(
+        result = interrupt_transfer(
             devh,
             INTERRUPT_IN_ENDPOINT,
             data_in,
             MAX_INTERRUPT_OUT_TRANSFER_SIZE,
-            &bytes_transferred,
-            TIMEOUT_MS);
+            &bytes_transferred);
 
         if (result >= 0)
         {
@@ -84,11 +116,12 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
             {
 #if DEBUG == 1
                 // printf("Data received via interrupt transfer:\n");
-                for (i = 0; i < bytes_transferred; i++)
+                for (i = 0; trace && i < bytes_transferred; i++)
                 {
                     printf("%02x ", data_in[i] & 0xff);
                 }
-                printf("\n");
+                if (trace)
+                    printf("\n");
 #endif
             }
             else
@@ -114,3 +147,356 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
     }
     return 0;
 }
+
+void boot_transfer_trace(uint8_t on)
+{
+    trace = on;
+}
+
+// [STX][cmd] followed by a zeroed report of size bytes
+void boot_frame_command(char *data_out, TCmd cmd, uint16_t size)
+{
+    data_out[0] = 0x0f;
+    data_out[1] = (char)cmd;
+    memset(data_out + 2, 0, size - 2);
+}
+
+/*
+ * Size the largest Input and Output report of a HID report descriptor,
+ * Report Size x Report Count bits per main item summed per report ID.
+ * Report Size, Count and ID are global items, Push / Pop save them.
+ * Returns - 1 if the descriptor numbers its reports, 0 otherwise.
+ */
+static int parse_report_descriptor(const uint8_t *desc, int len, uint32_t *out_bytes, uint32_t *in_bytes)
+{
+    uint32_t out_bits[256];
+    uint32_t in_bits[256];
+    uint32_t stack[4][3];
+    uint32_t report_size = 0;
+    uint32_t report_count = 0;
+    uint32_t report_id = 0;
+    uint32_t value = 0;
+    uint8_t numbered = 0;
+    uint8_t prefix = 0;
+    int depth = 0;
+    int size = 0;
+    int i = 0;
+    int k = 0;
+
+    memset(out_bits, 0, sizeof(out_bits));
+    memset(in_bits, 0, sizeof(in_bits));
+
+    while (i < len)
+    {
+        prefix = desc[i++];
+
+        // long item, bDataSize follows the prefix
+        if (prefix == 0xfe)
+        {
+            if (i >= len)
+                break;
+            i += 2 + desc[i];
+            continue;
+        }
+
+        size = prefix & 0x03;
+        size = (size == 3) ? 4 : size;
+        for (value = 0, k = 0; k < size && i + k < len; k++)
+            value |= (uint32_t)desc[i + k] << (8 * k);
+        i += size;
+
+        switch (prefix & 0xfc)
+        {
+        case 0x74: // Report Size
+            report_size = value;
+            break;
+        case 0x94: // Report Count
+            report_count = value;
+            break;
+        case 0x84: // Report ID
+            report_id = value & 0xff;
+            numbered = 1;
+            break;
+        case 0xa4: // Push
+            if (depth < 4)
+            {
+                stack[depth][0] = report_size;
+                stack[depth][1] = report_count;
+                stack[depth][2] = report_id;
+                depth++;
+            }
+            break;
+        case 0xb4: // Pop
+            if (depth > 0)
+            {
+                depth--;
+                report_size = stack[depth][0];
+                report_count = stack[depth][1];
+                report_id = stack[depth][2];
+            }
+            break;
+        case 0x80: // Input
+            in_bits[report_id] += report_size * report_count;
+            break;
+        case 0x90: // Output
+            out_bits[report_id] += report_size * report_count;
+            break;
+        default:
+            break;
+        }
+    }
+
+    *out_bytes = 0;
+    *in_bytes = 0;
+    for (k = 0; k < 256; k++)
+    {
+        if ((out_bits[k] + 7) / 8 > *out_bytes)
+            *out_bytes = (out_bits[k] + 7) / 8;
+        if ((in_bits[k] + 7) / 8 > *in_bytes)
+            *in_bytes = (in_bits[k] + 7) / 8;
+    }
+    return numbered;
+}
+
+/*
+ * Size the interrupt reports from the claimed interface, the HID report
+ * descriptors Output / Input report lengths when it has them and does not
+ * number its reports (the frames carry no report ID byte), otherwise the
+ * endpoints wMaxPacketSize times the high-bandwidth transactions per
+ * microframe. A report longer than the endpoint packet goes out as one
+ * multi-packet transfer. OUT is rounded down to a power of two so the
+ * flash pages slice evenly.
+ * Returns - zero on success, libusb error code on failure, sizes stay 64.
+ */
+int boot_report_negotiate(libusb_device_handle *devh, uint16_t *out_size, uint16_t *in_size)
+{
+    struct libusb_config_descriptor *config = NULL;
+    const struct libusb_interface_descriptor *alt = NULL;
+    const struct libusb_endpoint_descriptor *ep = NULL;
+    uint8_t desc[1024];
+    uint32_t ep_out = MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+    uint32_t ep_in = MAX_INTERRUPT_IN_TRANSFER_SIZE;
+    uint32_t report_out = 0;
+    uint32_t report_in = 0;
+    uint32_t size = 0;
+    uint16_t desc_len = sizeof(desc);
+    int result = 0;
+    int i = 0;
+
+    *out_size = MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+    *in_size = MAX_INTERRUPT_IN_TRANSFER_SIZE;
+
+    result = libusb_get_active_config_descriptor(libusb_get_device(devh), &config);
+    if (result < 0)
+    {
+        fprintf(stderr, "libusb_get_active_config_descriptor error %d\n", result);
+        return result;
+    }
+
+    if (INTERFACE_NUMBER < config->bNumInterfaces && config->interface[INTERFACE_NUMBER].num_altsetting > 0)
+    {
+        alt = &config->interface[INTERFACE_NUMBER].altsetting[0];
+        for (i = 0; i < alt->bNumEndpoints; i++)
+        {
+            ep = &alt->endpoint[i];
+            size = (ep->wMaxPacketSize & 0x7ff) * (((ep->wMaxPacketSize >> 11) & 0x03) + 1);
+            if (ep->bEndpointAddress == INTERRUPT_IN_ENDPOINT)
+                ep_in = size;
+            else if (ep->bEndpointAddress == INTERRUPT_OUT_ENDPOINT)
+                ep_out = size;
+        }
+
+        // HID class descriptor, wDescriptorLength of the report descriptor
+        if (alt->extra_length >= 9 && alt->extra[1] == 0x21 && alt->extra[6] == 0x22)
+            desc_len = alt->extra[7] | (alt->extra[8] << 8);
+    }
+    libusb_free_config_descriptor(config);
+
+    if (desc_len > sizeof(desc))
+        desc_len = sizeof(desc);
+
+    result = libusb_control_transfer(
+        devh,
+        LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE,
+        LIBUSB_REQUEST_GET_DESCRIPTOR,
+        (0x22 << 8),
+        INTERFACE_NUMBER,
+        desc,
+        desc_len,
+        TIMEOUT_MS);
+    if (result > 0)
+    {
+        if (parse_report_descriptor(desc, result, &report_out, &report_in))
+        {
+            fprintf(stderr, "HID reports are numbered (out %u in %u), using wMaxPacketSize\n", report_out, report_in);
+            report_out = 0;
+            report_in = 0;
+        }
+    }
+    else
+        fprintf(stderr, "No HID report descriptor (%d), using wMaxPacketSize\n", result);
+
+    size = (report_out > 0) ? report_out : ep_out;
+    if (size > MAX_INTERRUPT_REPORT_SIZE)
+        size = MAX_INTERRUPT_REPORT_SIZE;
+    for (*out_size = MAX_INTERRUPT_OUT_TRANSFER_SIZE; *out_size * 2 <= size; *out_size *= 2)
+        ;
+
+    size = (report_in > 0) ? report_in : ep_in;
+    *in_size = (size > MAX_INTERRUPT_REPORT_SIZE) ? MAX_INTERRUPT_REPORT_SIZE : size;
+    if (*in_size < MAX_INTERRUPT_IN_TRANSFER_SIZE)
+        *in_size = MAX_INTERRUPT_IN_TRANSFER_SIZE;
+
+    printf("report size out %u in %u : endpoint %u / %u\n", *out_size, *in_size, ep_out, ep_in);
+    return 0;
+}
+
+// Translate an async completion into the same result codes the synchronous path returns.
+static void LIBUSB_CALL boot_transfer_cb(struct libusb_transfer *xfer)
+{
+    TUsbTransfer *t = xfer->user_data;
+    unsigned char *data = xfer->buffer;
+    int length = xfer->length;
+    int result = xfer->actual_length;
+    int i = 0;
+
+    // the report follows the setup packet
+    if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+    {
+        data = libusb_control_transfer_get_data(xfer);
+        length -= LIBUSB_CONTROL_SETUP_SIZE;
+    }
+
+    switch (xfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        result = LIBUSB_ERROR_TIMEOUT;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        result = LIBUSB_ERROR_INTERRUPTED;
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        result = LIBUSB_ERROR_NO_DEVICE;
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        result = LIBUSB_ERROR_PIPE;
+        break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        result = LIBUSB_ERROR_OVERFLOW;
+        break;
+    default:
+        result = LIBUSB_ERROR_IO;
+        break;
+    }
+
+    capture_record(xfer->endpoint & LIBUSB_ENDPOINT_IN, t->submitted, time_now_ns(), result, (char *)data, length);
+    metrics_transfer(xfer->endpoint & LIBUSB_ENDPOINT_IN, result);
+
+#if DEBUG == 1
+    for (i = 0; trace && i < result; i++)
+    {
+        printf("%02x ", data[i] & 0xff);
+    }
+    if (trace && result > 0)
+        printf("\n");
+#endif
+
+    t->done(t, result);
+}
+
+// Returns - zero on success, libusb error code on failure.
+int boot_transfer_alloc(TUsbTransfer *t, TUsbDone done, void *user_data)
+{
+    t->xfer = libusb_alloc_transfer(0);
+    // the control path allocates nothing once flashing has started
+    t->setup = malloc(LIBUSB_CONTROL_SETUP_SIZE + MAX_INTERRUPT_REPORT_SIZE);
+    if (t->xfer == NULL || t->setup == NULL)
+    {
+        boot_transfer_free(t);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    t->done = done;
+    t->user_data = user_data;
+    return 0;
+}
+
+void boot_transfer_free(TUsbTransfer *t)
+{
+    if (t->xfer != NULL)
+        libusb_free_transfer(t->xfer);
+    t->xfer = NULL;
+    free(t->setup);
+    t->setup = NULL;
+}
+
+/*
+ * Queue one report of size bytes on the interrupt endpoint and return straight away,
+ * no timeout is set on the transfer the caller owns the deadline.
+ * Returns - zero on success, libusb error code on failure.
+ */
+int boot_interrupt_submit(TUsbTransfer *t, libusb_device_handle *devh, uint8_t in, char *data, uint16_t size)
+{
+    libusb_fill_interrupt_transfer(
+        t->xfer,
+        devh,
+        in ? INTERRUPT_IN_ENDPOINT : INTERRUPT_OUT_ENDPOINT,
+        (unsigned char *)data,
+        size,
+        boot_transfer_cb,
+        t,
+        0);
+
+    t->submitted = time_now_ns();
+    if (replay_active())
+        return replay_submit(t, in, data, size);
+    return libusb_submit_transfer(t->xfer);
+}
+
+/*
+ * Queue one report as a HID SET_REPORT (Output) on endpoint 0, not tied
+ * to the interrupt endpoints polling interval. The setup packet and a
+ * copy of the report share the buffer boot_transfer_alloc() set aside.
+ * Returns - zero on success, libusb error code on failure.
+ */
+int boot_control_submit(TUsbTransfer *t, libusb_device_handle *devh, char *data, uint16_t size)
+{
+    if (size > MAX_INTERRUPT_REPORT_SIZE)
+        return LIBUSB_ERROR_OVERFLOW;
+
+    libusb_fill_control_setup(t->setup, CONTROL_REQUEST_TYPE_OUT, HID_SET_REPORT, HID_REPORT_TYPE_OUTPUT << 8, INTERFACE_NUMBER, size);
+    memcpy(t->setup + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+    libusb_fill_control_transfer(t->xfer, devh, t->setup, boot_transfer_cb, t, 0);
+
+    t->submitted = time_now_ns();
+    if (replay_active())
+        return replay_submit(t, 0, data, size);
+    return libusb_submit_transfer(t->xfer);
+}
+
+int boot_transfer_cancel(TUsbTransfer *t)
+{
+    return libusb_cancel_transfer(t->xfer);
+}
+
+// "bus-port.port..." for the device and for the hub it hangs off
+void boot_device_topology(libusb_device *dev, char *board, char *hub, size_t size)
+{
+    uint8_t ports[MAX_PORT_DEPTH];
+    int n = libusb_get_port_numbers(dev, ports, MAX_PORT_DEPTH);
+    size_t len = 0;
+    int i = 0;
+
+    len = snprintf(board, size, "%u-", libusb_get_bus_number(dev));
+    for (i = 0; i < n && len < size; i++)
+        len += snprintf(board + len, size - len, (i == 0) ? "%u" : ".%u", ports[i]);
+
+    // boards on a root port share the root hub
+    snprintf(hub, size, "%s", board);
+    if (n > 1)
+        *strrchr(hub, '.') = '\0';
+    else
+        snprintf(hub, size, "%u-root", libusb_get_bus_number(dev));
+}
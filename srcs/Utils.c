@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
 
 #include "Types.h"
 #include "Utils.h"
@@ -60,4 +61,20 @@ uint32_t transform_2words_long(uint16_t a, uint16_t b)
     uint16_t temp16 = a;
     uint32_t temp32 = (a & 0xffff) << 16;
     return temp32 |= b;
-}
\ No newline at end of file
+}
+
+// monotonic clock in milliseconds, used for transfer deadlines
+uint64_t time_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)(ts.tv_nsec / 1000000);
+}
+
+// monotonic clock in nanoseconds, used for latency measurement
+uint64_t time_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,467 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Validate.h"
+#include "HexFile.h"
+#include "Window.h"
+#include "Types.h"
+
+// ':' + count, address, type and checksum as digits
+#define RECORD_MIN_DIGITS 11
+#define RECORD_MAX_BYTES (255 + 5)
+
+/*
+ * Pre-flight check of a hex file against a device profile, one pass over
+ * the mapped file with a digit table, then the data extents are sorted
+ * and swept for overlaps. Every problem is reported, nothing is flashed
+ * if there are any.
+ */
+typedef struct
+{
+  const char *path;
+  uint32_t flash_end;  // first physical address past program flash
+  uint32_t boot_start; // boot start up page, the bootloader sits above it
+  uint32_t root_address;
+  uint8_t eof;
+  int problems;
+
+  THexInterval *intervals;
+  uint32_t count;
+  uint32_t cap;
+  uint8_t streamed; // --window, program flash overlaps are checked per block, data is copied
+} TValidate;
+
+// digit value + 1, 0 = not a hex digit, constant so sessions on any thread share it
+static const uint8_t hex_digit[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16};
+
+static void validate_problem(TValidate *v, uint32_t line, const char *fmt, uint32_t a, uint32_t b, uint32_t c)
+{
+    fprintf(stderr, "%s:%u: ", v->path, line);
+    fprintf(stderr, fmt, a, b, c);
+    fputc('\n', stderr);
+    v->problems++;
+}
+
+static void validate_bounds(TValidate *v, uint32_t line, uint32_t start, uint32_t end)
+{
+    if (start >= _PIC32Mn_STARTFLASH && end <= v->flash_end)
+    {
+        if (end > v->boot_start)
+            validate_problem(v, line, "%08x..%08x collides with the bootloader from %08x", start, end, v->boot_start);
+    }
+    else if (start < _PIC32Mn_STARTCONF || end > _PIC32Mn_STARTCONF + CONF_BUFFER_SIZE)
+        validate_problem(v, line, "%08x..%08x is outside program flash (%08x) and config", start, end, v->flash_end);
+}
+
+static int validate_add(TValidate *v, uint32_t line, uint32_t start, uint32_t count, const char *data)
+{
+    THexInterval *grown = NULL;
+    char *copy = NULL;
+
+    if (v->count == v->cap)
+    {
+        v->cap = v->cap ? v->cap * 2 : 1024;
+        grown = realloc(v->intervals, v->cap * sizeof(THexInterval));
+        if (grown == NULL)
+            return -1;
+        v->intervals = grown;
+    }
+    // a streamed line buffer is reused, only config and stray records are kept
+    if (v->streamed)
+    {
+        copy = malloc(count * 2);
+        if (copy == NULL)
+            return -1;
+        memcpy(copy, data, count * 2);
+        data = copy;
+    }
+    v->intervals[v->count].start = start;
+    v->intervals[v->count].end = start + count;
+    v->intervals[v->count].line = line;
+    v->intervals[v->count].data = data;
+    v->count++;
+    return 0;
+}
+
+// one line without its line end
+static int validate_record(TValidate *v, uint32_t line, const char *p, size_t len)
+{
+    uint8_t rec[RECORD_MAX_BYTES];
+    uint32_t n = 0;
+    uint32_t i = 0;
+    uint8_t sum = 0;
+    int8_t hi = 0, lo = 0;
+
+    if (len == 0)
+        return 0;
+
+    if (p[0] != ':')
+    {
+        validate_problem(v, line, "record doesn't start with ':'", 0, 0, 0);
+        return 0;
+    }
+    if (len < RECORD_MIN_DIGITS || (len - 1) % 2 != 0 || (len - 1) / 2 > RECORD_MAX_BYTES)
+    {
+        validate_problem(v, line, "record length of %u characters", (uint32_t)len, 0, 0);
+        return 0;
+    }
+
+    for (n = 0, i = 1; i < len; i += 2, n++)
+    {
+        hi = hex_digit[(unsigned char)p[i]] - 1;
+        lo = hex_digit[(unsigned char)p[i + 1]] - 1;
+        if ((hi | lo) < 0)
+        {
+            validate_problem(v, line, "not a hex digit at column %u", (hi < 0) ? i + 1 : i + 2, 0, 0);
+            return 0;
+        }
+        rec[n] = (uint8_t)(hi << 4 | lo);
+        sum += rec[n];
+    }
+
+    if (rec[0] + 5u != n)
+    {
+        validate_problem(v, line, "byte count %u, the record holds %u", rec[0], n - 5, 0);
+        return 0;
+    }
+    if (sum != 0)
+        validate_problem(v, line, "checksum %02x, expected %02x", rec[n - 1], (uint8_t)(rec[n - 1] - sum), 0);
+
+    if (v->eof)
+    {
+        validate_problem(v, line, "record after the end of file, the loader stops before it", 0, 0, 0);
+        return 0;
+    }
+
+    switch (rec[3])
+    {
+    case 0x00:
+        if (rec[0] == 0)
+            break;
+        validate_bounds(v, line, v->root_address + (rec[1] << 8 | rec[2]), v->root_address + (rec[1] << 8 | rec[2]) + rec[0]);
+        if (v->streamed && v->root_address + (rec[1] << 8 | rec[2]) >= _PIC32Mn_STARTFLASH && v->root_address + (rec[1] << 8 | rec[2]) < v->flash_end)
+            break;
+        return validate_add(v, line, v->root_address + (rec[1] << 8 | rec[2]), rec[0], p + 9);
+    case 0x01:
+        v->eof = 1;
+        break;
+    case 0x02:
+    case 0x04:
+        if (rec[0] != 2)
+        {
+            validate_problem(v, line, "address record with %u data bytes", rec[0], 0, 0);
+            break;
+        }
+        // the loader takes both as the upper 16 bits of a linear address
+        if (rec[3] == 0x02 && (rec[4] | rec[5]) != 0)
+            validate_problem(v, line, "segment address %04x, only linear addresses are supported", rec[4] << 8 | rec[5], 0, 0);
+        v->root_address = (uint32_t)(rec[4] << 8 | rec[5]) << 16 | (rec[1] << 8 | rec[2]);
+        break;
+    case 0x03:
+    case 0x05:
+        break;
+    default:
+        validate_problem(v, line, "unknown record type %02x", rec[3], 0, 0);
+        break;
+    }
+    return 0;
+}
+
+static int interval_cmp(const void *a, const void *b)
+{
+    const THexInterval *ia = a;
+    const THexInterval *ib = b;
+
+    if (ia->start != ib->start)
+        return (ia->start < ib->start) ? -1 : 1;
+    return (ia->line < ib->line) ? -1 : (ia->line > ib->line);
+}
+
+/*
+ * Sort the extents by start and sweep, anything starting before the
+ * furthest end so far overlaps. The same bytes twice is a duplicate,
+ * otherwise the later line in the file wins in the loader.
+ */
+static void validate_overlaps(TValidate *v)
+{
+    const THexInterval *prev = NULL;
+    const THexInterval *cur = NULL;
+    uint32_t i = 0;
+
+    qsort(v->intervals, v->count, sizeof(THexInterval), interval_cmp);
+
+    for (i = 1, prev = v->intervals; i < v->count; i++)
+    {
+        cur = &v->intervals[i];
+        if (cur->start < prev->end)
+        {
+            if (cur->start == prev->start && cur->end == prev->end &&
+                strncasecmp(cur->data, prev->data, (cur->end - cur->start) * 2) == 0)
+                validate_problem(v, (cur->line > prev->line) ? cur->line : prev->line, "duplicate of line %u", (cur->line > prev->line) ? prev->line : cur->line, 0, 0);
+            else
+                validate_problem(v, (cur->line > prev->line) ? cur->line : prev->line, "%08x..%08x overlaps line %u", cur->start,
+                                 (cur->end < prev->end) ? cur->end : prev->end, (cur->line > prev->line) ? prev->line : cur->line);
+        }
+        if (cur->end > prev->end)
+            prev = cur;
+    }
+}
+
+static void validate_init(TValidate *v, const char *path, const TBootInfo *bootinfo)
+{
+    memset(v, 0, sizeof(TValidate));
+    v->path = path;
+    v->flash_end = _PIC32Mn_STARTFLASH + bootinfo->ulMcuSize.fValue;
+    v->boot_start = (bootinfo->ulBootStart.fValue & V2P) - bootinfo->uiEraseBlock.fValue.intVal;
+}
+
+static void validate_free(TValidate *v)
+{
+    uint32_t i = 0;
+
+    for (i = 0; v->streamed && i < v->count; i++)
+        free((char *)v->intervals[i].data);
+    free(v->intervals);
+}
+
+/*
+ * Check checksums, record structure, overlapping and duplicate data and
+ * that every byte lands in the devices program flash below the bootloader
+ * or in config, problems go to stderr with their line numbers.
+ *
+ * return: number of problems, 0 = fine to flash, -1 if the file can't be read
+ */
+int hex_validate(const char *path, const TBootInfo *bootinfo)
+{
+    TValidate v;
+    struct stat st;
+    const char *map = NULL;
+    const char *p = NULL;
+    const char *end = NULL;
+    const char *eol = NULL;
+    uint32_t line = 0;
+    size_t len = 0;
+    int fd = -1;
+
+    validate_init(&v, path, bootinfo);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Could not find or open a file!!\n");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        fprintf(stderr, "%s: empty file\n", path);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    for (p = map, end = map + st.st_size; p < end; p = eol + 1)
+    {
+        line++;
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        len = eol - p;
+        if (len > 0 && p[len - 1] == '\r')
+            len--;
+        if (validate_record(&v, line, p, len) < 0)
+        {
+            fprintf(stderr, "Out of memory validating %s\n", path);
+            v.problems = -1;
+            break;
+        }
+    }
+
+    if (v.problems >= 0)
+    {
+        if (!v.eof)
+            validate_problem(&v, line, "no end of file record", 0, 0, 0);
+        validate_overlaps(&v);
+    }
+
+    validate_free(&v);
+    munmap((void *)map, st.st_size);
+    return v.problems;
+}
+
+// a record overlapping earlier lines in one erase block, reported once per line
+static void validate_block_record(TValidate *v, uint32_t line, uint32_t prev, uint32_t lo, uint32_t hi, int duplicate)
+{
+    if (duplicate)
+        validate_problem(v, line, "duplicate of line %u", prev, 0, 0);
+    else
+        validate_problem(v, line, "%08x..%08x overlaps line %u", lo, hi, prev);
+}
+
+/*
+ * The overlap sweep for program flash without an interval per record,
+ * the window's runs are read back an erase block at a time and each byte
+ * remembers the line that wrote it last. A record that only repeats one
+ * earlier lines bytes is a duplicate, anything else overlaps.
+ *
+ * return: 0 on success, -1 on failure
+ */
+static int validate_blocks(TValidate *v, THexWindow *w)
+{
+    THexCursor cursor = {0};
+    uint8_t line[HEX_LINE_BYTES];
+    uint32_t *owner = malloc(w->block_size * sizeof(uint32_t));
+    uint8_t *value = malloc(w->block_size);
+    const THexRun *r = NULL;
+    uint32_t block = WINDOW_NO_BLOCK;
+    uint32_t reported = 0;
+    uint32_t line_no = 0;
+    uint32_t address = 0;
+    uint32_t offset = 0;
+    uint32_t start = 0;
+    uint32_t prev = 0;
+    uint32_t lo = 0, hi = 0;
+    uint32_t hits = 0;
+    uint32_t bytes = 0;
+    uint32_t k = 0;
+    uint8_t count = 0;
+    uint8_t same = 0;
+    size_t cap = 0;
+    ssize_t len = 0;
+    char *text = NULL;
+    int result = 0;
+
+    if (owner == NULL || value == NULL)
+        result = -1;
+
+    for (r = w->runs; result == 0 && r < w->runs + w->run_count; r++)
+    {
+        if (r->block != block)
+        {
+            block = r->block;
+            start = _PIC32Mn_STARTFLASH + block * w->block_size;
+            memset(owner, 0, w->block_size * sizeof(uint32_t));
+        }
+        if (fseek(w->fp, r->offset, SEEK_SET) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        cursor.root_address = r->root;
+        for (offset = r->offset, line_no = r->line; offset < r->end && (len = getline(&text, &cap, w->fp)) >= 0; offset += len, line_no++)
+        {
+            hex_line_decode(text, line, sizeof(line));
+            if (hex_record_locate(line, &cursor, &address, &count) != 0x00)
+                continue;
+
+            for (hits = 0, bytes = 0, same = 1, k = 0; k < count; k++, address++)
+            {
+                if (address - start >= w->block_size)
+                    continue;
+                bytes++;
+                if (owner[address - start] != 0)
+                {
+                    if (hits++ == 0)
+                    {
+                        prev = owner[address - start];
+                        lo = address;
+                    }
+                    hi = address + 1;
+                    same &= (owner[address - start] == prev && value[address - start] == line[k + sizeof(_HEX_REPORT_)]);
+                }
+                owner[address - start] = line_no;
+                value[address - start] = line[k + sizeof(_HEX_REPORT_)];
+            }
+
+            // a line over two blocks shows up in both
+            if (hits > 0 && line_no != reported)
+            {
+                validate_block_record(v, line_no, prev, lo, hi, same && hits == bytes);
+                reported = line_no;
+            }
+        }
+        if (offset < r->end)
+            result = -1;
+    }
+
+    free(text);
+    free(owner);
+    free(value);
+    return result;
+}
+
+/*
+ * hex_validate() for --window, memory stays bounded like the window's:
+ * the open file is streamed a line at a time, config and stray records
+ * are swept as usual and program flash per erase block from w's runs.
+ *
+ * return: number of problems, 0 = fine to flash, -1 if the file can't be read
+ */
+int hex_validate_window(const char *path, const TBootInfo *bootinfo, THexWindow *w)
+{
+    TValidate v;
+    uint32_t line = 0;
+    size_t cap = 0;
+    ssize_t len = 0;
+    char *text = NULL;
+
+    validate_init(&v, path, bootinfo);
+    v.streamed = 1;
+
+    rewind(w->fp);
+    while ((len = getline(&text, &cap, w->fp)) >= 0)
+    {
+        line++;
+        if (len > 0 && text[len - 1] == '\n')
+            len--;
+        if (len > 0 && text[len - 1] == '\r')
+            len--;
+        if (validate_record(&v, line, text, (size_t)len) < 0)
+        {
+            fprintf(stderr, "Out of memory validating %s\n", path);
+            v.problems = -1;
+            break;
+        }
+    }
+    free(text);
+
+    if (v.problems >= 0 && line == 0)
+    {
+        fprintf(stderr, "%s: empty file\n", path);
+        v.problems = 1;
+    }
+    else if (v.problems >= 0)
+    {
+        if (!v.eof)
+            validate_problem(&v, line, "no end of file record", 0, 0, 0);
+        validate_overlaps(&v);
+        if (ferror(w->fp) || validate_blocks(&v, w) < 0)
+        {
+            fprintf(stderr, "Could not read %s back\n", path);
+            v.problems = -1;
+        }
+    }
+
+    validate_free(&v);
+    return v.problems;
+}
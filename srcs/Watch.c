@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "Watch.h"
+#include "Cache.h"
+
+#define WATCH_BUFFER_SIZE 4096
+
+// a build has finished writing a hex, or moved one into place
+static int watch_is_hex(const struct inotify_event *ev)
+{
+    size_t len = 0;
+
+    if (ev->len == 0 || (ev->mask & IN_ISDIR))
+        return 0;
+    len = strlen(ev->name);
+    return len > 4 && strcasecmp(ev->name + len - 4, ".hex") == 0;
+}
+
+/*
+ * Watch build output directories and condition every hex file closed
+ * after writing into the image cache, for every device profile the cache
+ * knows, so the next flash of it starts without a parse. Runs until
+ * killed or the watch fails.
+ *
+ * return: -1 on failure
+ */
+int watch_run(char dirs[][250], int count, const char *cache_dir)
+{
+    char buf[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[CACHE_PATH_SIZE];
+    const struct inotify_event *ev = NULL;
+    int wds[MAX_WATCH_DIRS];
+    ssize_t len = 0;
+    char *p = NULL;
+    int fd = 0;
+    int i = 0;
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "inotify_init1 error %d\n", errno);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        wds[i] = inotify_add_watch(fd, dirs[i], IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wds[i] < 0)
+        {
+            fprintf(stderr, "Unable to watch %s: %s\n", dirs[i], strerror(errno));
+            close(fd);
+            return -1;
+        }
+        printf("watching %s\n", dirs[i]);
+    }
+
+    for (;;)
+    {
+        len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+        {
+            fprintf(stderr, "inotify read error %d\n", errno);
+            break;
+        }
+
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event *)p;
+            if (!watch_is_hex(ev))
+                continue;
+
+            for (i = 0; i < count && wds[i] != ev->wd; i++)
+                ;
+            if (i == count)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", dirs[i], ev->name);
+            cache_warm(cache_dir, path);
+            fflush(stdout);
+        }
+    }
+
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "Window.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+// 2 = index and materialize info
+#define DEBUG 2
+
+static int run_cmp(const void *a, const void *b)
+{
+    const THexRun *ra = a;
+    const THexRun *rb = b;
+
+    if (ra->block != rb->block)
+        return (ra->block < rb->block) ? -1 : 1;
+    return (ra->offset < rb->offset) ? -1 : (ra->offset > rb->offset);
+}
+
+// line at offset..end writes to block, extend the blocks run or start one
+static int window_note(THexWindow *w, uint32_t *last, uint32_t block, uint32_t offset, uint32_t end, uint32_t prev_end, uint32_t root, uint32_t line)
+{
+    THexRun *runs = NULL;
+    THexRun *r = NULL;
+
+    // still the line after the runs last one, nothing else was written in between
+    if (last[block] != WINDOW_NO_BLOCK && w->runs[last[block]].end == prev_end)
+    {
+        w->runs[last[block]].end = end;
+        return 0;
+    }
+
+    // a file in address order needs about one run per block
+    if (w->run_count == w->run_cap)
+    {
+        runs = realloc(w->runs, (w->run_cap + 64) * sizeof(THexRun));
+        if (runs == NULL)
+            return -1;
+        w->runs = runs;
+        w->run_cap += 64;
+    }
+
+    r = &w->runs[w->run_count];
+    r->block = block;
+    r->offset = offset;
+    r->end = end;
+    r->root = root;
+    r->line = line;
+    last[block] = w->run_count++;
+    return 0;
+}
+
+/*
+ * One pass, program flash lines are indexed into runs, config lines are
+ * applied to the one config row that gets flashed.
+ *
+ * return: 0 on success, -1 on failure
+ */
+static int window_index(THexWindow *w, THexImage *image, uint32_t conf_size)
+{
+    THexCursor cursor = {0};
+    uint8_t line[HEX_LINE_BYTES];
+    uint32_t *last = NULL;
+    uint32_t blocks = w->prg_size / w->block_size;
+    uint32_t offset = 0;
+    uint32_t prev_end = 0;
+    uint32_t address = 0;
+    uint32_t root = 0;
+    uint32_t block = 0;
+    uint32_t line_no = 0;
+    uint32_t k = 0;
+    uint8_t count = 0;
+    uint8_t report = 0;
+    size_t cap = 0;
+    ssize_t len = 0;
+    char *text = NULL;
+    int result = 0;
+
+    last = malloc(blocks * sizeof(uint32_t));
+    if (last == NULL)
+        return -1;
+    for (block = 0; block < blocks; block++)
+        last[block] = WINDOW_NO_BLOCK;
+
+    for (; result == 0 && (len = getline(&text, &cap, w->fp)) >= 0; offset += len)
+    {
+        line_no++;
+        hex_line_decode(text, line, sizeof(line));
+        root = cursor.root_address;
+        report = hex_record_locate(line, &cursor, &address, &count);
+        if (report == 0x01)
+            break;
+        if (report != 0x00 || count == 0)
+            continue;
+
+        if (address >= _PIC32Mn_STARTFLASH && address - _PIC32Mn_STARTFLASH < w->prg_size)
+        {
+            address -= _PIC32Mn_STARTFLASH;
+            for (block = address / w->block_size; result == 0 && block <= (address + count - 1) / w->block_size && block < blocks; block++)
+                result = window_note(w, last, block, offset, offset + len, prev_end, root, line_no);
+            prev_end = offset + len;
+        }
+        else if (address >= _PIC32Mn_STARTCONF)
+        {
+            // only the first row is ever written
+            for (k = 0; k < count && address - _PIC32Mn_STARTCONF + k < conf_size; k++)
+                image->conf[address - _PIC32Mn_STARTCONF + k] = line[k + sizeof(_HEX_REPORT_)];
+        }
+    }
+    free(text);
+    free(last);
+
+    image->prg_mem_count = cursor.prg_mem_count;
+    image->conf_mem_count = cursor.conf_mem_count;
+    qsort(w->runs, w->run_count, sizeof(THexRun), run_cmp);
+
+#if DEBUG == 2
+    printf("window index %u runs : %u blocks of %u : %u slots\n", w->run_count, blocks, w->block_size, w->slot_count);
+#endif
+    return (result < 0 || ferror(w->fp)) ? -1 : 0;
+}
+
+// same inode, size and mtime as st, a rebuild in place shows up here
+static int window_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Is the open file still the one indexed, a file replaced under its
+ * name is fine, the open one is read.
+ *
+ * return: 1 = unchanged, 0 = rewritten since
+ */
+int hex_window_unchanged(const THexWindow *w)
+{
+    struct stat st;
+
+    return fstat(fileno(w->fp), &st) == 0 && window_same(&st, &w->st);
+}
+
+/*
+ * Index path, keep it open and size the image without holding program
+ * flash, image->prg stays NULL and hex_image_data() reads the window.
+ *
+ * return: the file size as condition_hexfile_data() does, 0 on failure
+ */
+uint32_t hex_window_open(THexImage *image, const char *path, TBootInfo *bootinfo, uint32_t slots)
+{
+    THexWindow *w = calloc(1, sizeof(THexWindow));
+    uint32_t conf_size = bootinfo->uiWriteBlock.fValue.intVal;
+    struct stat st;
+    uint32_t i = 0;
+
+    memset(image, 0, sizeof(THexImage));
+    if (w == NULL)
+        return 0;
+    image->window = w;
+    image->prg_size = bootinfo->ulMcuSize.fValue;
+    image->block_size = bootinfo->uiEraseBlock.fValue.intVal;
+
+    w->prg_size = image->prg_size;
+    w->block_size = image->block_size;
+    w->slot_count = (slots < 1) ? 1 : slots;
+    w->slots = malloc((size_t)w->slot_count * w->block_size);
+    w->slot_block = malloc(w->slot_count * sizeof(uint32_t));
+
+    // the start up line is moved out of config data, 16 bytes at least
+    image->conf = malloc((conf_size < 16) ? 16 : conf_size);
+    image->owned = IMAGE_OWNS_CONF;
+    if (w->slots == NULL || w->slot_block == NULL || image->conf == NULL)
+    {
+        fprintf(stderr, "Out of memory for the image!\n");
+        free_hex_image(image);
+        return 0;
+    }
+    memset(image->conf, 0xff, (conf_size < 16) ? 16 : conf_size);
+    for (i = 0; i < w->slot_count; i++)
+        w->slot_block[i] = WINDOW_NO_BLOCK;
+
+    w->fp = fopen(path, "r");
+    if (w->fp == NULL)
+    {
+        fprintf(stderr, "Could not find or open a file!!\n");
+        free_hex_image(image);
+        return 0;
+    }
+
+    if (fstat(fileno(w->fp), &w->st) < 0 || window_index(w, image, conf_size) < 0 || digest_file(path, image->digest) != 0)
+    {
+        fprintf(stderr, "Could not index %s\n", path);
+        free_hex_image(image);
+        return 0;
+    }
+
+    // the digest is of the name, both have to be the file that was indexed
+    if (!hex_window_unchanged(w) || stat(path, &st) < 0 || !window_same(&st, &w->st))
+    {
+        fprintf(stderr, "%s changed while it was indexed\n", path);
+        free_hex_image(image);
+        return 0;
+    }
+
+    // pre-condition the boot start up page and config vector for bootloading
+    overwrite_bootflash_program(image, bootinfo);
+
+    image->file_size = (uint32_t)st.st_size;
+    return image->file_size;
+}
+
+// parse a blocks runs into dst, lines are read again from the file
+static int window_parse(THexWindow *w, uint32_t block, uint8_t *dst)
+{
+    THexCursor cursor = {0};
+    uint8_t line[HEX_LINE_BYTES];
+    uint32_t lo = 0, hi = w->run_count;
+    uint32_t start = block * w->block_size;
+    uint32_t address = 0;
+    uint32_t offset = 0;
+    uint32_t k = 0;
+    uint8_t count = 0;
+    size_t cap = 0;
+    ssize_t len = 0;
+    char *text = NULL;
+    const THexRun *r = NULL;
+
+    memset(dst, 0xff, w->block_size);
+
+    // a half written rebuild is never flashed
+    if (!hex_window_unchanged(w))
+    {
+        fprintf(stderr, "hex file changed since it was indexed\n");
+        return -1;
+    }
+
+    // first run of the block
+    while (lo < hi)
+    {
+        if (w->runs[(lo + hi) / 2].block < block)
+            lo = (lo + hi) / 2 + 1;
+        else
+            hi = (lo + hi) / 2;
+    }
+
+    for (r = &w->runs[lo]; r < w->runs + w->run_count && r->block == block; r++)
+    {
+        if (fseek(w->fp, r->offset, SEEK_SET) != 0)
+            break;
+        cursor.root_address = r->root;
+        for (offset = r->offset; offset < r->end && (len = getline(&text, &cap, w->fp)) >= 0; offset += len)
+        {
+            hex_line_decode(text, line, sizeof(line));
+            if (hex_record_locate(line, &cursor, &address, &count) != 0x00)
+                continue;
+
+            // a line may run over either end of the block
+            for (k = 0; k < count; k++, address++)
+            {
+                if (address - _PIC32Mn_STARTFLASH - start < w->block_size)
+                    dst[address - _PIC32Mn_STARTFLASH - start] = line[k + sizeof(_HEX_REPORT_)];
+            }
+        }
+        if (offset < r->end)
+            break;
+    }
+    free(text);
+
+    w->parsed++;
+    return (r < w->runs + w->run_count && r->block == block) ? -1 : 0;
+}
+
+/*
+ * The slot holding block, parsed into the oldest slot if no slot has it.
+ * Good until slot_count other blocks have been asked for.
+ *
+ * return: the block, NULL if it couldn't be read
+ */
+uint8_t *hex_window_block(THexWindow *w, uint32_t block)
+{
+    uint8_t *dst = NULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < w->slot_count; i++)
+    {
+        if (w->slot_block[i] == block)
+            return w->slots + (size_t)i * w->block_size;
+    }
+
+    i = w->next_slot;
+    w->next_slot = (w->next_slot + 1) % w->slot_count;
+    dst = w->slots + (size_t)i * w->block_size;
+    w->slot_block[i] = WINDOW_NO_BLOCK;
+    if (window_parse(w, block, dst) < 0)
+    {
+        fprintf(stderr, "Could not read erase block %u back\n", block);
+        return NULL;
+    }
+    w->slot_block[i] = block;
+    return dst;
+}
+
+// does any line write to [offset, offset + size) of program flash
+int hex_window_touched(const THexWindow *w, uint32_t offset, uint32_t size)
+{
+    uint32_t first = offset / w->block_size;
+    uint32_t last = (offset + size - 1) / w->block_size;
+    uint32_t i = 0;
+
+    if (size == 0)
+        return 0;
+    for (i = 0; i < w->run_count; i++)
+    {
+        if (w->runs[i].block >= first && w->runs[i].block <= last)
+            return 1;
+    }
+    return 0;
+}
+
+void hex_window_free(THexWindow *w)
+{
+    if (w == NULL)
+        return;
+#if DEBUG == 2
+    printf("window parsed %u blocks\n", w->parsed);
+#endif
+    if (w->fp != NULL)
+        fclose(w->fp);
+    free(w->runs);
+    free(w->slots);
+    free(w->slot_block);
+    free(w);
+}
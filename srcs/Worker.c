@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Worker.h"
+#include "Coordinator.h"
+#include "Session.h"
+#include "Capture.h"
+#include "Cache.h"
+#include "Digest.h"
+#include "Options.h"
+#include "Metrics.h"
+#include "Utils.h"
+
+// 2 = board selection
+#define DEBUG 2
+
+typedef struct
+{
+  int fd;
+  FILE *in;
+} TWorkerLink;
+
+// boards flashed lately, not taken again until they leave or their window passes
+typedef struct
+{
+  char path[WORKER_MAX_RECENT][WORKER_PATH_SIZE]; // bus-port.port...
+  uint64_t done_ms[WORKER_MAX_RECENT];
+  uint8_t seen[WORKER_MAX_RECENT]; // still on the bus in the last scan
+  int count;
+} TWorkerRecent;
+
+static int worker_recent_find(const TWorkerRecent *recent, const char *board)
+{
+    int i = 0;
+
+    for (i = 0; i < recent->count; i++)
+    {
+        if (strcmp(recent->path[i], board) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// drop the boards that have left the bus or whose window has passed
+static void worker_recent_expire(TWorkerRecent *recent)
+{
+    int i = 0;
+
+    while (i < recent->count)
+    {
+        if (!recent->seen[i] || time_now_ms() - recent->done_ms[i] >= WORKER_STARTUP_MS)
+        {
+            recent->count--;
+            memcpy(recent->path[i], recent->path[recent->count], WORKER_PATH_SIZE);
+            recent->done_ms[i] = recent->done_ms[recent->count];
+            recent->seen[i] = recent->seen[recent->count];
+        }
+        else
+            i++;
+    }
+}
+
+static void worker_recent_add(TWorkerRecent *recent, const char *board)
+{
+    int i = worker_recent_find(recent, board);
+
+    // full, the oldest entry goes
+    if (i < 0 && recent->count == WORKER_MAX_RECENT)
+    {
+        recent->count--;
+        memmove(recent->path[0], recent->path[1], (size_t)recent->count * WORKER_PATH_SIZE);
+        memmove(&recent->done_ms[0], &recent->done_ms[1], recent->count * sizeof(uint64_t));
+        memmove(&recent->seen[0], &recent->seen[1], recent->count);
+    }
+    if (i < 0)
+        i = recent->count++;
+    snprintf(recent->path[i], WORKER_PATH_SIZE, "%s", board);
+    recent->done_ms[i] = time_now_ms();
+    recent->seen[i] = 1;
+}
+
+// address = "ip:port", return: 0 on success, -1 on failure
+static int worker_connect(TWorkerLink *link, const char *address)
+{
+    struct sockaddr_in addr = {0};
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+
+    if (colon != NULL)
+    {
+        if ((size_t)(colon - address) >= sizeof(host))
+            return -1;
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        address = colon + 1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(address));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "worker: bad coordinator address %s\n", host);
+        return -1;
+    }
+
+    link->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (link->fd < 0)
+        return -1;
+    if (connect(link->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || (link->in = fdopen(link->fd, "r")) == NULL)
+    {
+        fprintf(stderr, "worker: unable to reach %s:%s (%s)\n", host, address, strerror(errno));
+        close(link->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// one request line out, its reply line back without the newline
+static int worker_request(TWorkerLink *link, const char *request, char *reply, size_t size)
+{
+    size_t len = strlen(request);
+
+    if (write(link->fd, request, len) != (ssize_t)len || fgets(reply, size, link->in) == NULL)
+    {
+        fprintf(stderr, "worker: coordinator went away\n");
+        return -1;
+    }
+    reply[strcspn(reply, "\r\n")] = '\0';
+    return 0;
+}
+
+/*
+ * The image for a digest, from the cache directory when an earlier job
+ * fetched it, otherwise fetched once and checked against its digest.
+ *
+ * return: 0 on success, -1 on failure
+ */
+static int worker_image(TWorkerLink *link, const char *digest, char *path, size_t size)
+{
+    char request[COORD_LINE_SIZE];
+    char reply[COORD_LINE_SIZE];
+    char tmp[CACHE_PATH_SIZE + 16];
+    char check[DIGEST_HEX_SIZE];
+    char buf[4096];
+    unsigned long left = 0;
+    FILE *fp = NULL;
+    size_t n = 0;
+
+    snprintf(path, size, "%s/%s.hex", options.cache, digest);
+    if (digest_file(path, check) == 0 && strcmp(check, digest) == 0)
+        return 0;
+
+    snprintf(request, sizeof(request), "FETCH %s\n", digest);
+    if (worker_request(link, request, reply, sizeof(reply)) < 0)
+        return -1;
+    if (sscanf(reply, "IMAGE %64s %lu", check, &left) != 2 || strcmp(check, digest) != 0)
+    {
+        fprintf(stderr, "worker: no image %s (%s)\n", digest, reply);
+        return -1;
+    }
+
+    // written aside and renamed, a half fetched file is never picked up
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fp = fopen(tmp, "wb");
+    while (left > 0 && (n = fread(buf, 1, (left < sizeof(buf)) ? left : sizeof(buf), link->in)) > 0)
+    {
+        if (fp != NULL && fwrite(buf, 1, n, fp) != n)
+        {
+            fclose(fp);
+            fp = NULL;
+        }
+        left -= n;
+    }
+    if (fp == NULL || fclose(fp) != 0 || left > 0 || digest_file(tmp, check) != 0 || strcmp(check, digest) != 0 || rename(tmp, path) != 0)
+    {
+        fprintf(stderr, "worker: fetch of %s failed\n", digest);
+        unlink(tmp);
+        return -1;
+    }
+    printf("worker: fetched %s\n", digest);
+    return 0;
+}
+
+/*
+ * A bootloader on a port not flashed lately, opened and claimed. A flashed
+ * board re-enumerates as the bootloader after cmdREBOOT, its port is only
+ * taken again once it has dropped off the bus or WORKER_STARTUP_MS has
+ * passed. A board another worker on this host has claimed is passed over.
+ *
+ * return: the claimed board, NULL if there is none yet
+ */
+static libusb_device_handle *worker_board(libusb_context *ctx, uint16_t vid, uint16_t pid, TWorkerRecent *recent, char *board, size_t size)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device **list = NULL;
+    libusb_device_handle *devh = NULL;
+    char path[WORKER_PATH_SIZE];
+    char hub[WORKER_PATH_SIZE];
+    ssize_t count = 0;
+    ssize_t i = 0;
+    int result = 0;
+    int k = 0;
+
+    count = libusb_get_device_list(ctx, &list);
+    if (count < 0)
+        return NULL;
+
+    // every port is looked at so boards that left are noticed
+    memset(recent->seen, 0, sizeof(recent->seen));
+    for (i = 0; i < count; i++)
+    {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+
+        boot_device_topology(list[i], path, hub, sizeof(path));
+        k = worker_recent_find(recent, path);
+        if (k >= 0)
+            recent->seen[k] = 1;
+        if (devh != NULL || (k >= 0 && time_now_ms() - recent->done_ms[k] < WORKER_STARTUP_MS))
+            continue;
+        if (libusb_open(list[i], &devh) < 0)
+        {
+            devh = NULL;
+            continue;
+        }
+
+        // busy, another process is flashing it
+        libusb_detach_kernel_driver(devh, INTERFACE_NUMBER);
+        result = libusb_claim_interface(devh, INTERFACE_NUMBER);
+        if (result < 0)
+        {
+#if DEBUG == 2
+            printf("worker: %s is busy (%d)\n", path, result);
+#endif
+            libusb_close(devh);
+            devh = NULL;
+            continue;
+        }
+        snprintf(board, size, "%s", path);
+    }
+    libusb_free_device_list(list, 1);
+
+    worker_recent_expire(recent);
+    return devh;
+}
+
+/*
+ * The next board to come up in its bootloader, or the replay standing in
+ * for it. With --patch its rows are the ones for the boards port path,
+ * patched over base so a batch of one image is parsed once.
+ */
+static int worker_flash(libusb_context *ctx, uint16_t vid, uint16_t pid, TWorkerRecent *recent, const char *path, THexImage *base)
+{
+    libusb_device_handle *devh = NULL;
+    char board[WORKER_PATH_SIZE];
+    uint8_t waiting = 0;
+    int result = 0;
+
+    if (options.replay[0] != '\0')
+    {
+        if (replay_open(options.replay, options.replay_speed) < 0)
+            return LIBUSB_ERROR_OTHER;
+        result = session_flash(NULL, path, base, options.patch_device);
+        replay_close();
+        return result;
+    }
+
+    while ((devh = worker_board(ctx, vid, pid, recent, board, sizeof(board))) == NULL)
+    {
+        if (!waiting)
+            printf("worker: waiting for a board\n");
+        waiting = 1;
+        usleep(WORKER_POLL_MS * 1000);
+    }
+
+    printf("worker: board %s\n", board);
+    result = session_flash(devh, path, base, board);
+    libusb_release_interface(devh, INTERFACE_NUMBER);
+    libusb_close(devh);
+
+    // re-booted into the application, it comes back as the bootloader first
+    if (result == 0)
+        worker_recent_add(recent, board);
+    return result;
+}
+
+/*
+ * Take jobs from the coordinator until it says END, each one is a
+ * board flashed with the image the job names, the result goes back.
+ *
+ * return: 0 after END, -1 if the coordinator was lost
+ */
+int worker_run(libusb_context *ctx, const char *address, uint16_t vid, uint16_t pid)
+{
+    TWorkerLink link = {-1, NULL};
+    TWorkerRecent recent;
+    THexImage base;
+    char base_digest[DIGEST_HEX_SIZE] = {0};
+    char request[COORD_LINE_SIZE];
+    char reply[COORD_LINE_SIZE];
+    char digest[DIGEST_HEX_SIZE];
+    char path[CACHE_PATH_SIZE];
+    char host[COORD_HOST_SIZE] = {0};
+    unsigned long size = 0;
+    uint64_t started = 0;
+    int flashed = 0;
+    int result = 0;
+    int job = 0;
+    int id = 0;
+    int ms = 0;
+
+    memset(&recent, 0, sizeof(recent));
+    memset(&base, 0, sizeof(base));
+    if (worker_connect(&link, address) < 0)
+        return -1;
+
+    // host and pid, so several workers on one machine stay apart
+    gethostname(host, sizeof(host) - 12);
+    snprintf(request, sizeof(request), "HELLO %s/%d\n", host, (int)getpid());
+    result = worker_request(&link, request, reply, sizeof(reply));
+    if (result == 0 && sscanf(reply, "WORKER %d", &id) != 1)
+        result = -1;
+    if (result == 0)
+        printf("worker %d on %s\n", id, address);
+
+    while (result == 0 && (result = worker_request(&link, "NEXT\n", reply, sizeof(reply))) == 0)
+    {
+        if (strcmp(reply, "END") == 0)
+            break;
+        if (sscanf(reply, "WAIT %d", &ms) == 1)
+        {
+            usleep(ms * 1000);
+            continue;
+        }
+        if (sscanf(reply, "JOB %d %64s %lu", &job, digest, &size) != 3)
+        {
+            fprintf(stderr, "worker: bad reply %s\n", reply);
+            result = -1;
+            break;
+        }
+
+        // a job that can't get its image fails like any other
+        started = time_now_ms();
+        if (worker_image(&link, digest, path, sizeof(path)) < 0)
+            flashed = LIBUSB_ERROR_IO;
+        else
+        {
+            // the base is parsed again when the batch moves to another image
+            if (strcmp(digest, base_digest) != 0)
+            {
+                free_hex_image(&base);
+                snprintf(base_digest, sizeof(base_digest), "%s", digest);
+            }
+            flashed = worker_flash(ctx, vid, pid, &recent, path, &base);
+        }
+
+        if (options.metrics_file[0] != '\0')
+            metrics_write_textfile(options.metrics_file);
+
+        snprintf(request, sizeof(request), "DONE %d %d %u\n", job, flashed, (unsigned int)(time_now_ms() - started));
+        result = worker_request(&link, request, reply, sizeof(reply));
+    }
+
+    fclose(link.in);
+    free_hex_image(&base);
+    return result;
+}